@@ -0,0 +1,293 @@
+#include "bench.h"
+#include "ibf.h"
+#include "util.h"
+#include "keydb.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include <openssl/sha.h>
+
+#define BENCH_ELEMENTS (1024*256)
+#define BENCH_SUBTRACT_CELLS (1024*1024*16)
+/* Scans are far slower, so fewer of them are timed. */
+#define BENCH_LOOKUPS 10000
+#define BENCH_SCAN_LOOKUPS 100
+/* User ID queries are this long, or the whole user ID if shorter. */
+#define BENCH_UID_QUERY 6
+
+/* Fills elements with n distinct pseudo-random hashes. */
+void
+bench_elements(fp160 *elements, int n) {
+    int i;
+    uint8_t seed[4];
+
+    for (i=0; i<n; i++) {
+        seed[0] = i>>24; seed[1] = i>>16; seed[2] = i>>8; seed[3] = i;
+        SHA1(seed, 4, elements[i]);
+    }
+}
+
+/* Filters as they were laid out before buckets became records: counts,
+ * element sums and SHA1 hash sums in three arrays, hashed with the SHA1
+ * scheme. Kept only so that the layouts can be compared. */
+struct bench_legacy_ibf_t {
+    int32_t *counts;
+    fp160   *id_sums;
+    fp160   *hash_sums;
+    int      k;
+    size_t   N;
+};
+
+void
+bench_legacy_free(struct bench_legacy_ibf_t *filter) {
+    if (!filter)
+        return;
+    free(filter->counts);
+    free(filter->id_sums);
+    free(filter->hash_sums);
+    free(filter);
+}
+
+struct bench_legacy_ibf_t *
+bench_legacy_allocate(int k, size_t N) {
+    struct bench_legacy_ibf_t *filter;
+
+    filter = calloc(1, sizeof(struct bench_legacy_ibf_t));
+    if (!filter) return NULL;
+    filter->counts = calloc(N, sizeof(int32_t));
+    filter->id_sums = calloc(N, sizeof(fp160));
+    filter->hash_sums = calloc(N, sizeof(fp160));
+    if (!filter->counts || !filter->id_sums || !filter->hash_sums) {
+        bench_legacy_free(filter);
+        return NULL;
+    }
+    filter->k = k;
+    filter->N = N;
+    return filter;
+}
+
+void
+bench_legacy_insert(struct bench_legacy_ibf_t *filter, const fp160 element) {
+    uint8_t buf[28];
+    fp160 hash_val, probe;
+    uint64_t key;
+    int i, j;
+
+    SHA1(element, 20, hash_val);
+    memcpy(buf, element, 20);
+    for (i=0; i<filter->k; i++) {
+        for (j=0; j<8; j++)
+            buf[20+j] = ((uint64_t)i>>(56-8*j))&0xFF;
+        SHA1(buf, 28, probe);
+        for (key=j=0; j<8; j++)
+            key = key<<8 | probe[8-j];
+        key %= filter->N;
+
+        filter->counts[key]++;
+        for (j=0; j<20; j++) {
+            filter->id_sums[key][j] ^= element[j];
+            filter->hash_sums[key][j] ^= hash_val[j];
+        }
+    }
+}
+
+void
+bench_legacy_subtract(struct bench_legacy_ibf_t *filter_A,
+                      const struct bench_legacy_ibf_t *filter_B) {
+    size_t i;
+    int j;
+
+    for (i=0; i<filter_A->N; i++) {
+        filter_A->counts[i] -= filter_B->counts[i];
+        for (j=0; j<20; j++) {
+            filter_A->id_sums[i][j] ^= filter_B->id_sums[i][j];
+            filter_A->hash_sums[i][j] ^= filter_B->hash_sums[i][j];
+        }
+    }
+}
+
+/* Times insert and subtract at every ladder size with the legacy layout,
+ * for comparison with IBF_HASH_SHA1 filters. */
+void
+bench_ibf_legacy(fp160 *elements) {
+    struct bench_legacy_ibf_t *filter_A, *filter_B;
+    uint64_t start, ins_time, sub_time;
+    size_t N;
+    int i, j, reps;
+
+    printf("Legacy layout, hashing scheme %d:\n", IBF_HASH_SHA1);
+    printf("%8s %14s %14s\n", "buckets", "inserts/s", "buckets sub/s");
+    for (i=0; i<BLOOM_MAX_COUNT; i++) {
+        N = IBF_MIN_SIZE<<i;
+        filter_A = bench_legacy_allocate(BLOOM_HASH, N);
+        filter_B = bench_legacy_allocate(BLOOM_HASH, N);
+        if (!filter_A || !filter_B) {
+            printf("Error allocating filters.\n");
+            bench_legacy_free(filter_A);
+            bench_legacy_free(filter_B);
+            return;
+        }
+
+        start = us_timestamp();
+        for (j=0; j<BENCH_ELEMENTS; j++)
+            bench_legacy_insert(filter_A, elements[j]);
+        ins_time = us_timestamp() - start;
+
+        reps = BENCH_SUBTRACT_CELLS/N;
+        start = us_timestamp();
+        for (j=0; j<reps; j++)
+            bench_legacy_subtract(filter_B, filter_A);
+        sub_time = us_timestamp() - start;
+
+        printf("%8lu %14.0f %14.0f\n", N,
+                BENCH_ELEMENTS*1e6/(ins_time ? ins_time : 1),
+                (double)reps*N*1e6/(sub_time ? sub_time : 1));
+
+        bench_legacy_free(filter_A);
+        bench_legacy_free(filter_B);
+    }
+}
+
+/* Times insert and subtract at every ladder size using hashing scheme v. */
+void
+bench_ibf_scheme(fp160 *elements, int v) {
+    struct inv_bloom_t *filter_A, *filter_B;
+    uint64_t start, ins_time, sub_time;
+    size_t N;
+    int i, j, reps;
+
+    printf("Hashing scheme %d:\n", v);
+    printf("%8s %14s %14s\n", "buckets", "inserts/s", "buckets sub/s");
+    for (i=0; i<BLOOM_MAX_COUNT; i++) {
+        N = IBF_MIN_SIZE<<i;
+        filter_A = ibf_allocate(BLOOM_HASH, N, v);
+        filter_B = ibf_allocate(BLOOM_HASH, N, v);
+        if (!filter_A || !filter_B) {
+            printf("Error allocating filters.\n");
+            ibf_free(filter_A);
+            ibf_free(filter_B);
+            return;
+        }
+
+        start = us_timestamp();
+        for (j=0; j<BENCH_ELEMENTS; j++)
+            ibf_insert(filter_A, elements[j]);
+        ins_time = us_timestamp() - start;
+
+        /* Subtract the same total number of buckets at every size. */
+        reps = BENCH_SUBTRACT_CELLS/N;
+        start = us_timestamp();
+        for (j=0; j<reps; j++)
+            ibf_subtract(filter_B, filter_A);
+        sub_time = us_timestamp() - start;
+
+        printf("%8lu %14.0f %14.0f\n", N,
+                BENCH_ELEMENTS*1e6/(ins_time ? ins_time : 1),
+                (double)reps*N*1e6/(sub_time ? sub_time : 1));
+
+        ibf_free(filter_A);
+        ibf_free(filter_B);
+    }
+}
+
+void
+bench_ibf() {
+    fp160 *elements;
+    const char *kernel;
+
+    kernel = ibf_kernel_check();
+    if (!kernel) {
+        printf("Bucket kernels disagree with the scalar kernel.\n");
+        return;
+    }
+    printf("Using the %s bucket kernel.\n", kernel);
+
+    elements = malloc(BENCH_ELEMENTS*sizeof(fp160));
+    if (!elements) {
+        printf("Error allocating benchmark elements.\n");
+        return;
+    }
+    bench_elements(elements, BENCH_ELEMENTS);
+
+    bench_ibf_legacy(elements);
+    bench_ibf_scheme(elements, IBF_HASH_SHA1);
+    bench_ibf_scheme(elements, IBF_HASH_FAST);
+
+    free(elements);
+}
+
+void
+bench_lookup(struct keydb_t *db) {
+    char (*queries)[4][43];
+    const char *names[4] = {"id32", "id64", "fingerprint", "uid"};
+    char uid[256];
+    uint64_t start, scan_time, idx_time, id64;
+    uint32_t id32;
+    fp160 fp;
+    size_t len, off;
+    int n_keys, i, j, n, k, mismatched;
+
+    n_keys = get_key_count(db);
+    if (!n_keys) {
+        printf("No keys to look up.\n");
+        return;
+    }
+    queries = malloc(BENCH_LOOKUPS*sizeof(*queries));
+    if (!queries) {
+        printf("Error allocating benchmark queries.\n");
+        return;
+    }
+
+    /* Look up keys that exist, chosen at random. */
+    for (i=0; i<BENCH_LOOKUPS; i++) {
+        k = lrand48()%n_keys;
+        if (get_key_ids(db, k, &id32, &id64, fp)
+                || get_key_uid(db, k, uid, sizeof(uid))) {
+            printf("Error reading key IDs.\n");
+            free(queries);
+            return;
+        }
+        sprintf(queries[i][0], "0x%08X", id32);
+        sprintf(queries[i][1], "0x%016lX", id64);
+        strcpy(queries[i][2], "0x");
+        print_fp160(fp, queries[i][2]+2);
+        /* A random piece of the user ID, upper-cased to exercise the case
+         * folding. */
+        len = strlen(uid);
+        off = len > BENCH_UID_QUERY ? lrand48()%(len-BENCH_UID_QUERY+1) : 0;
+        for (len=0; len<BENCH_UID_QUERY && uid[off+len]; len++)
+            queries[i][3][len] = toupper((unsigned char)uid[off+len]);
+        queries[i][3][len] = '\0';
+    }
+
+    printf("Lookups over %d keys:\n", n_keys);
+    printf("%12s %14s %14s\n", "query", "scan us", "indexed us");
+    for (j=0; j<4; j++) {
+        mismatched = 0;
+        start = us_timestamp();
+        for (i=0; i<BENCH_SCAN_LOOKUPS; i++)
+            count_key_matches(db, queries[i][j], 1);
+        scan_time = us_timestamp() - start;
+
+        start = us_timestamp();
+        for (i=0; i<BENCH_LOOKUPS; i++)
+            count_key_matches(db, queries[i][j], 0);
+        idx_time = us_timestamp() - start;
+
+        for (i=0; i<BENCH_SCAN_LOOKUPS; i++) {
+            n = count_key_matches(db, queries[i][j], 0);
+            if (n < 1 || n != count_key_matches(db, queries[i][j], 1))
+                mismatched++;
+        }
+
+        printf("%12s %14.2f %14.3f\n", names[j],
+                (double)scan_time/BENCH_SCAN_LOOKUPS,
+                (double)idx_time/BENCH_LOOKUPS);
+        if (mismatched)
+            printf("%d indexed lookups disagreed with the scan.\n",
+                    mismatched);
+    }
+    free(queries);
+}
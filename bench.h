@@ -0,0 +1,17 @@
+#ifndef BENCH_H_
+#define BENCH_H_
+
+#include "types.h"
+
+/* Times insertion into and subtraction of inverse bloom filters at each of
+ * the ladder sizes served by the key database, printing the results, with
+ * the bucket layout filters had before as a baseline. */
+void
+bench_ibf();
+
+/* Times ID and fingerprint lookups of random keys in db, by scanning the
+ * index and through the hash indexes, printing the results. */
+void
+bench_lookup(struct keydb_t *db);
+
+#endif
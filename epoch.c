@@ -0,0 +1,119 @@
+#include "epoch.h"
+#include <stdlib.h>
+#include <stdint.h>
+#include <pthread.h>
+
+/* Something retired, waiting for the readers that may see it to leave. */
+struct epoch_retired_t {
+    void *ptr;
+    void (*release)(void *);
+    struct epoch_retired_t *next;
+};
+
+/* Readers are counted by the parity of the epoch they entered in, and what
+ * is retired is listed by the parity of the epoch it was retired in. When
+ * the epoch moves from e to e+1, no reader of epoch e-1 is left, and only
+ * those could have reached what was retired in e-1, before it was
+ * unpublished. */
+struct epoch_t {
+    uint64_t epoch;
+    long active[2];
+    struct epoch_retired_t *retired[2];
+    pthread_mutex_t lock; /* Taken by writers only. */
+};
+
+struct epoch_t *
+epoch_allocate() {
+    struct epoch_t *epoch;
+
+    epoch = calloc(1, sizeof(struct epoch_t));
+    if (!epoch) return NULL;
+    if (pthread_mutex_init(&epoch->lock, 0)) {
+        free(epoch);
+        return NULL;
+    }
+    return epoch;
+}
+
+int
+epoch_enter(struct epoch_t *epoch) {
+    uint64_t e;
+    int token;
+
+    /* A reader counted under an epoch that has since moved on may have
+     * been missed by the writer that moved it, so it counts itself again
+     * under the new one. Nothing shared is read until it is counted. */
+    for (;;) {
+        e = __atomic_load_n(&epoch->epoch, __ATOMIC_SEQ_CST);
+        token = e & 1;
+        __atomic_add_fetch(&epoch->active[token], 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&epoch->epoch, __ATOMIC_SEQ_CST) == e)
+            return token;
+        __atomic_sub_fetch(&epoch->active[token], 1, __ATOMIC_SEQ_CST);
+    }
+}
+
+void
+epoch_exit(struct epoch_t *epoch, int token) {
+    __atomic_sub_fetch(&epoch->active[token], 1, __ATOMIC_SEQ_CST);
+}
+
+/* Releases a list of retired structures. */
+void
+epoch_release(struct epoch_retired_t *retired) {
+    struct epoch_retired_t *next;
+
+    for (; retired; retired=next) {
+        next = retired->next;
+        retired->release(retired->ptr);
+        free(retired);
+    }
+}
+
+void
+epoch_retire(struct epoch_t *epoch, void *ptr, void (*release)(void *)) {
+    struct epoch_retired_t *retired;
+    int i;
+
+    if (!ptr)
+        return;
+    /* Without memory to list it, ptr is leaked rather than released while
+     * a reader might still use it. */
+    retired = malloc(sizeof(struct epoch_retired_t));
+    if (!retired) return;
+    retired->ptr = ptr;
+    retired->release = release;
+
+    pthread_mutex_lock(&epoch->lock);
+    i = epoch->epoch & 1;
+    retired->next = epoch->retired[i];
+    epoch->retired[i] = retired;
+    pthread_mutex_unlock(&epoch->lock);
+}
+
+void
+epoch_reclaim(struct epoch_t *epoch) {
+    struct epoch_retired_t *due;
+    uint64_t e;
+
+    due = NULL;
+    pthread_mutex_lock(&epoch->lock);
+    e = epoch->epoch;
+    if (!__atomic_load_n(&epoch->active[(e-1)&1], __ATOMIC_SEQ_CST)) {
+        due = epoch->retired[(e-1)&1];
+        epoch->retired[(e-1)&1] = NULL;
+        __atomic_store_n(&epoch->epoch, e+1, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&epoch->lock);
+    epoch_release(due);
+}
+
+void
+epoch_free(struct epoch_t *epoch) {
+    if (!epoch)
+        return;
+    epoch_release(epoch->retired[0]);
+    epoch_release(epoch->retired[1]);
+    pthread_mutex_destroy(&epoch->lock);
+    free(epoch);
+}
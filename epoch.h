@@ -0,0 +1,40 @@
+#ifndef EPOCH_H_
+#define EPOCH_H_
+
+/* Epoch-based reclamation. Readers bracket their use of shared structures
+ * with epoch_enter and epoch_exit, which take no lock and never wait.
+ * A writer that replaces a structure publishes the new one and retires
+ * the old, which is only released once every reader that might still see
+ * it has left. A global epoch advances once no reader from the epoch
+ * before the current one remains, and what was retired two epochs back is
+ * then released. Retiring and reclaiming may be called from any thread. */
+struct epoch_t;
+
+/* Allocates a reclaimer with nothing retired. Returns NULL on failure. */
+struct epoch_t *
+epoch_allocate();
+
+/* Starts a read-side section, returning a token for epoch_exit. Sections
+ * may nest, and may run for as long as needed, at the cost of holding back
+ * reclamation meanwhile. */
+int
+epoch_enter(struct epoch_t *epoch);
+
+void
+epoch_exit(struct epoch_t *epoch, int token);
+
+/* Calls release on ptr once no reader in a section can still reach it,
+ * which it must no longer be reachable from for new ones. */
+void
+epoch_retire(struct epoch_t *epoch, void *ptr, void (*release)(void *));
+
+/* Advances the epoch, releasing what is due, if the readers allow it.
+ * Never waits. */
+void
+epoch_reclaim(struct epoch_t *epoch);
+
+/* Releases everything still retired. No reader may be in a section. */
+void
+epoch_free(struct epoch_t *epoch);
+
+#endif
@@ -3,43 +3,88 @@
 #include <stdlib.h>
 #include <assert.h>
 #include <string.h>
+#include <stddef.h>
+#include <pthread.h>
 
 #include <openssl/sha.h>
 
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define IBF_X86_KERNELS
+#endif
+
+#define IBF_CELL_ALIGN 64
+
+/* Binary encoding: magic, format byte, varint k, N and hashing scheme, then
+ * a varint per bucket or run of empty buckets. */
+#define IBF_BIN_MAGIC "IBFB"
+#define IBF_BIN_FORMAT 1
+
+/* Limits on filters accepted from the network. */
+#define IBF_MAX_HASH 16
+#define IBF_MAX_BUCKETS (1<<24)
+
+/* Seeds the fast checksum. Changing it changes the IBF_HASH_FAST scheme. */
+#define IBF_FAST_KEY 0x9E3779B97F4A7C15ULL
+
+/* Legacy SHA1 hash sums are 20 bytes wide; only the first 8 live in the
+ * bucket. */
+#define IBF_SHA1_TAIL 12
+
+/* A single bucket. The purity check only needs a 64-bit checksum rather
+ * than a second full sum, so a bucket is 32 bytes and two share a cache
+ * line. */
+struct ibf_cell_t {
+    int32_t  count;
+    fp160    id_sum;
+    uint64_t hash_sum;
+} __attribute__((aligned(32)));
+
 struct inv_bloom_t {
-    /* Arrays of bucket counts, xors, and xors of hashes. */
-    int32_t  *counts; 
-    fp160    *id_sums; 
-    fp160    *hash_sums; 
+    /* Array of buckets, aligned to a cache line. */
+    struct ibf_cell_t *cells;
 
     int      k; /* Number of buckets to hash each element into. */
     size_t   N; /* Total number of buckets. */
+    int      version; /* Hashing scheme, one of IBF_HASH_*. */
+
+    /* Remaining IBF_SHA1_TAIL bytes of each bucket's hash sum, kept only by
+     * legacy filters so that they can still be sent to peers that predate
+     * the compact format. Decoding never reads them. */
+    uint8_t *hash_tail;
 };
 
 /* Allocates and returns a pointer to an inverse bloom filter with the
  * requested parameters. Returns NULL in the case of failure. */
 struct inv_bloom_t *
 ibf_allocate(int    k /* Number of hashes per element */,
-             size_t N /* Number of buckets */) {
+             size_t N /* Number of buckets */,
+             int    v /* Hashing scheme */) {
     struct inv_bloom_t *filter;
 
+    if (v != IBF_HASH_SHA1 && v != IBF_HASH_FAST) return NULL;
+
     filter = malloc(sizeof(struct inv_bloom_t));
     if (!filter) goto fail;
 
     /* NULL out pointers to allow easy error handling. */
     memset(filter, 0, sizeof(struct inv_bloom_t));
 
-    filter->counts = calloc(N, sizeof(int32_t)); 
-    if (!filter->counts) goto fail;
-
-    filter->id_sums = calloc(N, sizeof(fp160));
-    if (!filter->id_sums) goto fail;
+    if (posix_memalign((void **)&filter->cells, IBF_CELL_ALIGN,
+                N*sizeof(struct ibf_cell_t))) {
+        filter->cells = NULL;
+        goto fail;
+    }
+    memset(filter->cells, 0, N*sizeof(struct ibf_cell_t));
 
-    filter->hash_sums = calloc(N, sizeof(fp160));
-    if (!filter->hash_sums) goto fail;
+    if (v == IBF_HASH_SHA1) {
+        filter->hash_tail = calloc(N, IBF_SHA1_TAIL);
+        if (!filter->hash_tail) goto fail;
+    }
 
     filter->k = k;
     filter->N = N;
+    filter->version = v;
     
     return filter;
 
@@ -50,25 +95,30 @@ fail:
 }
 
 int
-ibf_match(struct inv_bloom_t *filter, int k, size_t N) {
-    return filter->k == k && filter->N == N;
+ibf_match(struct inv_bloom_t *filter, int k, size_t N, int v) {
+    return filter->k == k && filter->N == N && filter->version == v;
+}
+
+int
+ibf_version(const struct inv_bloom_t *filter) {
+    return filter->version;
 }
 
 struct inv_bloom_t *
-ibf_copy(struct inv_bloom_t *filter) {
+ibf_copy(const struct inv_bloom_t *filter) {
     struct inv_bloom_t *copy;
 
     if (!filter) return NULL;
-    copy = ibf_allocate(filter->k, filter->N);
+    copy = ibf_allocate(filter->k, filter->N, filter->version);
     if (!copy)
         return NULL;
     
     copy->k = filter->k;
     copy->N = filter->N;
 
-    memcpy(copy->counts, filter->counts, copy->N*sizeof(int32_t));
-    memcpy(copy->id_sums, filter->id_sums, copy->N*sizeof(fp160));
-    memcpy(copy->hash_sums, filter->hash_sums, copy->N*sizeof(fp160));
+    memcpy(copy->cells, filter->cells, copy->N*sizeof(struct ibf_cell_t));
+    if (filter->hash_tail)
+        memcpy(copy->hash_tail, filter->hash_tail, copy->N*IBF_SHA1_TAIL);
 
     return copy;
 }
@@ -78,12 +128,10 @@ void
 ibf_free(struct inv_bloom_t *filter) {
     if (!filter)
         return;
-    if (filter->counts)
-        free(filter->counts);
-    if (filter->id_sums)
-        free(filter->id_sums);
-    if (filter->hash_sums)
-        free(filter->hash_sums);
+    if (filter->cells)
+        free(filter->cells);
+    if (filter->hash_tail)
+        free(filter->hash_tail);
     free(filter);
 }
 
@@ -109,14 +157,325 @@ ibf_sha1_64_keyed(fp160 data, uint64_t index) {
     return ret;
 }
 
-/* Updates dst ^= src. */
+/* Updates dst ^= src, eight bytes at a time. */
 void 
-ibf_fp160_xor(fp160 dst, fp160 src) {
+ibf_fp160_xor(fp160 dst, const fp160 src) {
+    uint64_t d[2], s[2];
+    uint32_t d4, s4;
+
+    memcpy(d, dst, 16);
+    memcpy(s, src, 16);
+    memcpy(&d4, dst+16, 4);
+    memcpy(&s4, src+16, 4);
+    d[0] ^= s[0];
+    d[1] ^= s[1];
+    d4 ^= s4;
+    memcpy(dst, d, 16);
+    memcpy(dst+16, &d4, 4);
+}
+
+/* Bucket combining kernels. Each updates a[i] with b[i] for n buckets,
+ * subtracting (sub != 0) or adding the counts and xoring the sums. The
+ * vector kernels treat the buckets as a stream of 32-bit lanes, where the
+ * lanes holding counts are picked out by ibf_count_mask. The mask repeats
+ * every IBF_KERNEL_BLOCK bytes, which must be a whole number of buckets. */
+#define IBF_KERNEL_BLOCK 96
+typedef char ibf_kernel_block_check
+    [(IBF_KERNEL_BLOCK % sizeof(struct ibf_cell_t)) ? -1 : 1];
+
+typedef void (*ibf_kernel_t)(struct ibf_cell_t *a,
+                             const struct ibf_cell_t *b,
+                             size_t n, int sub);
+
+uint32_t ibf_count_mask[IBF_KERNEL_BLOCK/4];
+ibf_kernel_t ibf_kernel = NULL;
+const char *ibf_kernel_name = NULL;
+pthread_once_t ibf_kernel_once = PTHREAD_ONCE_INIT;
+
+void
+ibf_combine_scalar(struct ibf_cell_t *a, const struct ibf_cell_t *b,
+                   size_t n, int sub) {
+    size_t i;
+
+    /* Counts wrap around, as they do in the vector lanes. */
+    for (i=0; i<n; i++, a++, b++) {
+        if (sub)
+            a->count = (int32_t)((uint32_t)a->count - (uint32_t)b->count);
+        else
+            a->count = (int32_t)((uint32_t)a->count + (uint32_t)b->count);
+        ibf_fp160_xor(a->id_sum, b->id_sum);
+        a->hash_sum ^= b->hash_sum;
+    }
+}
+
+/* Xors n buckets' worth of legacy hash sum tails from b into a. */
+void
+ibf_combine_tail(uint8_t *a, const uint8_t *b, size_t n) {
+    uint32_t x, y;
+    size_t i;
+
+    for (i=0; i<n*IBF_SHA1_TAIL; i+=4) {
+        memcpy(&x, a+i, 4);
+        memcpy(&y, b+i, 4);
+        x ^= y;
+        memcpy(a+i, &x, 4);
+    }
+}
+
+#ifdef IBF_X86_KERNELS
+__attribute__((target("sse2")))
+void
+ibf_combine_sse2(struct ibf_cell_t *a, const struct ibf_cell_t *b,
+                 size_t n, int sub) {
+    uint8_t *pa = (uint8_t *)a;
+    const uint8_t *pb = (const uint8_t *)b;
+    size_t len, i;
+    int j;
+    __m128i m[IBF_KERNEL_BLOCK/16];
+    __m128i va, vb, vc;
+
+    for (j=0; j<IBF_KERNEL_BLOCK/16; j++)
+        m[j] = _mm_loadu_si128((const __m128i *)(ibf_count_mask+4*j));
+
+    len = n*sizeof(struct ibf_cell_t);
+    for (i=0; i+IBF_KERNEL_BLOCK<=len; i+=IBF_KERNEL_BLOCK) {
+        for (j=0; j<IBF_KERNEL_BLOCK/16; j++) {
+            va = _mm_loadu_si128((const __m128i *)(pa+i+16*j));
+            vb = _mm_loadu_si128((const __m128i *)(pb+i+16*j));
+            vc = sub ? _mm_sub_epi32(va, vb) : _mm_add_epi32(va, vb);
+            va = _mm_or_si128(_mm_and_si128(m[j], vc),
+                              _mm_andnot_si128(m[j], _mm_xor_si128(va, vb)));
+            _mm_storeu_si128((__m128i *)(pa+i+16*j), va);
+        }
+    }
+    i /= sizeof(struct ibf_cell_t);
+    ibf_combine_scalar(a+i, b+i, n-i, sub);
+}
+
+__attribute__((target("avx2")))
+void
+ibf_combine_avx2(struct ibf_cell_t *a, const struct ibf_cell_t *b,
+                 size_t n, int sub) {
+    uint8_t *pa = (uint8_t *)a;
+    const uint8_t *pb = (const uint8_t *)b;
+    size_t len, i;
+    int j;
+    __m256i m[IBF_KERNEL_BLOCK/32];
+    __m256i va, vb, vc;
+
+    for (j=0; j<IBF_KERNEL_BLOCK/32; j++)
+        m[j] = _mm256_loadu_si256((const __m256i *)(ibf_count_mask+8*j));
+
+    len = n*sizeof(struct ibf_cell_t);
+    for (i=0; i+IBF_KERNEL_BLOCK<=len; i+=IBF_KERNEL_BLOCK) {
+        for (j=0; j<IBF_KERNEL_BLOCK/32; j++) {
+            va = _mm256_loadu_si256((const __m256i *)(pa+i+32*j));
+            vb = _mm256_loadu_si256((const __m256i *)(pb+i+32*j));
+            vc = sub ? _mm256_sub_epi32(va, vb) : _mm256_add_epi32(va, vb);
+            va = _mm256_blendv_epi8(_mm256_xor_si256(va, vb), vc, m[j]);
+            _mm256_storeu_si256((__m256i *)(pa+i+32*j), va);
+        }
+    }
+    i /= sizeof(struct ibf_cell_t);
+    ibf_combine_scalar(a+i, b+i, n-i, sub);
+}
+#endif
+
+/* Builds the count lane mask and picks the widest kernel this CPU runs. */
+void
+ibf_kernel_select() {
+    size_t i;
+
+    for (i=0; i<IBF_KERNEL_BLOCK/4; i++)
+        ibf_count_mask[i] =
+            ((4*i) % sizeof(struct ibf_cell_t) == offsetof(struct ibf_cell_t, count))
+            ? 0xFFFFFFFF : 0;
+
+    ibf_kernel_name = "scalar";
+    ibf_kernel = &ibf_combine_scalar;
+#ifdef IBF_X86_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        ibf_kernel_name = "avx2";
+        ibf_kernel = &ibf_combine_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        ibf_kernel_name = "sse2";
+        ibf_kernel = &ibf_combine_sse2;
+    }
+#endif
+}
+
+/* Selects the kernel once. Filters are combined from many threads, which
+ * must all see the mask before the kernel that reads it. */
+void
+ibf_kernel_init() {
+    pthread_once(&ibf_kernel_once, ibf_kernel_select);
+}
+
+const char *
+ibf_kernel_check() {
+    ibf_kernel_t kernels[3];
+    struct ibf_cell_t *a, *b, *ref;
+    size_t n, i;
+    int j, sub, failed;
+
+    ibf_kernel_init();
+
+    j = 0;
+#ifdef IBF_X86_KERNELS
+    if (__builtin_cpu_supports("sse2"))
+        kernels[j++] = &ibf_combine_sse2;
+    if (__builtin_cpu_supports("avx2"))
+        kernels[j++] = &ibf_combine_avx2;
+#endif
+    kernels[j] = NULL;
+
+    /* An odd bucket count exercises the scalar tail as well. */
+    n = 4*IBF_KERNEL_BLOCK/sizeof(struct ibf_cell_t)+1;
+    a = b = ref = NULL;
+    failed = 0;
+    if (posix_memalign((void **)&a, IBF_CELL_ALIGN,
+                n*sizeof(struct ibf_cell_t))) {
+        a = NULL;
+        failed = 1;
+    }
+    if (posix_memalign((void **)&b, IBF_CELL_ALIGN,
+                n*sizeof(struct ibf_cell_t))) {
+        b = NULL;
+        failed = 1;
+    }
+    if (posix_memalign((void **)&ref, IBF_CELL_ALIGN,
+                n*sizeof(struct ibf_cell_t))) {
+        ref = NULL;
+        failed = 1;
+    }
+
+    for (j=0; !failed && kernels[j]; j++) {
+        for (sub=0; sub<2; sub++) {
+            for (i=0; i<n; i++) {
+                a[i].count = (i%3) ? (int32_t)mrand48() : INT32_MIN;
+                b[i].count = (i%5) ? (int32_t)mrand48() : INT32_MAX;
+                memset(a[i].id_sum, i, 20);
+                a[i].hash_sum = ~(uint64_t)i * IBF_FAST_KEY;
+                memset(b[i].id_sum, 3*i+1, 20);
+                b[i].hash_sum = (5*i+7) * IBF_FAST_KEY;
+            }
+            memcpy(ref, a, n*sizeof(struct ibf_cell_t));
+            ibf_combine_scalar(ref, b, n, sub);
+            kernels[j](a, b, n, sub);
+            for (i=0; i<n; i++) {
+                if (a[i].count != ref[i].count
+                        || neq_fp160(a[i].id_sum, ref[i].id_sum)
+                        || a[i].hash_sum != ref[i].hash_sum)
+                    failed = 1;
+            }
+        }
+    }
+
+    free(a);
+    free(b);
+    free(ref);
+    return failed ? NULL : ibf_kernel_name;
+}
+
+/* Returns non-zero iff every byte of val is zero. */
+int
+ibf_fp160_zero(const fp160 val) {
     int i;
+    uint8_t acc;
+
+    acc = 0;
+    for (i=0; i<20; i++)
+        acc |= val[i];
+    return !acc;
+}
+
+/* Loads 8 bytes as a little-endian integer, independent of the host. */
+uint64_t
+ibf_load64(const uint8_t *buf) {
+    uint64_t ret;
+    int i;
+
+    ret = 0;
+    for (i=7; i>=0; i--) {
+        ret <<= 8;
+        ret |= buf[i];
+    }
+    return ret;
+}
 
-    for (i=0; i<20; i++) {
-        dst[i] ^= src[i];
+/* The 64-bit finalizer from MurmurHash3. */
+uint64_t
+ibf_mix64(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xFF51AFD7ED558CCDULL;
+    h ^= h >> 33;
+    h *= 0xC4CEB9FE1A85EC53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+uint64_t
+ibf_fast_checksum(const fp160 element) {
+    uint64_t h;
+
+    h = IBF_FAST_KEY;
+    h = ibf_mix64(h ^ ibf_load64(element));
+    h = ibf_mix64(h ^ ibf_load64(element+8));
+    h = ibf_mix64(h ^ (ibf_load64(element+12) >> 32));
+    return h;
+}
+
+/* Computes the checksum that is summed into hash_sum for element. It must
+ * not be linear in element, or the sum of several elements would pass the
+ * purity check. Legacy filters use the first 8 bytes of the element's SHA1
+ * and, if tail is not NULL, store the other IBF_SHA1_TAIL there. */
+uint64_t
+ibf_checksum(const struct inv_bloom_t *filter, const fp160 element,
+             uint8_t *tail) {
+    fp160 digest;
+
+    if (filter->version == IBF_HASH_SHA1) {
+        SHA1(element, 20, digest);
+        if (tail)
+            memcpy(tail, digest+8, IBF_SHA1_TAIL);
+        return ibf_load64(digest);
     }
+    return ibf_fast_checksum(element);
+}
+
+/* Returns the bucket that the i-th hash of element maps to. Under the fast
+ * scheme the element, itself a SHA1 digest, supplies the first four probes
+ * directly as independent 32-bit words; any further probes are mixed from
+ * them. Its last four bytes pick the strata level, so only the first
+ * sixteen are used. Both schemes reduce the probe value modulo N. */
+size_t
+ibf_index(const struct inv_bloom_t *filter, const fp160 element, int i) {
+    uint64_t x;
+
+    if (filter->version == IBF_HASH_SHA1)
+        return ibf_sha1_64_keyed((uint8_t *)element, i) % filter->N;
+
+    if (i < 4)
+        x = (ibf_load64(element+4*i) & 0xFFFFFFFF);
+    else
+        x = ibf_mix64(ibf_load64(element) + i*IBF_FAST_KEY);
+    return x % filter->N;
+}
+
+/* Adds or removes element, whose checksum is hash_val and tail, in bucket
+ * j. */
+void
+ibf_update_cell(struct inv_bloom_t *filter, size_t j, const fp160 element,
+                uint64_t hash_val, const uint8_t *tail, int ins) {
+    struct ibf_cell_t *cell;
+
+    cell = &filter->cells[j];
+    cell->count += (ins>0)?1:-1;
+    ibf_fp160_xor(cell->id_sum, element);
+    cell->hash_sum ^= hash_val;
+    if (filter->hash_tail)
+        ibf_combine_tail(filter->hash_tail+j*IBF_SHA1_TAIL, tail, 1);
 }
 
 /* Helper function to handle insertions and deletions. */
@@ -124,18 +483,50 @@ void
 ibf_insdel(struct inv_bloom_t *filter,
            fp160 element,
            int ins /* 1 for insert, -1 for delete. */) {
-    uint64_t i;
-    uint64_t key;
-    fp160 hash_val;
+    uint64_t i, hash_val;
+    uint8_t tail[IBF_SHA1_TAIL];
     assert(filter);
 
-    SHA1(element, 20, hash_val);
-    for (i=0; i<filter->k; i++) {
-        key = ibf_sha1_64_keyed(element, i) % filter->N;
+    /* Only the SHA1 scheme has a tail to fill in. */
+    memset(tail, 0, sizeof(tail));
+    hash_val = ibf_checksum(filter, element, tail);
+    for (i=0; i<filter->k; i++)
+        ibf_update_cell(filter, ibf_index(filter, element, i), element,
+                        hash_val, tail, ins);
+}
+
+/* Elements whose buckets are looked up, and prefetched, before any of
+ * them is updated. */
+#define IBF_INSERT_BATCH 16
 
-        filter->counts[key] += (ins>0)?1:-1;
-        ibf_fp160_xor(filter->id_sums[key], element);
-        ibf_fp160_xor(filter->hash_sums[key], hash_val);
+void
+ibf_insert_batch(struct inv_bloom_t *filter, const fp160 *elements,
+                 size_t n) {
+    size_t probes[IBF_INSERT_BATCH][IBF_MAX_HASH];
+    uint64_t hash_vals[IBF_INSERT_BATCH];
+    uint8_t tails[IBF_INSERT_BATCH][IBF_SHA1_TAIL];
+    size_t i, b, m;
+    int j;
+
+    if (filter->k > IBF_MAX_HASH) {
+        for (i=0; i<n; i++)
+            ibf_insdel(filter, (uint8_t *)elements[i], 1);
+        return;
+    }
+    memset(tails, 0, sizeof(tails));
+    for (i=0; i<n; i+=m) {
+        m = n-i < IBF_INSERT_BATCH ? n-i : IBF_INSERT_BATCH;
+        for (b=0; b<m; b++) {
+            hash_vals[b] = ibf_checksum(filter, elements[i+b], tails[b]);
+            for (j=0; j<filter->k; j++) {
+                probes[b][j] = ibf_index(filter, elements[i+b], j);
+                __builtin_prefetch(&filter->cells[probes[b][j]], 1);
+            }
+        }
+        for (b=0; b<m; b++)
+            for (j=0; j<filter->k; j++)
+                ibf_update_cell(filter, probes[b][j], elements[i+b],
+                                hash_vals[b], tails[b], 1);
     }
 }
 
@@ -155,30 +546,36 @@ ibf_delete(struct inv_bloom_t *filter,
     ibf_insdel(filter, element, -1);
 }
 
+/* Returns non-zero iff bucket i holds exactly one element, positive or
+ * negative. */
+int
+ibf_pure(const struct inv_bloom_t *filter, size_t i) {
+    const struct ibf_cell_t *cell;
+
+    cell = &filter->cells[i];
+    if (abs(cell->count) != 1)
+        return 0;
+    return cell->hash_sum == ibf_checksum(filter, cell->id_sum, NULL);
+}
+
 /* Decodes one element from filter, if possible, returning the result into
  * the value pointed by element. Returns the number of elements removed. */
 int
 ibf_decode(struct inv_bloom_t *filter /* Filter to search */,
            fp160 element /* Updated with the decoded element */) {
     size_t i;
-    fp160 hash_val;
     int ins_del;
     assert(filter);
 
     for(i=0; i<filter->N; i++) {
-        /* Need to have abs(count) == 1 to be able to decode. */
-        if (abs(filter->counts[i]) != 1)
-            continue;
-
-        /* Check that both the hash and value match to the defined precision. */
-        SHA1(filter->id_sums[i], 20, hash_val);
-        if (neq_fp160(filter->hash_sums[i], hash_val))
+        /* Need abs(count) == 1 and a matching hash to be able to decode. */
+        if (!ibf_pure(filter, i))
             continue;
 
-        memcpy(&element[0], &filter->id_sums[i], 20);
+        memcpy(&element[0], filter->cells[i].id_sum, 20);
 
         /* Update the filter to remove the value. */
-        ins_del = -filter->counts[i]; /* -1 for delete if count == 1
+        ins_del = -filter->cells[i].count; /* -1 for delete if count == 1
                                        *  1 for insert if count == -1 */
         ibf_insdel(filter, element, ins_del);
 
@@ -188,25 +585,169 @@ ibf_decode(struct inv_bloom_t *filter /* Filter to search */,
     return 0;
 }
 
+/* Appends element to a growable list of hashes. Returns 0 on success. */
+int
+ibf_list_append(fp160 **list, size_t *n, size_t *alloc, fp160 element) {
+    fp160 *tmp;
+
+    if (*n >= *alloc) {
+        *alloc = *alloc ? 2*(*alloc) : 64;
+        tmp = realloc(*list, *alloc*sizeof(fp160));
+        if (!tmp) return -1;
+        *list = tmp;
+    }
+    memcpy((*list)[(*n)++], element, sizeof(fp160));
+    return 0;
+}
+
+int
+ibf_decode_all(struct inv_bloom_t *filter,
+               fp160 **pos, size_t *n_pos,
+               fp160 **neg, size_t *n_neg) {
+    size_t *queue, *tmp;
+    size_t q_len, q_alloc, pos_alloc, neg_alloc;
+    size_t i, cell;
+    int j, ins_del;
+    fp160 element;
+    assert(filter);
+
+    *pos = *neg = NULL;
+    *n_pos = *n_neg = 0;
+    pos_alloc = neg_alloc = 0;
+
+    /* Seed the work queue with every bucket that might be pure. The purity
+     * check itself is deferred until the bucket is popped. */
+    q_alloc = filter->N + filter->k;
+    queue = malloc(q_alloc*sizeof(size_t));
+    if (!queue) goto error;
+    q_len = 0;
+    for (i=0; i<filter->N; i++)
+        if (abs(filter->cells[i].count) == 1)
+            queue[q_len++] = i;
+
+    while (q_len) {
+        cell = queue[--q_len];
+        if (!ibf_pure(filter, cell))
+            continue;
+
+        memcpy(element, filter->cells[cell].id_sum, sizeof(fp160));
+        ins_del = -filter->cells[cell].count; /* -1 for delete if count == 1
+                                          *  1 for insert if count == -1 */
+        if (ins_del < 0) {
+            if (ibf_list_append(pos, n_pos, &pos_alloc, element)) goto error;
+        } else {
+            if (ibf_list_append(neg, n_neg, &neg_alloc, element)) goto error;
+        }
+        ibf_insdel(filter, element, ins_del);
+
+        /* Only the buckets touched by the removal can have become pure. */
+        if (q_len + filter->k > q_alloc) {
+            q_alloc = 2*q_alloc + filter->k;
+            tmp = realloc(queue, q_alloc*sizeof(size_t));
+            if (!tmp) goto error;
+            queue = tmp;
+        }
+        for (j=0; j<filter->k; j++) {
+            i = ibf_index(filter, element, j);
+            if (abs(filter->cells[i].count) == 1)
+                queue[q_len++] = i;
+        }
+    }
+    free(queue);
+
+    /* Any bucket left non-zero is an undecodeable remainder; counts alone
+     * are not enough since positive and negative elements can cancel. */
+    for (i=0; i<filter->N; i++)
+        if (filter->cells[i].count || !ibf_fp160_zero(filter->cells[i].id_sum))
+            return 1;
+    return 0;
+
+error:
+    free(queue);
+    free(*pos);
+    free(*neg);
+    *pos = *neg = NULL;
+    *n_pos = *n_neg = 0;
+    return -1;
+}
+
 int
 ibf_subtract(struct inv_bloom_t *filter_A,
        const struct inv_bloom_t *filter_B) {
-    size_t i;
+    if (!filter_A)                        return -1;
+    if (!filter_B)                        return -1;
+    if (filter_A->k != filter_B->k)       return -1;
+    if (filter_A->N != filter_B->N)       return -1;
+    if (filter_A->version != filter_B->version) return -1;
+
+    /* Walk both filters as a single stream of buckets. */
+    ibf_kernel_init();
+    ibf_kernel(filter_A->cells, filter_B->cells, filter_A->N, 1);
+    if (filter_A->hash_tail)
+        ibf_combine_tail(filter_A->hash_tail, filter_B->hash_tail, filter_A->N);
+
+    return 0;
+}
 
+int
+ibf_add(struct inv_bloom_t *filter_A,
+        const struct inv_bloom_t *filter_B) {
     if (!filter_A)                        return -1;
     if (!filter_B)                        return -1;
     if (filter_A->k != filter_B->k)       return -1;
     if (filter_A->N != filter_B->N)       return -1;
+    if (filter_A->version != filter_B->version) return -1;
 
-    for (i=0; i<filter_A->N; i++) {
-        filter_A->counts[i] -= filter_B->counts[i];
-        ibf_fp160_xor(filter_A->id_sums[i], filter_B->id_sums[i]);
-        ibf_fp160_xor(filter_A->hash_sums[i], filter_B->hash_sums[i]);
+    ibf_kernel_init();
+    ibf_kernel(filter_A->cells, filter_B->cells, filter_A->N, 0);
+    if (filter_A->hash_tail)
+        ibf_combine_tail(filter_A->hash_tail, filter_B->hash_tail, filter_A->N);
+
+    return 0;
+}
+
+int
+ibf_fold_into(struct inv_bloom_t *dst, const struct inv_bloom_t *src) {
+    size_t i;
+
+    if (!dst || !src)                     return -1;
+    if (dst->k != src->k)                 return -1;
+    if (dst->version != src->version)     return -1;
+    if (src->N % dst->N)                  return -1;
+
+    /* Every element's probe value is reduced modulo the size, so bucket j
+     * of the smaller filter is the sum of the buckets congruent to j. */
+    memcpy(dst->cells, src->cells, dst->N*sizeof(struct ibf_cell_t));
+    ibf_kernel_init();
+    for (i=dst->N; i<src->N; i+=dst->N)
+        ibf_kernel(dst->cells, src->cells+i, dst->N, 0);
+
+    if (dst->hash_tail) {
+        memcpy(dst->hash_tail, src->hash_tail, dst->N*IBF_SHA1_TAIL);
+        for (i=dst->N; i<src->N; i+=dst->N)
+            ibf_combine_tail(dst->hash_tail, src->hash_tail+i*IBF_SHA1_TAIL,
+                    dst->N);
     }
 
     return 0;
 }
 
+struct inv_bloom_t *
+ibf_fold(const struct inv_bloom_t *filter, size_t N) {
+    struct inv_bloom_t *folded;
+
+    if (!filter || !N || filter->N % N)
+        return NULL;
+    folded = ibf_allocate(filter->k, N, filter->version);
+    if (!folded)
+        return NULL;
+    if (ibf_fold_into(folded, filter)) {
+        ibf_free(folded);
+        return NULL;
+    }
+    return folded;
+}
+
 /* Counts the number of elements in the bloom filter. */
 uint64_t
 ibf_count(struct inv_bloom_t *filter) {
@@ -215,7 +756,7 @@ ibf_count(struct inv_bloom_t *filter) {
     assert(filter);
 
     for (i=0; i<filter->N; i++) {
-        count += filter->counts[i];
+        count += filter->cells[i].count;
     }
 
     /* The count of total added hashes should be divisible by k */
@@ -225,6 +766,29 @@ ibf_count(struct inv_bloom_t *filter) {
     return count;
 }
 
+/* Stores bucket i's hash sum as it appears on the wire into out, a zeroed
+ * buffer of at least ibf_checksum_len bytes: the checksum least significant
+ * byte first, followed by the legacy tail if there is one. */
+void
+ibf_get_hash_sum(const struct inv_bloom_t *filter, size_t i, uint8_t *out) {
+    uint64_t h;
+    int j;
+
+    h = filter->cells[i].hash_sum;
+    for (j=0; j<8; j++, h >>= 8)
+        out[j] = h&0xFF;
+    if (filter->hash_tail)
+        memcpy(out+8, filter->hash_tail+i*IBF_SHA1_TAIL, IBF_SHA1_TAIL);
+}
+
+/* Inverse of ibf_get_hash_sum. */
+void
+ibf_set_hash_sum(struct inv_bloom_t *filter, size_t i, const uint8_t *in) {
+    filter->cells[i].hash_sum = ibf_load64(in);
+    if (filter->hash_tail)
+        memcpy(filter->hash_tail+i*IBF_SHA1_TAIL, in+8, IBF_SHA1_TAIL);
+}
+
 /* Writes out filter to an ASCII file. Returns 0 on success. */
 char *
 ibf_write(struct inv_bloom_t *filter) {
@@ -233,46 +797,59 @@ ibf_write(struct inv_bloom_t *filter) {
     int w;
 
     char buf_hashA[41], buf_hashB[41];
+    fp160 hash_sum;
 
     w = 0;
     buf = malloc(100*filter->N);
     if (!buf) return NULL;
 
     assert(filter);
-    w += sprintf(buf+w, "IBF:%d:%lu\n", filter->k, filter->N);
+    /* The legacy header is kept byte-for-byte so old peers can parse it. */
+    if (filter->version == IBF_HASH_SHA1)
+        w += sprintf(buf+w, "IBF:%d:%lu\n", filter->k, filter->N);
+    else
+        w += sprintf(buf+w, "IBF:%d:%lu:%d\n", filter->k, filter->N,
+                filter->version);
     for (i=0; i<filter->N; i++) {
-        print_fp160(filter->id_sums[i], buf_hashA);
-        print_fp160(filter->hash_sums[i], buf_hashB);
-        w += sprintf(buf+w, "%d:%s:%s\n", filter->counts[i], buf_hashA, buf_hashB);
+        print_fp160(filter->cells[i].id_sum, buf_hashA);
+        memset(hash_sum, 0, sizeof(fp160));
+        ibf_get_hash_sum(filter, i, hash_sum);
+        print_fp160(hash_sum, buf_hashB);
+        w += sprintf(buf+w, "%d:%s:%s\n", filter->cells[i].count, buf_hashA, buf_hashB);
     }
     return buf;
 }
 
 struct inv_bloom_t *
 ibf_from_string(char *string) {
-    int k, N, i, cnt;
+    int k, N, v, i, cnt;
     struct inv_bloom_t *filter;
     char bufA[40], bufB[40];
     fp160 buf;
 
     filter = NULL;
-    if (2 != sscanf(string, "IBF:%d:%d", &k, &N))
-        goto error;
+    /* Peers that predate versioning only send k and N. */
+    switch (sscanf(string, "IBF:%d:%d:%d", &k, &N, &v)) {
+        case 2:  v = IBF_HASH_SHA1; break;
+        case 3:  break;
+        default: goto error;
+    }
 
-    /*printf("Detected k=%d, N=%d\n", k, N);*/
+    /*printf("Detected k=%d, N=%d, v=%d\n", k, N, v);*/
 
-    filter = ibf_allocate(k, N);
+    filter = ibf_allocate(k, N, v);
+    if (!filter) goto error;
 
     for (i=0; i<N; i++) {
         string += strcspn(string, "\r\n");
         string += strspn(string, "\r\n");
         if (3 != sscanf(string, "%d:%40c:%40c", &cnt, bufA, bufB)) goto error;
 
-        filter->counts[i] = cnt;
+        filter->cells[i].count = cnt;
         parse_fp160(bufA, buf);
-        ibf_fp160_xor(filter->id_sums[i], buf);
+        ibf_fp160_xor(filter->cells[i].id_sum, buf);
         parse_fp160(bufB, buf);
-        ibf_fp160_xor(filter->hash_sums[i], buf);
+        ibf_set_hash_sum(filter, i, buf);
     }
 
     if (!filter) goto error;
@@ -285,3 +862,138 @@ error:
     return NULL;
 }
 
+/* Appends v to buf as an unsigned LEB128 varint, returning its length. */
+size_t
+ibf_put_varint(uint8_t *buf, uint64_t v) {
+    size_t w;
+
+    w = 0;
+    while (v >= 0x80) {
+        buf[w++] = (v&0x7F) | 0x80;
+        v >>= 7;
+    }
+    buf[w++] = v;
+    return w;
+}
+
+/* Reads a varint from *buf, advancing it. Returns 0 on success. */
+int
+ibf_get_varint(const uint8_t **buf, const uint8_t *end, uint64_t *v) {
+    int shift;
+
+    *v = 0;
+    for (shift=0; shift<64 && *buf<end; shift+=7) {
+        *v |= (uint64_t)(**buf&0x7F) << shift;
+        if (!(*(*buf)++ & 0x80))
+            return 0;
+    }
+    return -1;
+}
+
+/* Number of significant hash sum bytes. The fast checksum is only 8 bytes
+ * wide; legacy filters carry the full SHA1. */
+size_t
+ibf_checksum_len(const struct inv_bloom_t *filter) {
+    return filter->version == IBF_HASH_SHA1 ? 20 : 8;
+}
+
+uint8_t *
+ibf_write_binary(struct inv_bloom_t *filter, size_t *len) {
+    uint8_t *buf;
+    size_t w, i, run, sum_len;
+    struct ibf_cell_t *cell;
+    int32_t count;
+    fp160 hash_sum;
+
+    assert(filter);
+    sum_len = ibf_checksum_len(filter);
+    /* Header, then at worst one varint and both sums per bucket. */
+    buf = malloc(64 + filter->N*(10+20+sum_len));
+    if (!buf) return NULL;
+
+    memcpy(buf, IBF_BIN_MAGIC, 4);
+    w = 4;
+    buf[w++] = IBF_BIN_FORMAT;
+    w += ibf_put_varint(buf+w, filter->k);
+    w += ibf_put_varint(buf+w, filter->N);
+    w += ibf_put_varint(buf+w, filter->version);
+
+    run = 0;
+    for (i=0; i<filter->N; i++) {
+        cell = &filter->cells[i];
+        memset(hash_sum, 0, sizeof(fp160));
+        ibf_get_hash_sum(filter, i, hash_sum);
+        if (!cell->count && ibf_fp160_zero(cell->id_sum)
+                && ibf_fp160_zero(hash_sum)) {
+            run++;
+            continue;
+        }
+        /* Runs of empty buckets are odd; buckets carry a zigzag count. */
+        if (run)
+            w += ibf_put_varint(buf+w, (run<<1) | 1);
+        run = 0;
+        count = cell->count;
+        w += ibf_put_varint(buf+w,
+                ((uint64_t)(((uint32_t)count<<1) ^ (uint32_t)(count>>31)))<<1);
+        memcpy(buf+w, cell->id_sum, 20);
+        w += 20;
+        memcpy(buf+w, hash_sum, sum_len);
+        w += sum_len;
+    }
+    if (run)
+        w += ibf_put_varint(buf+w, (run<<1) | 1);
+
+    *len = w;
+    return buf;
+}
+
+struct inv_bloom_t *
+ibf_from_binary(const uint8_t *buf, size_t len, size_t *used) {
+    const uint8_t *end, *start;
+    struct inv_bloom_t *filter;
+    struct ibf_cell_t *cell;
+    uint64_t k, N, v, h;
+    size_t i, sum_len;
+    uint32_t zz;
+
+    filter = NULL;
+    start = buf;
+    end = buf+len;
+    if (len < 5 || memcmp(buf, IBF_BIN_MAGIC, 4) || buf[4] != IBF_BIN_FORMAT)
+        goto error;
+    buf += 5;
+    if (ibf_get_varint(&buf, end, &k)) goto error;
+    if (ibf_get_varint(&buf, end, &N)) goto error;
+    if (ibf_get_varint(&buf, end, &v)) goto error;
+    if (k < 1 || k > IBF_MAX_HASH || N < 1 || N > IBF_MAX_BUCKETS) goto error;
+
+    filter = ibf_allocate(k, N, v);
+    if (!filter) goto error;
+    sum_len = ibf_checksum_len(filter);
+
+    /* Buckets are decoded straight into the zeroed filter. */
+    for (i=0; i<N; ) {
+        if (ibf_get_varint(&buf, end, &h)) goto error;
+        if (h&1) {
+            h >>= 1;
+            if (h > N-i) goto error;
+            i += h;
+            continue;
+        }
+        if (end-buf < 20+sum_len) goto error;
+        zz = h>>1;
+        cell = &filter->cells[i++];
+        cell->count = (int32_t)((zz>>1) ^ -(zz&1));
+        memcpy(cell->id_sum, buf, 20);
+        ibf_set_hash_sum(filter, i-1, buf+20);
+        buf += 20+sum_len;
+    }
+
+    if (used)
+        *used = buf-start;
+    return filter;
+
+error:
+    ibf_free(filter);
+    return NULL;
+}
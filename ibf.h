@@ -6,19 +6,38 @@
 #include <stddef.h>
 #include "types.h"
 
+/* Hashing schemes, advertised in the IBF: header. Filters can only be
+ * compared with filters that use the same scheme. */
+#define IBF_HASH_SHA1 1 /* SHA1 per probe and a SHA1 hash sum. */
+#define IBF_HASH_FAST 2 /* Probes taken from the element bits and a 64-bit
+                           mixed checksum. */
+
+/* Buckets hold a count, the sum of the elements and a 64-bit sum of their
+ * checksums, which is all the purity check compares. A bucket holding
+ * several elements whose counts net to +-1 passes it with probability
+ * 2^-64 under either scheme: truncated to b bits, both checksums pass
+ * 2^-b of such buckets (measured for b = 8 to 24 over 2^25 random sums of
+ * three and five elements). A 32-bit checksum would not make the bucket
+ * any smaller, so the wider one is kept. */
+
 /* Allocates and returns a pointer to an inverse bloom filter with the
  * requested parameters. Returns NULL in the case of failure. */
 struct inv_bloom_t *
 ibf_allocate(int    k /* Number of hashes per element */,
-             size_t N /* Number of buckets */);
+             size_t N /* Number of buckets */,
+             int    v /* Hashing scheme, one of IBF_HASH_* */);
+
+int
+ibf_match(struct inv_bloom_t *filter, int k, size_t N, int v);
 
+/* Returns the hashing scheme used by filter. */
 int
-ibf_match(struct inv_bloom_t *filter, int k, size_t N);
+ibf_version(const struct inv_bloom_t *filter);
 
 /* Allocates and returns a pointer to a bloom filter that is a copy of filter.
  * returns NULL in the case of failure. */
 struct inv_bloom_t *
-ibf_copy(struct inv_bloom_t *filter);
+ibf_copy(const struct inv_bloom_t *filter);
 
 /* Frees all memory allocated by the filter. */
 void
@@ -30,6 +49,13 @@ void
 ibf_insert(struct inv_bloom_t *filter /* Filter to insert into */,
            fp160 element /* Element to insert. */);
 
+/* Inserts n elements, giving the same filter as inserting them one by one.
+ * The buckets of several elements are fetched before any is updated, which
+ * is faster for filters that don't fit in cache. */
+void
+ibf_insert_batch(struct inv_bloom_t *filter, const fp160 *elements,
+                 size_t n);
+
 /* Deletes the given element from the bloom filter. May result in negative
  * counts. */
 void
@@ -45,11 +71,46 @@ int
 ibf_decode(struct inv_bloom_t *filter /* Filter to search */,
            fp160 element /* Updated with the decoded element */);
 
+/* Decodes every element that can be peeled from filter, removing them from
+ * the filter in place. Pure buckets are kept on a work queue, and only the
+ * buckets touched by each removal are re-examined. On return, *pos and *neg
+ * point to malloc'd arrays of the positive and negative elements, which the
+ * caller must free. Returns 0 if the filter was decoded completely, 1 if an
+ * undecodeable remainder is left, and -1 on allocation failure. */
+int
+ibf_decode_all(struct inv_bloom_t *filter /* Filter to decode */,
+               fp160 **pos   /* Updated with the positive elements */,
+               size_t *n_pos /* Updated with the number of positives */,
+               fp160 **neg   /* Updated with the negative elements */,
+               size_t *n_neg /* Updated with the number of negatives */);
+
 /* Subtracts B from A in place. Returns 0 on success, non-zero on error. */
 int
 ibf_subtract(struct inv_bloom_t *filter_A,
        const struct inv_bloom_t *filter_B);
 
+/* Adds B to A in place. Returns 0 on success, non-zero on error. */
+int
+ibf_add(struct inv_bloom_t *filter_A,
+        const struct inv_bloom_t *filter_B);
+
+/* Folds src into the smaller filter dst, overwriting it, so that dst is the
+ * filter src's elements would have produced at dst's size. The size of dst
+ * must divide the size of src. Returns 0 on success, non-zero on error. */
+int
+ibf_fold_into(struct inv_bloom_t *dst, const struct inv_bloom_t *src);
+
+/* Allocates and returns filter folded down to N buckets. N must divide the
+ * size of filter. Returns NULL on failure. */
+struct inv_bloom_t *
+ibf_fold(const struct inv_bloom_t *filter, size_t N);
+
+/* Checks every bucket-combining kernel this CPU supports against the scalar
+ * one, bit for bit. Returns the name of the kernel in use, or NULL if any
+ * kernel disagrees. */
+const char *
+ibf_kernel_check();
+
 /* Counts the number of elements in the bloom filter. */
 uint64_t
 ibf_count(struct inv_bloom_t *filter);
@@ -62,4 +123,41 @@ ibf_write(struct inv_bloom_t *filter);
 struct inv_bloom_t *
 ibf_from_string(char *string);
 
+/* Writes out filter in the compact binary encoding, storing its length in
+ * len. Returns NULL on failure. */
+uint8_t *
+ibf_write_binary(struct inv_bloom_t *filter, size_t *len);
+
+/* Allocates and parses a binary-encoded ibf from buf, decoding the buckets
+ * in place. If used is not NULL it is set to the number of bytes consumed.
+ * Returns NULL on failure. */
+struct inv_bloom_t *
+ibf_from_binary(const uint8_t *buf, size_t len, size_t *used);
+
+/* Helpers shared with the rateless coder in riblt.c. */
+
+/* Updates dst ^= src. */
+void
+ibf_fp160_xor(fp160 dst, const fp160 src);
+
+/* Returns non-zero iff every byte of val is zero. */
+int
+ibf_fp160_zero(const fp160 val);
+
+/* Returns the 64-bit checksum of element under IBF_HASH_FAST. */
+uint64_t
+ibf_fast_checksum(const fp160 element);
+
+/* Appends element to a growable list of hashes. Returns 0 on success. */
+int
+ibf_list_append(fp160 **list, size_t *n, size_t *alloc, fp160 element);
+
+/* Appends v to buf as an unsigned LEB128 varint, returning its length. */
+size_t
+ibf_put_varint(uint8_t *buf, uint64_t v);
+
+/* Reads a varint from *buf, advancing it. Returns 0 on success. */
+int
+ibf_get_varint(const uint8_t **buf, const uint8_t *end, uint64_t *v);
+
 #endif
@@ -4,13 +4,13 @@
 #include <assert.h>
 #include <string.h>
 #include <ctype.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include <openssl/sha.h>
 
-#define RD_BYTE(v, f) \
-    if (1 != fread(&v, sizeof(uint8_t), 1, f)) \
-        return -1;
-
 #define START_ASCII "-----BEGIN PGP PUBLIC KEY BLOCK-----"
 #define END_ASCII "-----END PGP PUBLIC KEY BLOCK-----"
 
@@ -38,54 +38,6 @@ deep_free_key(struct pgp_key_t *key) {
     free(key);
 }
 
-uint64_t
-rd_n_bytes(FILE *in, int n) {
-    uint8_t tmp;
-    uint64_t ret;
-    assert(0 <= n && n <= 7);
-    ret = 0;
-    for(; n; n--) {
-        RD_BYTE(tmp, in);
-        ret <<= 8;
-        ret |= tmp;
-    }
-    return ret;
-}
-
-uint64_t
-get_new_pkt_len(FILE *in) {
-    uint8_t tmp;
-    uint32_t pkt_len;
-    RD_BYTE(tmp, in);
-    if (tmp < 192) {
-        pkt_len = tmp;
-    } else if (tmp < 224) {
-        pkt_len = (tmp-192)<<8;
-        RD_BYTE(tmp, in);
-        pkt_len |= tmp + 192;
-    } else if (tmp == 255) {
-        pkt_len = rd_n_bytes(in, 4);
-    } else {
-        return -1;
-    }
-    return pkt_len;
-}
-
-uint64_t
-get_old_pkt_len(FILE *in, uint8_t len_type) {
-    switch(len_type) {
-        case 0:
-            return rd_n_bytes(in, 1);
-        case 1:
-            return rd_n_bytes(in, 2);
-        case 2:
-            return rd_n_bytes(in, 4);
-        case 3:
-        default:
-            return -1;
-    }
-}
-
 int
 parse_packet_header(uint8_t *pkt, 
                     uint8_t *hdr_len, 
@@ -253,69 +205,108 @@ error:
     return -1;
 }
 
-int
-parse_from_dump(FILE *in, struct pgp_key_t *key) {
-    int tmp;
-    uint8_t type;
-    char started, new;
-    size_t start_pos, end_pos;
-    size_t pkt_len;
-
-    start_pos = ftell(in);
-    started = 0;
+struct dump_t *
+dump_open(const char *filename) {
+    struct dump_t *dump;
+    struct stat st;
+    int fd;
 
-    do {
-        end_pos = ftell(in);
-        tmp = fgetc(in);
+    dump = malloc(sizeof(struct dump_t));
+    if (!dump) return NULL;
+    memset(dump, 0, sizeof(*dump));
 
-        if (tmp == EOF) {
-            if (started)
-                break;
-            else
-                return -1;
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        goto error;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        goto error;
+    }
+    dump->len = st.st_size;
+    /* Nothing can be mapped from an empty file, and nothing needs to be. */
+    if (dump->len) {
+        dump->data = mmap(NULL, dump->len, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (dump->data == MAP_FAILED) {
+            close(fd);
+            goto error;
         }
+        madvise(dump->data, dump->len, MADV_SEQUENTIAL);
+    }
+    close(fd);
+    return dump;
+error:
+    free(dump);
+    return NULL;
+}
 
-        if (!(tmp&0x80))
-            return -1;
+/* Parses the header of the packet at offset, which holds a whole header
+ * even if it is cut short by the end of the dump. */
+int
+dump_packet_header(const struct dump_t *dump, size_t offset, uint8_t *hdr_len,
+                   uint8_t *type, uint64_t *pkt_len) {
+    uint8_t hdr[6];
+
+    if (dump->len-offset >= sizeof(hdr))
+        return parse_packet_header(dump->data+offset, hdr_len, type, pkt_len);
+
+    memset(hdr, 0, sizeof(hdr));
+    memcpy(hdr, dump->data+offset, dump->len-offset);
+    if (parse_packet_header(hdr, hdr_len, type, pkt_len) ||
+            *hdr_len > dump->len-offset)
+        return -1;
+    return 0;
+}
 
-        new = tmp&0x40;
-        if (new)
-            type = tmp&0x3F;
-        else
-            type = (tmp>>2)&0xF;
+int
+dump_next_key(struct dump_t *dump, struct pgp_key_t *key) {
+    uint8_t hdr_len, type;
+    uint64_t pkt_len;
+    size_t offset;
+    char started;
 
-        /*printf("Skipping packet (tag 0x%X) of type %d.\n", tmp, type);*/
+    if (dump->pos >= dump->len)
+        return 1;
 
+    /* A key runs from its public key packet to the next one. */
+    started = 0;
+    for (offset=dump->pos; offset<dump->len; offset+=hdr_len+pkt_len) {
+        if (dump_packet_header(dump, offset, &hdr_len, &type, &pkt_len))
+            return -1;
         if (type == 6) {
-            /*printf("Packet is a public key packet.\n");*/
             if (started)
                 break;
             started = 1;
         }
-        if (new) {
-            pkt_len = get_new_pkt_len(in);
-            /*printf("Packet is a new format packet of length %lu.\n", pkt_len);*/
-        } else {
-            pkt_len = get_old_pkt_len(in, tmp&0x3);
-            /*printf("Packet is a old format packet of length %lu.\n", pkt_len);*/
-        }
-        /* Skip the remainder of the packet. */
-        fseek(in, pkt_len, SEEK_CUR);
-    } while (1);
-
-    assert(!fseek(in, start_pos, SEEK_SET));
-    key->len = end_pos-start_pos;
-    key->data = malloc(key->len);
-    if (!key->data)
-        goto error;
-
-    if (key->len != fread(key->data, 1, key->len, in))
-        goto error;
+        if (pkt_len > dump->len-offset-hdr_len)
+            return -1;
+    }
+    if (!started)
+        return -1;
 
+    key->data = dump->data+dump->pos;
+    key->len = offset-dump->pos;
+    dump->pos = offset;
     return 0;
-error:
-    inner_free_key(key);
-    return -1;
+}
+
+void
+dump_release(struct dump_t *dump, size_t offset) {
+    size_t end;
+
+    end = offset & ~(size_t)(sysconf(_SC_PAGESIZE)-1);
+    if (end > dump->released) {
+        madvise(dump->data+dump->released, end-dump->released,
+                MADV_DONTNEED);
+        dump->released = end;
+    }
+}
+
+void
+dump_close(struct dump_t *dump) {
+    if (!dump) return;
+    if (dump->len)
+        munmap(dump->data, dump->len);
+    free(dump);
 }
 
 void
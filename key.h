@@ -13,11 +13,32 @@ free_key(struct pgp_key_t *key);
 void
 inner_free_key(struct pgp_key_t *key);
 
-/* Attempts to parse a public key from a file dump. Returns 0 on success and
- * non-zero on failure. On a successful return, the value pointed to by key is 
- * filled in with the results. */
+/* A key dump mapped into memory, read from pos on. */
+struct dump_t {
+    uint8_t *data;
+    size_t len;
+    size_t pos;
+    size_t released; /* The pages before it have been given back. */
+};
+
+/* Maps the dump file filename. Returns NULL on failure. */
+struct dump_t *
+dump_open(const char *filename);
+
+/* Points key->data and key->len at the next key in dump, found by walking
+ * its packet headers, without copying it. The data belongs to the dump and
+ * must not be freed or written. Returns 0 on success, 1 at the end of the
+ * dump and -1 if the dump is malformed. */
 int
-parse_from_dump(FILE *in, struct pgp_key_t *key);
+dump_next_key(struct dump_t *dump, struct pgp_key_t *key);
+
+/* Gives back the pages of dump before offset, which are done with, so that
+ * a large dump doesn't stay resident. They are read in again if used. */
+void
+dump_release(struct dump_t *dump, size_t offset);
+
+void
+dump_close(struct dump_t *dump);
 
 /* Pretty prints a key to standard out with an optional prefix. */
 void
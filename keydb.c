@@ -2,6 +2,9 @@
 #include "key.h"
 #include "ibf.h"
 #include "setdiff.h"
+#include "riblt.h"
+#include "trigram.h"
+#include "epoch.h"
 #include "types.h"
 #include "serv.h"
 #include "util.h"
@@ -13,30 +16,185 @@
 #include <db.h>
 #include <assert.h>
 #include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sched.h>
+#include <time.h>
 /*#include <valgrind/memcheck.h>*/
 
 #define MULTIPUT_SIZE (1024*1024*64)
-
+/* Bytes a key/data pair takes in a DB_MULTIPLE_KEY buffer beyond its own:
+ * four offsets and lengths, and room for alignment. */
+#define MULTIPUT_PAIR_OVERHEAD (4*sizeof(uint32_t)+8)
+/* Polls of a peer without /riblt before it is tried again, as it may have
+ * been upgraded. */
+#define PEER_RIBLT_RETRY 64
+/* Keys peer_with downloads before inserting them together. */
+#define FETCH_BATCH 1024
+
+/* One indexed key, packed into 64 bytes. The user ID lives in the arena. */
 struct key_idx_t {
-    int version;
-    uint32_t id32;
-    size_t size;
     uint64_t id64;
-    char *uid;
+    uint32_t id32;
+    uint32_t size;
+    uint32_t uid; /* Offset of the user ID in the arena. */
+    uint8_t version;
     fp160 fp;
     fp160 hash;
 };
 
+/* The index and the user ID arena are kept in fixed-size segments, so
+ * growing them never moves, or copies, what is already there. */
+#define IDX_SEGMENT_BITS 16
+#define IDX_SEGMENT_SIZE (1<<IDX_SEGMENT_BITS) /* Records. */
+#define UID_SEGMENT_BITS 24
+#define UID_SEGMENT_SIZE (1<<UID_SEGMENT_BITS) /* Bytes. */
+#define UID_MAX_SEGMENTS (1<<(32-UID_SEGMENT_BITS))
+
+/* Query types, autodetected using HKP format. */
+#define QUERY_ID32 1 /* 32-bit keyID */
+#define QUERY_ID64 2 /* 64-bit keyID */
+#define QUERY_FP   3 /* 160-bit fingerprint */
+#define QUERY_UID  4 /* User ID substring */
+#define IDX_HASH   5 /* Key hash, for spotting duplicates; never queried */
+
+/* Open-addressing hash table of positions in key_idx, probed linearly.
+ * Positions are only ever added, in key_idx order, so the entries for any
+ * one key are met in that order too. A table that fills up is replaced by
+ * a larger one, so lookups never see it resized under them. */
+struct idx_table_t {
+    int *slots; /* -1 marks an empty slot. */
+    size_t mask;
+    int count;
+};
+
+#define IDX_TABLE_MIN_SIZE 1024
+/* Mean size of a stored key assumed when sizing the tables from the size
+ * of a file, about that in keyserver dumps. */
+#define IDX_KEY_SIZE_GUESS 2048
+
+/* Hashes of indexed keys on their way to the filters, in a ring that any
+ * number of writers append to without a lock. Entry i holds the hash
+ * appended at position p once its seq is p+1, and is free for position p
+ * while its seq is p. Entries are taken under fold_lock, in order. */
+#define FILTER_LOG_SIZE (1<<16)
+#define FILTER_BATCH 1024
+/* How long the applier lets a partial batch wait for more hashes. */
+#define FILTER_DELAY_MS 10
+/* Keys that can be added to a database after a rateless stream was
+ * started and still be taken back out of its symbols. */
+#define RIBLT_MAX_LAG (1<<16)
+
+enum { LOG_AWAKE, LOG_IDLE, LOG_FILLING };
+
+struct filter_log_entry_t {
+    uint64_t seq;
+    fp160 hash;
+};
+
+struct filter_log_t {
+    struct filter_log_entry_t *entries;
+    uint64_t tail; /* Next position to append at. */
+    uint64_t head; /* Next position to take. */
+    fp160 *batch;
+    /* The applier sleeps on wake, LOG_IDLE while the log is empty and
+     * LOG_FILLING while a batch fills up. */
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    int sleeping;
+    int stop;
+};
+
+/* A filter or estimator as it was at one generation. Never changed once
+ * published. */
+struct filter_view_t {
+    uint64_t generation;
+    struct inv_bloom_t *bloom;
+    struct strata_estimator_t *strata;
+};
+
+/* Lookups and filter requests take no lock. They run in epoch sections,
+ * see only keys below the idx_count they read on entry, and what a writer
+ * replaces is retired to the epoch until they are done with it. Writers
+ * still take the write lock, and publish idx_count once a key is filed
+ * everywhere. */
 struct keydb_t {
     DB *dbp;
-    struct key_idx_t *key_idx;
-    int idx_alloc;
+    struct key_idx_t **key_idx; /* Segments of IDX_SEGMENT_SIZE records. */
+    int idx_segments;
     int idx_count;
-    struct inv_bloom_t *filters[BLOOM_MAX_COUNT];
-    struct strata_estimator_t *strata[STRATA_MAX_COUNT];
+    struct epoch_t *epoch;
+    /* Append-only arena of NUL-terminated user IDs. */
+    char *uids[UID_MAX_SEGMENTS];
+    size_t uid_end;
+    /* Snapshot the index was loaded from. Segments inside it are mapped
+     * copy-on-write rather than malloc'd. */
+    uint8_t *snapshot;
+    size_t snapshot_len;
+    char *filename;
+    int indexed; /* Set once the index matches the database. */
+    /* Background indexing, for databases opened lazily. ready is 1 once
+     * the index is complete, 0 while it is built and -1 if that failed. */
+    pthread_t indexer;
+    int indexer_started;
+    int ready;
+    int stop;
+    uint64_t index_start;
+    /* Hash indexes for the exact-match query types. */
+    struct idx_table_t *by_id32;
+    struct idx_table_t *by_id64;
+    struct idx_table_t *by_fp;
+    struct idx_table_t *by_hash;
+    /* Trigram index for user ID substring queries. */
+    struct trigram_idx_t *by_uid;
+    /* Every key goes into the master filter only. Writers append its hash
+     * to the log, and the applier adds it, so the filters trail the index
+     * by whatever is in the log. Filters are served from copies folded
+     * from it on request; each is kept until the next batch, and then
+     * retired when the next request replaces it. The master filter,
+     * strata estimator and encoder are only touched under fold_lock. */
+    struct filter_log_t log;
+    pthread_t applier;
+    int applier_started;
+    struct inv_bloom_t *master;
+    struct filter_view_t *folded[BLOOM_MAX_COUNT];
+    uint64_t generation; /* Counts the batches applied. */
+    int filtered; /* Keys in the filters, which come first in key_idx. */
+    pthread_mutex_t fold_lock;
+    /* Likewise, only the deepest strata estimator is maintained. */
+    struct strata_estimator_t *strata;
+    struct filter_view_t *strata_views[STRATA_MAX_COUNT];
+    /* Rateless encoder over every filtered key, built on first use. */
+    struct riblt_encoder_t *riblt;
+    int hash_version;
     pthread_rwlock_t lock;
+    /* A sharded database holds no keys itself. It spreads them over the
+     * n_shards databases in shards by a prefix of their hash, and serves
+     * the sums of theirs as its filters. Each shard knows its place, so
+     * that it only takes its own keys when ingesting. */
+    struct keydb_t **shards;
+    int n_shards;
+    int shard;
+    /* The Berkeley DB environment, if one was asked for, which a sharded
+     * database shares among its shards and closes itself. Set locking if
+     * BDB keeps concurrent writers apart; without an environment it
+     * allows only one at a time. */
+    DB_ENV *env;
+    int env_owner;
+    int txn;
+    int locking;
 };
 
+/* Returns which of n shards keys with the given hash belong to, going by
+ * the first two bytes of the hash. */
+int
+shard_of(const fp160 hash, int n) {
+    return ((hash[0]<<8 | hash[1]) * n) >> 16;
+}
+
 int
 retry_rdlock(struct keydb_t *db) {
     while (pthread_rwlock_rdlock(&db->lock)) {
@@ -53,18 +211,539 @@ unlock(struct keydb_t *db) {
     return 0;
 }
 
+int
+read_begin(struct keydb_t *db) {
+    return epoch_enter(db->epoch);
+}
+
+void
+read_end(struct keydb_t *db, int token) {
+    epoch_exit(db->epoch, token);
+}
+
+/* Retires what the trigram index replaces, for it. */
+void
+retire_free(void *db_, void *ptr) {
+    struct keydb_t *db = db_;
+
+    epoch_retire(db->epoch, ptr, free);
+}
+
+void
+release_view(void *view_) {
+    struct filter_view_t *view = view_;
+
+    ibf_free(view->bloom);
+    strata_free(view->strata);
+    free(view);
+}
+
+/* Publishes view in *slot, retiring the one it replaces. Must be called
+ * with fold_lock held. */
+void
+publish_view(struct keydb_t *db, struct filter_view_t **slot,
+             struct filter_view_t *view) {
+    struct filter_view_t *old;
+
+    old = *slot;
+    __atomic_store_n(slot, view, __ATOMIC_RELEASE);
+    epoch_retire(db->epoch, old, release_view);
+}
+
+/* Returns the view in *slot if it is of the current generation, or NULL. */
+struct filter_view_t *
+current_view(struct keydb_t *db, struct filter_view_t **slot) {
+    struct filter_view_t *view;
+
+    view = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (view && view->generation == get_generation(db))
+        return view;
+    return NULL;
+}
+
+/* Fills in view->bloom, a filter with k hashes, N buckets and hashing
+ * scheme v, from the master filter, or as the sum of the shards' filters,
+ * along with its generation. Must be called with fold_lock held. Returns
+ * 0 on success. */
+int
+fold_bloom(struct keydb_t *db, struct filter_view_t *view, int k, size_t N,
+           int v) {
+    struct inv_bloom_t *filter;
+    uint64_t generation;
+    int i, token, ret;
+
+    if (!db->shards) {
+        view->generation = db->generation;
+        return ibf_fold_into(view->bloom, db->master);
+    }
+    /* Filters are linear, so the sum over disjoint shards is the filter of
+     * every key. */
+    view->generation = 0;
+    for (i=0; i<db->n_shards; i++) {
+        token = read_begin(db->shards[i]);
+        filter = get_bloom(db->shards[i], k, N, v, &generation);
+        ret = !filter || ibf_add(view->bloom, filter);
+        read_end(db->shards[i], token);
+        if (ret)
+            return -1;
+        view->generation += generation;
+    }
+    return 0;
+}
+
+/* As fold_bloom, for view->strata. */
+int
+fold_strata(struct keydb_t *db, struct filter_view_t *view, int k, size_t N,
+            int c, int v) {
+    struct strata_estimator_t *strata;
+    uint64_t generation;
+    int i, token, ret;
+
+    if (!db->shards) {
+        view->generation = db->generation;
+        return strata_fold_into(view->strata, db->strata);
+    }
+    view->generation = 0;
+    for (i=0; i<db->n_shards; i++) {
+        token = read_begin(db->shards[i]);
+        strata = get_strata(db->shards[i], k, N, c, v, &generation);
+        ret = !strata || strata_add(view->strata, strata);
+        read_end(db->shards[i], token);
+        if (ret)
+            return -1;
+        view->generation += generation;
+    }
+    return 0;
+}
+
+/* Must be called in a read section; the result is valid until it ends.
+ * A stale view is refolded into a new copy, and the old one retired. */
 struct inv_bloom_t *
-get_bloom(struct keydb_t *db, int idx) {
-    if (idx >= BLOOM_MAX_COUNT)
+get_bloom(struct keydb_t *db, int k, size_t N, int v, uint64_t *generation) {
+    struct filter_view_t *view;
+    int i;
+
+    if (!ibf_match(db->shards ? db->shards[0]->master : db->master,
+                k, BLOOM_MASTER_SIZE, v))
+        return NULL;
+
+    for (i=0; i<BLOOM_MAX_COUNT; i++)
+        if ((IBF_MIN_SIZE<<i) == N)
+            break;
+    if (i == BLOOM_MAX_COUNT)
+        return NULL;
+
+    view = current_view(db, &db->folded[i]);
+    if (!view) {
+        pthread_mutex_lock(&db->fold_lock);
+        view = current_view(db, &db->folded[i]);
+        if (!view && (view=calloc(1, sizeof(struct filter_view_t)))) {
+            view->bloom = ibf_allocate(k, N, v);
+            if (!view->bloom || fold_bloom(db, view, k, N, v)) {
+                release_view(view);
+                view = NULL;
+            } else
+                publish_view(db, &db->folded[i], view);
+        }
+        pthread_mutex_unlock(&db->fold_lock);
+        epoch_reclaim(db->epoch);
+    }
+    if (!view)
         return NULL;
-    return db->filters[idx];
+    if (generation)
+        *generation = view->generation;
+    return view->bloom;
+}
+
+int
+get_key_count(struct keydb_t *db) {
+    int i, count;
+
+    if (!db->shards)
+        return __atomic_load_n(&db->idx_count, __ATOMIC_ACQUIRE);
+    for (count=i=0; i<db->n_shards; i++)
+        count += get_key_count(db->shards[i]);
+    return count;
+}
+
+/* Returns the i-th indexed key. */
+struct key_idx_t *
+key_at(const struct keydb_t *db, int i) {
+    struct key_idx_t **segs;
+
+    segs = __atomic_load_n(&db->key_idx, __ATOMIC_ACQUIRE);
+    return &segs[i>>IDX_SEGMENT_BITS][i&(IDX_SEGMENT_SIZE-1)];
 }
 
+/* Returns the user ID of an indexed key. */
+const char *
+key_uid(const struct keydb_t *db, const struct key_idx_t *entry) {
+    return db->uids[entry->uid>>UID_SEGMENT_BITS]
+         + (entry->uid&(UID_SEGMENT_SIZE-1));
+}
+
+/* Appends uid to the arena, storing its offset in *off. A user ID never
+ * spans two segments; one longer than a segment, which no sane key has, is
+ * cut short. Returns 0 on success. */
+int
+intern_uid(struct keydb_t *db, const char *uid, uint32_t *off) {
+    size_t len, seg, used;
+
+    len = strlen(uid);
+    if (len >= UID_SEGMENT_SIZE)
+        len = UID_SEGMENT_SIZE-1;
+    seg = db->uid_end >> UID_SEGMENT_BITS;
+    used = db->uid_end & (UID_SEGMENT_SIZE-1);
+    if (used+len+1 > UID_SEGMENT_SIZE) {
+        seg++;
+        used = 0;
+    }
+    if (seg >= UID_MAX_SEGMENTS)
+        return -1;
+    if (!db->uids[seg]) {
+        /* Zeroed, so that snapshots of the slack at the ends of segments
+         * are reproducible. */
+        db->uids[seg] = calloc(1, UID_SEGMENT_SIZE);
+        if (!db->uids[seg]) return -1;
+    }
+    memcpy(db->uids[seg]+used, uid, len);
+    db->uids[seg][used+len] = '\0';
+    *off = (uint32_t)(seg << UID_SEGMENT_BITS | used);
+    db->uid_end = (seg << UID_SEGMENT_BITS) + used+len+1;
+    return 0;
+}
+
+/* Must be called in a read section, as with get_bloom. */
 struct strata_estimator_t *
-get_strata(struct keydb_t *db, int idx) {
-    if (idx >= STRATA_MAX_COUNT)
+get_strata(struct keydb_t *db, int k, size_t N, int c, int v,
+           uint64_t *generation) {
+    struct filter_view_t *view;
+    int i;
+
+    if (!strata_match(db->shards ? db->shards[0]->strata : db->strata,
+                k, N, STRATA_MASTER_DEPTH, v))
+        return NULL;
+
+    for (i=0; i<STRATA_MAX_COUNT; i++)
+        if ((STRATA_IBF_MIN_DEPTH<<i) == c)
+            break;
+    if (i == STRATA_MAX_COUNT)
+        return NULL;
+
+    view = current_view(db, &db->strata_views[i]);
+    if (!view) {
+        pthread_mutex_lock(&db->fold_lock);
+        view = current_view(db, &db->strata_views[i]);
+        if (!view && (view=calloc(1, sizeof(struct filter_view_t)))) {
+            view->strata = strata_allocate(k, N, c, v);
+            if (!view->strata || fold_strata(db, view, k, N, c, v)) {
+                release_view(view);
+                view = NULL;
+            } else
+                publish_view(db, &db->strata_views[i], view);
+        }
+        pthread_mutex_unlock(&db->fold_lock);
+        epoch_reclaim(db->epoch);
+    }
+    if (!view)
         return NULL;
-    return db->strata[idx];
+    if (generation)
+        *generation = view->generation;
+    return view->strata;
+}
+
+int
+get_hash_version(struct keydb_t *db) {
+    return db->hash_version;
+}
+
+uint64_t
+get_generation(struct keydb_t *db) {
+    uint64_t generation;
+    int i;
+
+    if (!db->shards)
+        return __atomic_load_n(&db->generation, __ATOMIC_ACQUIRE);
+    for (generation=i=0; i<db->n_shards; i++)
+        generation += get_generation(db->shards[i]);
+    return generation;
+}
+
+/* Adds indexed keys from to to-1 to encoder. Must be called in a read
+ * section. Returns 0 on success. */
+int
+riblt_add_keys(struct keydb_t *db, struct riblt_encoder_t *encoder, int from,
+               int to) {
+    int i;
+
+    for (i=from; i<to; i++)
+        if (riblt_encoder_add(encoder, key_at(db, i)->hash))
+            return -1;
+    return 0;
+}
+
+/* Copies symbols start to start+n-1 of the first n_keys filtered keys of
+ * db, which is not sharded, into out. Once built, the encoder is kept up to
+ * date by the applier, and the symbols it has produced are shared by every
+ * stream; the keys filtered since are taken out of the copy. */
+int
+riblt_symbols_of(struct keydb_t *db, int n_keys, size_t start, size_t n,
+                 struct riblt_symbol_t *out) {
+    const struct riblt_symbol_t *symbols;
+    struct riblt_encoder_t *encoder;
+    int token, filtered, i, ret;
+
+    ret = -1;
+    token = read_begin(db);
+    pthread_mutex_lock(&db->fold_lock);
+    if (!db->riblt) {
+        /* The applier is not held up while the encoder is built. The keys
+         * it filters meanwhile are added once it is. */
+        filtered = db->filtered;
+        pthread_mutex_unlock(&db->fold_lock);
+        encoder = riblt_encoder_allocate();
+        if (encoder && riblt_add_keys(db, encoder, 0, filtered)) {
+            riblt_encoder_free(encoder);
+            encoder = NULL;
+        }
+        pthread_mutex_lock(&db->fold_lock);
+        if (encoder && !db->riblt
+                && !riblt_add_keys(db, encoder, filtered, db->filtered)) {
+            db->riblt = encoder;
+            encoder = NULL;
+        }
+        riblt_encoder_free(encoder);
+    }
+    filtered = db->filtered;
+    if (db->riblt && filtered-n_keys <= RIBLT_MAX_LAG) {
+        symbols = riblt_encoder_symbols(db->riblt, start+n);
+        if (symbols) {
+            memcpy(out, symbols+start, n*sizeof(struct riblt_symbol_t));
+            ret = 0;
+        }
+    }
+    pthread_mutex_unlock(&db->fold_lock);
+    for (i=n_keys; !ret && i<filtered; i++)
+        riblt_symbols_remove(out, start, n, key_at(db, i)->hash);
+    read_end(db, token);
+    return ret;
+}
+
+/* Symbols are linear, like filters, so those of a sharded database are
+ * the sums of the shards'. */
+int
+sum_riblt_symbols(struct keydb_t *db, const struct riblt_set_t *set,
+                  size_t start, size_t n, struct riblt_symbol_t *out) {
+    struct riblt_symbol_t *symbols;
+    size_t j;
+    int i, ret;
+
+    symbols = malloc(n*sizeof(struct riblt_symbol_t));
+    if (!symbols) return -1;
+    memset(out, 0, n*sizeof(struct riblt_symbol_t));
+    ret = 0;
+    for (i=0; !ret && i<db->n_shards; i++) {
+        ret = riblt_symbols_of(db->shards[i], set->n_keys[i], start, n,
+                symbols);
+        for (j=0; !ret && j<n; j++)
+            riblt_symbol_add(&out[j], &symbols[j]);
+    }
+    free(symbols);
+    return ret;
+}
+
+int
+get_riblt_symbols(struct keydb_t *db, const struct riblt_set_t *set,
+                  size_t start, size_t n, struct riblt_symbol_t *out) {
+    if (db->shards)
+        return sum_riblt_symbols(db, set, start, n, out);
+    return riblt_symbols_of(db, set->n_keys[0], start, n, out);
+}
+
+/* Returns the number of keys in the filters of db, which is not sharded. */
+int
+filtered_keys(struct keydb_t *db) {
+    int n;
+
+    pthread_mutex_lock(&db->fold_lock);
+    n = db->filtered;
+    pthread_mutex_unlock(&db->fold_lock);
+    return n;
+}
+
+void
+get_riblt_set(struct keydb_t *db, struct riblt_set_t *set) {
+    int i;
+
+    if (!db->shards) {
+        set->n_keys[0] = filtered_keys(db);
+        return;
+    }
+    for (i=0; i<db->n_shards; i++)
+        set->n_keys[i] = filtered_keys(db->shards[i]);
+}
+
+/* Takes up to FILTER_BATCH hashes off the log and adds them to the
+ * filters and the encoder, as one generation. Returns the number taken. */
+int
+filter_log_apply(struct keydb_t *db) {
+    struct filter_log_t *log = &db->log;
+    struct filter_log_entry_t *entry;
+    uint64_t head;
+    int i, n;
+
+    pthread_mutex_lock(&db->fold_lock);
+    head = log->head;
+    for (n=0; n<FILTER_BATCH; n++) {
+        entry = &log->entries[(head+n) & (FILTER_LOG_SIZE-1)];
+        if (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != head+n+1)
+            break;
+        memcpy(log->batch[n], entry->hash, sizeof(fp160));
+        __atomic_store_n(&entry->seq, head+n+FILTER_LOG_SIZE,
+                         __ATOMIC_RELEASE);
+    }
+    __atomic_store_n(&log->head, head+n, __ATOMIC_RELAXED);
+    if (n) {
+        ibf_insert_batch(db->master, (const fp160 *)log->batch, n);
+        for (i=0; i<n; i++)
+            strata_insert(db->strata, log->batch[i]);
+        /* A failed update leaves the encoder to be rebuilt on next use. */
+        for (i=0; db->riblt && i<n; i++) {
+            if (riblt_encoder_add(db->riblt, log->batch[i])) {
+                riblt_encoder_free(db->riblt);
+                db->riblt = NULL;
+            }
+        }
+        db->filtered += n;
+        __atomic_add_fetch(&db->generation, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&db->fold_lock);
+    return n;
+}
+
+/* Returns non-zero iff the log holds a hash that can be taken. */
+int
+filter_log_pending(struct filter_log_t *log) {
+    uint64_t head;
+
+    head = __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+    return __atomic_load_n(&log->entries[head & (FILTER_LOG_SIZE-1)].seq,
+                           __ATOMIC_SEQ_CST) == head+1;
+}
+
+/* Appends hash to the log, waking the applier if it sleeps. A full log is
+ * drained by the writer itself. */
+void
+filter_log_append(struct keydb_t *db, const fp160 hash) {
+    struct filter_log_t *log = &db->log;
+    struct filter_log_entry_t *entry;
+    uint64_t pos;
+    int state;
+
+    pos = __atomic_fetch_add(&log->tail, 1, __ATOMIC_SEQ_CST);
+    entry = &log->entries[pos & (FILTER_LOG_SIZE-1)];
+    while (__atomic_load_n(&entry->seq, __ATOMIC_ACQUIRE) != pos)
+        if (!filter_log_apply(db))
+            sched_yield();
+    memcpy(entry->hash, hash, sizeof(fp160));
+    __atomic_store_n(&entry->seq, pos+1, __ATOMIC_SEQ_CST);
+
+    /* An idle applier is woken by the first append, and one waiting for a
+     * batch to fill up by the append that fills it. Only one append wakes
+     * it each time, so the writer rarely pays for a wakeup. */
+    state = __atomic_load_n(&log->sleeping, __ATOMIC_SEQ_CST);
+    if (state == LOG_FILLING &&
+        pos+1 - __atomic_load_n(&log->head, __ATOMIC_RELAXED) < FILTER_BATCH)
+        return;
+    if (state != LOG_AWAKE &&
+        __atomic_compare_exchange_n(&log->sleeping, &state, LOG_AWAKE, 0,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&log->lock);
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+    }
+}
+
+/* Applies the log in batches for as long as the database is open. Once the
+ * log runs empty, the applier waits for an append, and then for a full
+ * batch or FILTER_DELAY_MS, whichever comes first. */
+void *
+filter_applier(void *db_) {
+    struct keydb_t *db = db_;
+    struct filter_log_t *log = &db->log;
+    struct timespec deadline;
+    uint64_t queued;
+
+    pthread_mutex_lock(&log->lock);
+    while (!log->stop) {
+        pthread_mutex_unlock(&log->lock);
+        while (filter_log_apply(db));
+        epoch_reclaim(db->epoch);
+        pthread_mutex_lock(&log->lock);
+        /* An append either sees the state or is seen by the check. */
+        __atomic_store_n(&log->sleeping, LOG_IDLE, __ATOMIC_SEQ_CST);
+        if (!log->stop && !filter_log_pending(log))
+            pthread_cond_wait(&log->wake, &log->lock);
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += FILTER_DELAY_MS*1000000L;
+        if (deadline.tv_nsec >= 1000000000L) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000L;
+        }
+        __atomic_store_n(&log->sleeping, LOG_FILLING, __ATOMIC_SEQ_CST);
+        queued = __atomic_load_n(&log->tail, __ATOMIC_SEQ_CST) -
+                 __atomic_load_n(&log->head, __ATOMIC_RELAXED);
+        if (!log->stop && queued < FILTER_BATCH)
+            pthread_cond_timedwait(&log->wake, &log->lock, &deadline);
+        __atomic_store_n(&log->sleeping, LOG_AWAKE, __ATOMIC_SEQ_CST);
+    }
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+}
+
+/* Allocates the log and starts its applier. Returns 0 on success. */
+int
+filter_log_start(struct keydb_t *db) {
+    struct filter_log_t *log = &db->log;
+    uint64_t i;
+
+    log->entries = malloc(FILTER_LOG_SIZE*sizeof(struct filter_log_entry_t));
+    log->batch = malloc(FILTER_BATCH*sizeof(fp160));
+    if (!log->entries || !log->batch) return -1;
+    for (i=0; i<FILTER_LOG_SIZE; i++)
+        log->entries[i].seq = i;
+    if (pthread_mutex_init(&log->lock, 0)) return -1;
+    if (pthread_cond_init(&log->wake, 0)) {
+        pthread_mutex_destroy(&log->lock);
+        return -1;
+    }
+    if (pthread_create(&db->applier, NULL, filter_applier, db)) {
+        pthread_cond_destroy(&log->wake);
+        pthread_mutex_destroy(&log->lock);
+        return -1;
+    }
+    db->applier_started = 1;
+    return 0;
+}
+
+/* Stops the applier and applies whatever is left, so that the filters
+ * match the index. No writer may be appending. */
+void
+filter_log_stop(struct keydb_t *db) {
+    struct filter_log_t *log = &db->log;
+
+    if (db->applier_started) {
+        pthread_mutex_lock(&log->lock);
+        log->stop = 1;
+        pthread_cond_signal(&log->wake);
+        pthread_mutex_unlock(&log->lock);
+        pthread_join(db->applier, NULL);
+        pthread_cond_destroy(&log->wake);
+        pthread_mutex_destroy(&log->lock);
+        db->applier_started = 0;
+    }
+    if (log->entries)
+        while (filter_log_apply(db));
 }
 
 int
@@ -77,240 +756,2571 @@ retry_wrlock(struct keydb_t *db) {
     return 0;
 } 
 
+/* Returns where the table for type is published. */
+struct idx_table_t **
+idx_table_ref(struct keydb_t *db, int type) {
+    switch (type) {
+        case QUERY_ID32: return &db->by_id32;
+        case QUERY_ID64: return &db->by_id64;
+        case QUERY_FP:   return &db->by_fp;
+        default:         return &db->by_hash;
+    }
+}
+
+/* Returns the table for type, or NULL if nothing was filed in it yet. */
+struct idx_table_t *
+idx_table_for(struct keydb_t *db, int type) {
+    return __atomic_load_n(idx_table_ref(db, type), __ATOMIC_ACQUIRE);
+}
+
+/* Returns the value entry is filed under for the given query type. */
+uint64_t
+idx_table_key(const struct key_idx_t *entry, int type) {
+    uint64_t key;
+
+    switch (type) {
+        case QUERY_ID32: return entry->id32;
+        case QUERY_ID64: return entry->id64;
+        case IDX_HASH:
+            memcpy(&key, entry->hash, sizeof(key));
+            return key;
+        default:
+            memcpy(&key, entry->fp, sizeof(key));
+            return key;
+    }
+}
+
+/* Returns non-zero iff a and b match for the given query type. */
 int
-add_key_to_index(struct keydb_t *db, int version, int size, char *uid,
-                                fp160 hash, fp160 fp, uint32_t id32, uint64_t id64) {
-    struct key_idx_t *tmp;
-    int i;
+idx_table_match(const struct key_idx_t *a, const struct key_idx_t *b,
+                int type) {
+    switch (type) {
+        case QUERY_ID32: return a->id32 == b->id32;
+        case QUERY_ID64: return a->id64 == b->id64;
+        case IDX_HASH:   return !neq_fp160(a->hash, b->hash);
+        default:         return !neq_fp160(a->fp, b->fp);
+    }
+}
+
+/* Returns the first slot to probe for key, by Fibonacci hashing. */
+size_t
+idx_table_slot(const struct idx_table_t *table, uint64_t key) {
+    return (key*0x9E3779B97F4A7C15ULL >> 32) & table->mask;
+}
+
+/* Returns the position in slot, or -1 if it is empty. */
+int
+idx_table_get(const struct idx_table_t *table, size_t slot) {
+    return __atomic_load_n(&table->slots[slot], __ATOMIC_RELAXED);
+}
+
+void
+idx_table_put(struct idx_table_t *table, uint64_t key, int i) {
+    size_t slot;
+
+    for (slot=idx_table_slot(table, key); table->slots[slot] >= 0;
+            slot=(slot+1)&table->mask);
+    __atomic_store_n(&table->slots[slot], i, __ATOMIC_RELAXED);
+    table->count++;
+}
+
+void
+idx_table_free(struct idx_table_t *table) {
+    if (!table)
+        return;
+    free(table->slots);
+    free(table);
+}
+
+void
+release_idx_table(void *table) {
+    idx_table_free(table);
+}
+
+/* Replaces the index for type with a table of size slots holding the
+ * first n entries of key_idx. Returns 0 on success. */
+int
+idx_table_resize(struct keydb_t *db, int type, size_t size, int n) {
+    struct idx_table_t **ref, *table, *grown;
+    int j;
+
+    ref = idx_table_ref(db, type);
+    table = *ref;
+    grown = malloc(sizeof(struct idx_table_t));
+    if (!grown) return -1;
+    grown->slots = malloc(size*sizeof(int));
+    if (!grown->slots) {
+        free(grown);
+        return -1;
+    }
+    memset(grown->slots, 0xFF, size*sizeof(int));
+    grown->mask = size-1;
+    /* Refiling in key_idx order keeps each key's entries in order. */
+    grown->count = 0;
+    for (j=0; j<n; j++)
+        idx_table_put(grown, idx_table_key(key_at(db, j), type), j);
+    __atomic_store_n(ref, grown, __ATOMIC_RELEASE);
+    epoch_retire(db->epoch, table, release_idx_table);
+    return 0;
+}
+
+/* Adds key_idx entry i, the next unindexed one, to the index for type,
+ * replacing the table with one twice the size to keep it at most half
+ * full. Returns 0 on success. */
+int
+idx_table_add(struct keydb_t *db, int type, int i) {
+    struct idx_table_t *table;
+
+    table = *idx_table_ref(db, type);
+    if (!table || 2*(size_t)(table->count+1) > table->mask+1) {
+        if (idx_table_resize(db, type,
+                    table ? 2*(table->mask+1) : IDX_TABLE_MIN_SIZE, i))
+            return -1;
+        table = *idx_table_ref(db, type);
+    }
+    idx_table_put(table, idx_table_key(key_at(db, i), type), i);
+    return 0;
+}
+
+/* Grows the hash indexes up front to take n keys in all, and half as many
+ * again, so that they are not refiled under the write lock time and again
+ * as keys are added. Must be called with the write lock held, or before
+ * the database is shared. Returns 0 on success. */
+int
+idx_tables_reserve(struct keydb_t *db, int n) {
+    struct idx_table_t *table;
+    size_t size;
+    int type;
+
+    for (size=IDX_TABLE_MIN_SIZE; size < 3*(size_t)n; size*=2);
+    for (type=QUERY_ID32; type<=IDX_HASH; type++) {
+        if (type == QUERY_UID)
+            continue;
+        table = *idx_table_ref(db, type);
+        if ((!table || table->mask+1 < size)
+                && idx_table_resize(db, type, size, db->idx_count))
+            return -1;
+    }
+    return 0;
+}
 
-    if (db->idx_alloc <= db->idx_count) {
-        db->idx_alloc += 1024*1024;
-        tmp = realloc(db->key_idx, db->idx_alloc*sizeof(struct key_idx_t));
-        if (!tmp) return -1;
-        db->key_idx = tmp;
+/* Returns about how many keys db's database holds: the count BDB saved
+ * last, or failing that an estimate from the size of its file. */
+int
+stored_keys_guess(struct keydb_t *db) {
+    DB_HASH_STAT *hash_stat;
+    struct stat st;
+    uint64_t n;
+
+    n = 0;
+    if (!db->dbp->stat(db->dbp, NULL, &hash_stat, DB_FAST_STAT)) {
+        n = hash_stat->hash_nkeys;
+        free(hash_stat);
     }
+    if (!n && !stat(db->filename, &st))
+        n = st.st_size/IDX_KEY_SIZE_GUESS;
+    return n > INT_MAX/2 ? INT_MAX/2 : n;
+}
 
-    i = db->idx_count++;
-    db->key_idx[i].version = version;
-    db->key_idx[i].size = size;
-    db->key_idx[i].id32 = id32;
-    db->key_idx[i].id64 = id64;
-    db->key_idx[i].uid = strdup(uid);
-    memcpy(db->key_idx[i].hash, hash, sizeof(fp160));
-    memcpy(db->key_idx[i].fp, fp, sizeof(fp160));
+/* Files key_idx entry i, the next one unfiled under type, in the hash
+ * index for type, or the trigram index for QUERY_UID. Returns 0 on
+ * success. */
+int
+file_key(struct keydb_t *db, int type, int i) {
+    if (type == QUERY_UID)
+        return trigram_add(db->by_uid, i, key_uid(db, key_at(db, i)));
+    return idx_table_add(db, type, i);
+}
 
-    for (i=0; i<BLOOM_MAX_COUNT && db->filters[i]; i++)
-        ibf_insert(db->filters[i], hash);
-    for (i=0; i<STRATA_MAX_COUNT && db->strata[i]; i++)
-        strata_insert(db->strata[i], hash);
+/* Files key_idx entry i, the next unindexed one, in the hash and trigram
+ * indexes. Returns 0 on success. */
+int
+index_key(struct keydb_t *db, int i) {
+    int type;
 
+    for (type=QUERY_ID32; type<=IDX_HASH; type++)
+        if (file_key(db, type, i))
+            return -1;
     return 0;
 }
 
-struct keydb_t *
-open_key_db(const char *filename, char create) {
-    struct keydb_t *ret;
-    DBC *curs;
-    DBT key, data;
-    struct pgp_key_t pgp_key;
-    uint8_t *retdata, *retkey;
-    void *ptr;
-    size_t retklen, retdlen;
-    int flags, i;
-    int indexed;
+/* Returns non-zero iff a key with the given hash is in key_idx. Must be
+ * called in a read section or with the write lock held. */
+int
+has_key(struct keydb_t *db, const fp160 hash) {
+    struct key_idx_t probe;
+    struct idx_table_t *table;
+    size_t slot;
+    int i, count;
+
+    count = get_key_count(db);
+    table = idx_table_for(db, IDX_HASH);
+    if (!table)
+        return 0;
+    memcpy(probe.hash, hash, sizeof(fp160));
+    for (slot=idx_table_slot(table, idx_table_key(&probe, IDX_HASH));
+            (i=idx_table_get(table, slot)) >= 0; slot=(slot+1)&table->mask)
+        if (i < count && idx_table_match(key_at(db, i), &probe, IDX_HASH))
+            return 1;
+    return 0;
+}
 
-    ret = malloc(sizeof(struct keydb_t));
-    if (!ret) goto error;
+/* Appends a key to key_idx and, if file is set, files it in the hash and
+ * trigram indexes, leaving the filters alone. Returns 0 on success. */
+int
+store_key(struct keydb_t *db, int version, int size, const char *uid,
+          const fp160 hash, const fp160 fp, uint32_t id32, uint64_t id64,
+          int file) {
+    struct key_idx_t **segs, **old, *entry;
+    int i, seg;
+
+    /* Only the small table of segment pointers is ever replaced, by a
+     * copy with the new segment already in place. */
+    seg = db->idx_count >> IDX_SEGMENT_BITS;
+    if (seg >= db->idx_segments) {
+        segs = malloc((seg+1)*sizeof(struct key_idx_t *));
+        if (!segs) return -1;
+        segs[seg] = malloc(IDX_SEGMENT_SIZE*sizeof(struct key_idx_t));
+        if (!segs[seg]) {
+            free(segs);
+            return -1;
+        }
+        old = db->key_idx;
+        if (seg)
+            memcpy(segs, old, seg*sizeof(struct key_idx_t *));
+        __atomic_store_n(&db->key_idx, segs, __ATOMIC_RELEASE);
+        epoch_retire(db->epoch, old, free);
+        db->idx_segments = seg+1;
+    }
 
-    memset(ret, 0, sizeof(struct keydb_t));
-    memset(&key, 0, sizeof(key));
-    memset(&data, 0, sizeof(data));
+    i = db->idx_count;
+    entry = key_at(db, i);
+    memset(entry, 0, sizeof(*entry));
+    if (intern_uid(db, uid, &entry->uid)) return -1;
+    entry->version = version;
+    entry->size = size;
+    entry->id32 = id32;
+    entry->id64 = id64;
+    memcpy(entry->hash, hash, sizeof(fp160));
+    memcpy(entry->fp, fp, sizeof(fp160));
+    if (file && index_key(db, i)) return -1;
+
+    /* Only now can readers see it. */
+    __atomic_store_n(&db->idx_count, i+1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/* Stores a key and queues its hash for the filters. Appending under the
+ * write lock keeps the log in key_idx order. Refuses while the index is
+ * not ready, as while keys are ingested, which leaves the filters behind
+ * key_idx until it is done. */
+int
+add_key_to_index(struct keydb_t *db, int version, int size, char *uid,
+                                fp160 hash, fp160 fp, uint32_t id32, uint64_t id64) {
+    if (__atomic_load_n(&db->ready, __ATOMIC_ACQUIRE) != 1)
+        return -1;
+    if (store_key(db, version, size, uid, hash, fp, id32, id64, 1))
+        return -1;
+    filter_log_append(db, hash);
+    return 0;
+}
+
+/* Snapshots. close_key_db writes key_idx, the user ID arena, the master
+ * filter and the strata estimator to <database>.idx, tagged with the state
+ * of the database file it matches. open_key_db maps a snapshot that is
+ * still current instead of parsing every key in the database again; only
+ * the hash and trigram indexes are rebuilt from it. Record and arena
+ * segments are laid out whole, so they are used in place. */
+#define SNAPSHOT_MAGIC "KSNP"
+#define SNAPSHOT_FORMAT 1
+#define SNAPSHOT_SUFFIX ".idx"
+#define SNAPSHOT_HEADER_SIZE 4096
+#define IDX_SEGMENT_BYTES ((size_t)IDX_SEGMENT_SIZE*sizeof(struct key_idx_t))
+
+struct snapshot_header_t {
+    char magic[4];
+    uint32_t format;
+    uint32_t hash_version;
+    uint32_t record_size;
+    /* The database file the snapshot matches. */
+    uint64_t db_dev;
+    uint64_t db_ino;
+    uint64_t db_size;
+    uint64_t db_mtime_sec;
+    uint64_t db_mtime_nsec;
+    uint64_t idx_count;
+    uint64_t uid_end;
+    uint64_t ibf_len;
+    uint64_t strata_len;
+    /* Checksum of the records, the used part of the arena and the
+     * filters. */
+    uint64_t checksum;
+};
+
+/* Byte offsets of the parts of a snapshot. */
+struct snapshot_layout_t {
+    size_t records;
+    size_t uids;
+    size_t ibf;
+    size_t strata;
+    size_t end;
+};
+
+void
+snapshot_layout(const struct snapshot_header_t *header,
+                struct snapshot_layout_t *layout) {
+    size_t idx_segs, uid_segs;
+
+    idx_segs = (header->idx_count+IDX_SEGMENT_SIZE-1) >> IDX_SEGMENT_BITS;
+    uid_segs = (header->uid_end+UID_SEGMENT_SIZE-1) >> UID_SEGMENT_BITS;
+    layout->records = SNAPSHOT_HEADER_SIZE;
+    layout->uids = layout->records + idx_segs*IDX_SEGMENT_BYTES;
+    layout->ibf = layout->uids + uid_segs*UID_SEGMENT_SIZE;
+    layout->strata = layout->ibf + header->ibf_len;
+    layout->end = layout->strata + header->strata_len;
+}
+
+/* Folds len bytes of buf into the running checksum h. Regions must be
+ * folded in the same pieces on both ends, bar pieces whose length is a
+ * multiple of 8. */
+uint64_t
+snapshot_sum(uint64_t h, const uint8_t *buf, size_t len) {
+    uint64_t w;
+    size_t i;
+
+    for (i=0; i+8<=len; i+=8) {
+        memcpy(&w, buf+i, 8);
+        h = (h^w) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    for (; i<len; i++) {
+        h = (h^buf[i]) * 0x9E3779B97F4A7C15ULL;
+        h ^= h >> 29;
+    }
+    return h;
+}
+
+/* Copies the state of the database file at st into header. */
+void
+snapshot_db_state(struct snapshot_header_t *header, const struct stat *st) {
+    header->db_dev = st->st_dev;
+    header->db_ino = st->st_ino;
+    header->db_size = st->st_size;
+    header->db_mtime_sec = st->st_mtim.tv_sec;
+    header->db_mtime_nsec = st->st_mtim.tv_nsec;
+}
+
+/* Writes len bytes of buf at offset off in out, folding them into *h.
+ * Returns 0 on success. */
+int
+snapshot_put(FILE *out, size_t off, const void *buf, size_t len, uint64_t *h) {
+    *h = snapshot_sum(*h, buf, len);
+    if (fseeko(out, off, SEEK_SET)) return -1;
+    return fwrite(buf, 1, len, out) != len;
+}
+
+/* Writes a snapshot of db, which must match the closed database file at
+ * filename. The snapshot is written beside it and renamed into place, so a
+ * reader never sees half of one. Returns 0 on success. */
+int
+write_snapshot(struct keydb_t *db, const char *filename) {
+    struct snapshot_header_t header;
+    struct snapshot_layout_t layout;
+    struct stat st;
+    uint8_t *ibf, *strata;
+    char *path, *tmp_path;
+    FILE *out;
+    size_t i, len, n_segs;
+    int ret;
+
+    ret = -1;
+    out = NULL;
+    ibf = strata = NULL;
+    path = malloc(strlen(filename)+sizeof(SNAPSHOT_SUFFIX)+4);
+    tmp_path = malloc(strlen(filename)+sizeof(SNAPSHOT_SUFFIX)+4);
+    if (!path || !tmp_path) goto error;
+    sprintf(path, "%s%s", filename, SNAPSHOT_SUFFIX);
+    sprintf(tmp_path, "%s.tmp", path);
+    if (stat(filename, &st)) goto error;
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, 4);
+    header.format = SNAPSHOT_FORMAT;
+    header.hash_version = db->hash_version;
+    header.record_size = sizeof(struct key_idx_t);
+    snapshot_db_state(&header, &st);
+    header.idx_count = db->idx_count;
+    header.uid_end = db->uid_end;
+    ibf = ibf_write_binary(db->master, &len);
+    if (!ibf) goto error;
+    header.ibf_len = len;
+    strata = strata_write_binary(db->strata, &len);
+    if (!strata) goto error;
+    header.strata_len = len;
+    snapshot_layout(&header, &layout);
+
+    out = fopen(tmp_path, "wb");
+    if (!out) goto error;
+
+    header.checksum = 0;
+    for (i=0; i<(size_t)db->idx_count; i+=IDX_SEGMENT_SIZE) {
+        len = db->idx_count-i < IDX_SEGMENT_SIZE ?
+                db->idx_count-i : IDX_SEGMENT_SIZE;
+        if (snapshot_put(out, layout.records + i*sizeof(struct key_idx_t),
+                    db->key_idx[i>>IDX_SEGMENT_BITS],
+                    len*sizeof(struct key_idx_t), &header.checksum))
+            goto error;
+    }
+    n_segs = (db->uid_end+UID_SEGMENT_SIZE-1) >> UID_SEGMENT_BITS;
+    for (i=0; i<n_segs; i++) {
+        len = i+1 < n_segs ? UID_SEGMENT_SIZE : db->uid_end - i*UID_SEGMENT_SIZE;
+        if (snapshot_put(out, layout.uids + i*UID_SEGMENT_SIZE, db->uids[i],
+                    len, &header.checksum))
+            goto error;
+    }
+    if (snapshot_put(out, layout.ibf, ibf, header.ibf_len, &header.checksum))
+        goto error;
+    if (snapshot_put(out, layout.strata, strata, header.strata_len,
+                &header.checksum))
+        goto error;
+
+    /* The gaps left at the ends of segments read back as zeroes. */
+    if (ftruncate(fileno(out), layout.end)) goto error;
+    if (fseeko(out, 0, SEEK_SET)) goto error;
+    if (fwrite(&header, sizeof(header), 1, out) != 1) goto error;
+    if (fflush(out) || fsync(fileno(out))) goto error;
+    if (fclose(out)) {
+        out = NULL;
+        goto error;
+    }
+    out = NULL;
+    if (rename(tmp_path, path)) goto error;
+    ret = 0;
+
+error:
+    if (out) {
+        fclose(out);
+        unlink(tmp_path);
+    }
+    free(ibf);
+    free(strata);
+    free(path);
+    free(tmp_path);
+    return ret;
+}
+
+/* Loads key_idx and the filters of db from the snapshot for the database
+ * file at filename, whose state before opening is st, sizing the hash
+ * indexes but leaving the filing to index_loaded. Returns 0 on success, 1
+ * if there is no usable snapshot, leaving db untouched, and -1 on
+ * failure. */
+int
+load_snapshot(struct keydb_t *db, const char *filename, const struct stat *st) {
+    struct snapshot_header_t header, current;
+    struct snapshot_layout_t layout;
+    struct inv_bloom_t *master;
+    struct strata_estimator_t *strata;
+    struct stat snap_st;
+    uint8_t *map;
+    char *path;
+    size_t i, n_segs, used;
+    uint64_t sum;
+    int fd;
+
+    map = NULL;
+    master = NULL;
+    strata = NULL;
+    path = malloc(strlen(filename)+sizeof(SNAPSHOT_SUFFIX));
+    if (!path) return -1;
+    sprintf(path, "%s%s", filename, SNAPSHOT_SUFFIX);
+    fd = open(path, O_RDONLY);
+    free(path);
+    if (fd < 0)
+        return 1;
+    if (fstat(fd, &snap_st) || snap_st.st_size < SNAPSHOT_HEADER_SIZE) {
+        close(fd);
+        goto stale;
+    }
+    map = mmap(NULL, snap_st.st_size, PROT_READ|PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        map = NULL;
+        goto stale;
+    }
+
+    memcpy(&header, map, sizeof(header));
+    memset(&current, 0, sizeof(current));
+    snapshot_db_state(&current, st);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, 4)
+            || header.format != SNAPSHOT_FORMAT
+            || header.hash_version != (uint32_t)db->hash_version
+            || header.record_size != sizeof(struct key_idx_t)
+            || header.db_dev != current.db_dev
+            || header.db_ino != current.db_ino
+            || header.db_size != current.db_size
+            || header.db_mtime_sec != current.db_mtime_sec
+            || header.db_mtime_nsec != current.db_mtime_nsec
+            || header.idx_count > INT_MAX
+            || header.uid_end > (uint64_t)UID_MAX_SEGMENTS*UID_SEGMENT_SIZE
+            || header.ibf_len > (uint64_t)snap_st.st_size
+            || header.strata_len > (uint64_t)snap_st.st_size)
+        goto stale;
+    snapshot_layout(&header, &layout);
+    if (layout.end != (size_t)snap_st.st_size)
+        goto stale;
+
+    sum = snapshot_sum(0, map+layout.records,
+            header.idx_count*sizeof(struct key_idx_t));
+    sum = snapshot_sum(sum, map+layout.uids, header.uid_end);
+    sum = snapshot_sum(sum, map+layout.ibf, header.ibf_len);
+    sum = snapshot_sum(sum, map+layout.strata, header.strata_len);
+    if (sum != header.checksum)
+        goto stale;
+
+    master = ibf_from_binary(map+layout.ibf, header.ibf_len, &used);
+    if (!master || !ibf_match(master, BLOOM_HASH, BLOOM_MASTER_SIZE,
+                db->hash_version))
+        goto stale;
+    strata = strata_from_binary(map+layout.strata, header.strata_len);
+    if (!strata || !strata_match(strata, BLOOM_HASH, STRATA_IBF_SIZE,
+                STRATA_MASTER_DEPTH, db->hash_version))
+        goto stale;
+
+    /* Everything checks out; use the segments in place. */
+    n_segs = (header.idx_count+IDX_SEGMENT_SIZE-1) >> IDX_SEGMENT_BITS;
+    if (n_segs) {
+        db->key_idx = malloc(n_segs*sizeof(struct key_idx_t *));
+        if (!db->key_idx) goto error;
+    }
+    for (i=0; i<n_segs; i++)
+        db->key_idx[i] = (struct key_idx_t *)(map+layout.records
+                                              + i*IDX_SEGMENT_BYTES);
+    db->idx_segments = n_segs;
+    n_segs = (header.uid_end+UID_SEGMENT_SIZE-1) >> UID_SEGMENT_BITS;
+    for (i=0; i<n_segs; i++)
+        db->uids[i] = (char *)map+layout.uids + i*UID_SEGMENT_SIZE;
+    db->uid_end = header.uid_end;
+    db->snapshot = map;
+    db->snapshot_len = snap_st.st_size;
+    ibf_free(db->master);
+    db->master = master;
+    strata_free(db->strata);
+    db->strata = strata;
+
+    if (idx_tables_reserve(db, header.idx_count))
+        return -1;
+    db->idx_count = header.idx_count;
+    db->filtered = db->idx_count;
+    return 0;
+
+stale:
+    printf("Snapshot is missing, stale or corrupt; rescanning.\n");
+    ibf_free(master);
+    strata_free(strata);
+    if (map)
+        munmap(map, snap_st.st_size);
+    return 1;
+
+error:
+    ibf_free(master);
+    strata_free(strata);
+    munmap(map, snap_st.st_size);
+    return -1;
+}
+
+/* Returns non-zero iff ptr points into the snapshot db was loaded from. */
+int
+in_snapshot(const struct keydb_t *db, const void *ptr) {
+    return db->snapshot && (const uint8_t *)ptr >= db->snapshot
+        && (const uint8_t *)ptr < db->snapshot+db->snapshot_len;
+}
+
+/* Startup indexing. A reader thread pulls bulk buffers from a cursor and
+ * queues them for worker threads, which parse the keys into batches and
+ * insert them into filters of their own. The opening thread splices the
+ * batches into key_idx in cursor order, so the index comes out exactly as
+ * a scan on one thread would build it, and since filters are linear the
+ * partial ones are simply added up at the end. Bulk ingest runs the same
+ * pool over chunks of dump files instead of cursor buffers. */
+#define INDEX_THREADS_MAX 16
+#define INDEX_BUFFER_SIZE (1024*1024*4)
+#define INDEX_BUFFERS_PER_THREAD 2
+#define INDEX_PROGRESS_KEYS 100000
+
+/* A dump file being ingested. Its keys are counted as they are written. */
+struct ingest_file_t {
+    const char *filename;
+    struct dump_t *dump;
+    int keys;
+    int dups;
+    uint64_t bytes;
+};
+
+/* A bulk buffer read from the cursor, or a run of whole keys in a dump. */
+struct index_buf_t {
+    uint64_t seq;
+    DBT data;
+    struct dump_t chunk; /* Set when ingesting. */
+    int file;
+    int last;            /* Whether the chunk ends its file. */
+    size_t end;          /* Offset of the chunk's end in its file. */
+    struct index_buf_t *next;
+};
+
+/* The keys parsed from one buffer. Each record's uid is an offset into
+ * uids until the batch is spliced. */
+struct index_batch_t {
+    uint64_t seq;
+    struct key_idx_t *keys;
+    uint8_t **data; /* The keys themselves, in the dump, when ingesting. */
+    int n_keys;
+    int alloc;
+    char *uids;
+    size_t uids_len;
+    size_t uids_alloc;
+    int views;
+    int dups;       /* Ingested keys found to be duplicates on splicing. */
+    int *bounds;    /* Where the keys of each shard start, when they are
+                     * routed to shards, and where the last one's end. */
+    int file;
+    int last;
+    size_t end;
+    struct index_batch_t *next;
+};
+
+struct index_job_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Broadcast on every change below. */
+    DBC *curs;
+    struct index_buf_t *todo;
+    struct index_buf_t *todo_tail;
+    struct index_buf_t *idle;
+    struct index_batch_t *done;
+    uint64_t read;     /* Buffers read so far. */
+    uint64_t spliced;  /* Batches spliced so far. */
+    uint64_t max_ahead; /* Bound on read-spliced, which bounds memory. */
+    struct ingest_file_t *files; /* The dumps to ingest, in order. */
+    int n_files;
+    float excl_pct;    /* Share of ingested keys to drop at random. */
+    int n_shards;      /* Shards to route ingested keys to, or 0. */
+    int eof;
+    int failed;
+};
+
+struct index_worker_t {
+    pthread_t thread;
+    struct index_job_t *job;
+    struct inv_bloom_t *master;
+    struct strata_estimator_t *strata;
+    unsigned short xsubi[3];
+};
+
+void
+index_batch_free(struct index_batch_t *batch) {
+    if (!batch)
+        return;
+    free(batch->keys);
+    free(batch->data);
+    free(batch->uids);
+    free(batch->bounds);
+    free(batch);
+}
+
+/* Appends a parsed key to batch. Returns 0 on success. */
+int
+index_batch_add(struct index_batch_t *batch, const struct pgp_key_t *key) {
+    struct key_idx_t *entry, *keys;
+    uint8_t **data;
+    size_t len;
+    char *uids;
+
+    if (batch->n_keys >= batch->alloc) {
+        batch->alloc = batch->alloc ? 2*batch->alloc : 1024;
+        keys = realloc(batch->keys, batch->alloc*sizeof(struct key_idx_t));
+        if (!keys) return -1;
+        batch->keys = keys;
+        if (batch->views) {
+            data = realloc(batch->data, batch->alloc*sizeof(uint8_t *));
+            if (!data) return -1;
+            batch->data = data;
+        }
+    }
+    len = strlen(key->user_id)+1;
+    if (batch->uids_len+len > batch->uids_alloc) {
+        batch->uids_alloc = 2*(batch->uids_len+len);
+        uids = realloc(batch->uids, batch->uids_alloc);
+        if (!uids) return -1;
+        batch->uids = uids;
+    }
+    memcpy(batch->uids+batch->uids_len, key->user_id, len);
+
+    if (batch->views)
+        batch->data[batch->n_keys] = key->data;
+    entry = &batch->keys[batch->n_keys++];
+    memset(entry, 0, sizeof(*entry));
+    entry->version = key->version;
+    entry->size = key->len;
+    entry->id32 = key->id32;
+    entry->id64 = key->id64;
+    entry->uid = batch->uids_len;
+    memcpy(entry->hash, key->hash, sizeof(fp160));
+    memcpy(entry->fp, key->fp, sizeof(fp160));
+    batch->uids_len += len;
+    return 0;
+}
+
+/* Adds a parsed key to batch and the worker's filters, and frees its user
+ * ID. Ingested keys only go into the filters once splicing has ruled out
+ * that they are duplicates. Returns 0 on success. */
+int
+index_parsed(struct index_worker_t *worker, struct index_batch_t *batch,
+             struct pgp_key_t *pgp_key) {
+    int ret;
+
+    ret = index_batch_add(batch, pgp_key);
+    if (!ret && !batch->views) {
+        ibf_insert(worker->master, pgp_key->hash);
+        strata_insert(worker->strata, pgp_key->hash);
+    }
+    free(pgp_key->user_id);
+    return ret;
+}
+
+/* Orders the keys in batch by which of n_shards shards they belong to,
+ * keeping their order within each, and notes where each shard's keys
+ * start. Returns 0 on success. */
+int
+index_batch_route(struct index_batch_t *batch, int n_shards) {
+    struct key_idx_t *keys;
+    uint8_t **data;
+    int *next;
+    int i, s, ret;
+
+    ret = -1;
+    batch->bounds = calloc(n_shards+1, sizeof(int));
+    next = malloc(n_shards*sizeof(int));
+    keys = malloc((batch->n_keys+1)*sizeof(struct key_idx_t));
+    data = malloc((batch->n_keys+1)*sizeof(uint8_t *));
+    if (!batch->bounds || !next || !keys || !data) goto out;
+
+    for (i=0; i<batch->n_keys; i++)
+        batch->bounds[shard_of(batch->keys[i].hash, n_shards)+1]++;
+    for (s=0; s<n_shards; s++) {
+        batch->bounds[s+1] += batch->bounds[s];
+        next[s] = batch->bounds[s];
+    }
+    for (i=0; i<batch->n_keys; i++) {
+        s = shard_of(batch->keys[i].hash, n_shards);
+        keys[next[s]] = batch->keys[i];
+        data[next[s]++] = batch->data[i];
+    }
+    free(batch->keys);
+    free(batch->data);
+    batch->keys = keys;
+    batch->data = data;
+    batch->alloc = batch->n_keys+1;
+    keys = NULL;
+    data = NULL;
+    ret = 0;
+out:
+    free(keys);
+    free(data);
+    free(next);
+    return ret;
+}
+
+/* Parses every key in buf into a new batch and the worker's filters.
+ * Returns NULL on failure. */
+struct index_batch_t *
+index_parse(struct index_worker_t *worker, struct index_buf_t *buf) {
+    struct index_batch_t *batch;
+    struct pgp_key_t pgp_key;
+    uint8_t *retdata, *retkey;
+    size_t retklen, retdlen;
+    void *ptr;
+
+    batch = calloc(1, sizeof(struct index_batch_t));
+    if (!batch) return NULL;
+    batch->seq = buf->seq;
+
+    if (buf->chunk.data) {
+        batch->views = 1;
+        batch->file = buf->file;
+        batch->last = buf->last;
+        batch->end = buf->end;
+        while (!dump_next_key(&buf->chunk, &pgp_key)) {
+            if (parse_key_metadata(&pgp_key))
+                continue;
+            if (100*erand48(worker->xsubi) < worker->job->excl_pct) {
+                free(pgp_key.user_id);
+                continue;
+            }
+            if (index_parsed(worker, batch, &pgp_key))
+                goto error;
+        }
+        if (worker->job->n_shards
+                && index_batch_route(batch, worker->job->n_shards))
+            goto error;
+        return batch;
+    }
+
+    DB_MULTIPLE_INIT(ptr, &buf->data);
+    while (1) {
+        DB_MULTIPLE_KEY_NEXT(ptr, &buf->data, retkey, retklen, retdata, retdlen);
+        if (!ptr)
+            break;
+        pgp_key.data = retdata;
+        pgp_key.len = retdlen;
+
+        if (parse_key_metadata(&pgp_key))
+            continue;
+        if (index_parsed(worker, batch, &pgp_key))
+            goto error;
+    }
+    return batch;
+error:
+    index_batch_free(batch);
+    return NULL;
+}
+
+void *
+index_worker(void *arg) {
+    struct index_worker_t *worker;
+    struct index_job_t *job;
+    struct index_batch_t *batch;
+    struct index_buf_t *buf;
+
+    worker = arg;
+    job = worker->job;
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->todo && !job->eof && !job->failed)
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (!job->todo || job->failed)
+            break;
+        buf = job->todo;
+        job->todo = buf->next;
+        pthread_mutex_unlock(&job->lock);
+
+        batch = index_parse(worker, buf);
+
+        pthread_mutex_lock(&job->lock);
+        buf->next = job->idle;
+        job->idle = buf;
+        if (batch) {
+            batch->next = job->done;
+            job->done = batch;
+        } else {
+            job->failed = 1;
+        }
+        pthread_cond_broadcast(&job->cond);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/* Filing keys in the hash and trigram indexes costs about as much as
+ * copying them into key_idx. While the database is indexed, each index is
+ * filled by a thread of its own trailing the splicer, as an index takes
+ * one writer at a time. Keys are counted in idx_count before they are
+ * filed, which only lookups made before the index is ready can notice. */
+struct index_filer_t {
+    pthread_t thread;
+    struct index_filing_t *filing;
+    int type; /* The QUERY_* or IDX_HASH index the thread fills. */
+};
+
+struct index_filing_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Broadcast on every change below. */
+    struct keydb_t *db;
+    int from;   /* The first key to file. */
+    int stored; /* Keys in key_idx that can be filed. */
+    int last;   /* Set once no more keys will be stored. */
+    int failed;
+    int n_started;
+    struct index_filer_t filers[IDX_HASH];
+};
+
+void *
+index_filer(void *arg) {
+    struct index_filer_t *filer;
+    struct index_filing_t *filing;
+    struct keydb_t *db;
+    int i, n, token, ret;
+
+    filer = arg;
+    filing = filer->filing;
+    db = filing->db;
+    pthread_mutex_lock(&filing->lock);
+    for (i=filing->from; ; ) {
+        while (i == filing->stored && !filing->last && !filing->failed)
+            pthread_cond_wait(&filing->cond, &filing->lock);
+        if (filing->failed || i == filing->stored)
+            break;
+        n = filing->stored;
+        pthread_mutex_unlock(&filing->lock);
+
+        /* The splicer may replace the table of key_idx segments. */
+        token = read_begin(db);
+        for (ret=0; !ret && i<n; i++)
+            ret = file_key(db, filer->type, i);
+        read_end(db, token);
+
+        pthread_mutex_lock(&filing->lock);
+        if (ret) {
+            filing->failed = 1;
+            pthread_cond_broadcast(&filing->cond);
+        }
+    }
+    pthread_mutex_unlock(&filing->lock);
+    return NULL;
+}
+
+/* Makes the keys stored up to position stored available to filing. */
+void
+index_filing_post(struct index_filing_t *filing, int stored) {
+    pthread_mutex_lock(&filing->lock);
+    filing->stored = stored;
+    pthread_cond_broadcast(&filing->cond);
+    pthread_mutex_unlock(&filing->lock);
+}
+
+/* Waits for filing's threads to file every key stored, or makes them give
+ * up if failed is set, and releases filing. Returns 0 if every key was
+ * filed. */
+int
+index_filing_finish(struct index_filing_t *filing, int failed) {
+    int i, ret;
+
+    pthread_mutex_lock(&filing->lock);
+    filing->last = 1;
+    if (failed)
+        filing->failed = 1;
+    pthread_cond_broadcast(&filing->cond);
+    pthread_mutex_unlock(&filing->lock);
+    for (i=0; i<filing->n_started; i++)
+        pthread_join(filing->filers[i].thread, NULL);
+    ret = filing->failed ? -1 : 0;
+    pthread_cond_destroy(&filing->cond);
+    pthread_mutex_destroy(&filing->lock);
+    return ret;
+}
+
+/* Starts a thread for each index, to file db's keys from position from on
+ * as they are posted. Returns 0 on success. */
+int
+index_filing_start(struct index_filing_t *filing, struct keydb_t *db,
+                   int from) {
+    struct index_filer_t *filer;
+    int type;
+
+    memset(filing, 0, sizeof(*filing));
+    if (pthread_mutex_init(&filing->lock, 0)) return -1;
+    if (pthread_cond_init(&filing->cond, 0)) {
+        pthread_mutex_destroy(&filing->lock);
+        return -1;
+    }
+    filing->db = db;
+    filing->from = filing->stored = from;
+    for (type=QUERY_ID32; type<=IDX_HASH; type++) {
+        filer = &filing->filers[filing->n_started];
+        filer->filing = filing;
+        filer->type = type;
+        if (pthread_create(&filer->thread, NULL, index_filer, filer)) {
+            index_filing_finish(filing, 1);
+            return -1;
+        }
+        filing->n_started++;
+    }
+    return 0;
+}
+
+/* Copies keys from to to-1 of batch into key_idx, printing progress now
+ * and then. Ingested keys that are already there, from the database or
+ * earlier in the dumps, are counted and have their data cleared instead.
+ * Keys are left to filing's threads to file if it is not NULL. Returns 0
+ * on success. */
+int
+index_splice(struct keydb_t *db, struct index_batch_t *batch, int from,
+             int to, uint64_t start, struct index_filing_t *filing) {
+    struct key_idx_t *entry;
+    double secs;
+    int i, ret;
+
+    /* Lookups may be running against the partial index, but only other
+     * writers and filter folds wait for the lock. */
+    if (retry_wrlock(db)) return -1;
+    if (db->stop) {
+        unlock(db);
+        return -1;
+    }
+    for (i=from; i<to; i++) {
+        entry = &batch->keys[i];
+        if (batch->views && has_key(db, entry->hash)) {
+            batch->data[i] = NULL;
+            batch->dups++;
+            continue;
+        }
+        ret = store_key(db, entry->version, entry->size,
+                batch->uids+entry->uid, entry->hash, entry->fp,
+                entry->id32, entry->id64, !filing);
+        if (ret) {
+            unlock(db);
+            return -1;
+        }
+        if (db->idx_count%INDEX_PROGRESS_KEYS == 0) {
+            secs = (us_timestamp()-start)/1e6;
+            printf("Indexing...%d (%.0f keys/s)\n", db->idx_count,
+                    secs > 0 ? db->idx_count/secs : 0);
+        }
+    }
+    unlock(db);
+    if (filing)
+        index_filing_post(filing, db->idx_count);
+    epoch_reclaim(db->epoch);
+    return 0;
+}
+
+/* Waits for the batch that comes next in reading order and takes it off
+ * the done list. Returns NULL once every batch has been taken or the job
+ * has failed. */
+struct index_batch_t *
+index_next_batch(struct index_job_t *job) {
+    struct index_batch_t *batch, **prev;
+
+    batch = NULL;
+    pthread_mutex_lock(&job->lock);
+    while (!job->failed) {
+        for (prev=&job->done; *prev && (*prev)->seq != job->spliced;
+                prev=&(*prev)->next);
+        if (*prev) {
+            batch = *prev;
+            *prev = batch->next;
+            break;
+        }
+        if (job->eof && job->spliced == job->read)
+            break;
+        pthread_cond_wait(&job->cond, &job->lock);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return batch;
+}
+
+/* Marks the batch last taken as handled, failing the job if failed is
+ * set. */
+void
+index_batch_done(struct index_job_t *job, int failed) {
+    pthread_mutex_lock(&job->lock);
+    job->spliced++;
+    if (failed)
+        job->failed = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+/* Reads the bulk buffer after the cursor's position into buf, growing it
+ * if a single record doesn't fit. Returns 0 on success, DB_NOTFOUND at
+ * the end and another error code on failure. */
+int
+index_read(DBC *curs, struct index_buf_t *buf) {
+    DBT key;
+    void *tmp;
+    int ret;
+
+    memset(&key, 0, sizeof(key));
+    while ((ret = curs->c_get(curs, &key, &buf->data,
+                    DB_MULTIPLE_KEY | DB_NEXT)) == DB_BUFFER_SMALL) {
+        buf->data.ulen = (buf->data.size+1023) & ~(u_int32_t)1023;
+        tmp = realloc(buf->data.data, buf->data.ulen);
+        if (!tmp) return ENOMEM;
+        buf->data.data = tmp;
+    }
+    return ret;
+}
+
+/* Queues buf to be parsed. The job's lock must be held. */
+void
+index_queue(struct index_job_t *job, struct index_buf_t *buf) {
+    buf->seq = job->read++;
+    buf->next = NULL;
+    if (job->todo)
+        job->todo_tail->next = buf;
+    else
+        job->todo = buf;
+    job->todo_tail = buf;
+    pthread_cond_broadcast(&job->cond);
+}
+
+void *
+index_reader(void *arg) {
+    struct index_job_t *job;
+    struct index_buf_t *buf;
+    int ret;
+
+    job = arg;
+    pthread_mutex_lock(&job->lock);
+    while (1) {
+        while (!job->failed
+                && (!job->idle || job->read-job->spliced >= job->max_ahead))
+            pthread_cond_wait(&job->cond, &job->lock);
+        if (job->failed)
+            break;
+        buf = job->idle;
+        job->idle = buf->next;
+        pthread_mutex_unlock(&job->lock);
+
+        ret = index_read(job->curs, buf);
+
+        pthread_mutex_lock(&job->lock);
+        if (ret) {
+            buf->next = job->idle;
+            job->idle = buf;
+            job->eof = 1;
+            if (ret != DB_NOTFOUND)
+                job->failed = 1;
+            pthread_cond_broadcast(&job->cond);
+            break;
+        }
+        index_queue(job, buf);
+    }
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+}
+
+/* Starts n_threads workers, counting those started in *n_started. Returns 0
+ * on success. */
+int
+index_workers_start(struct index_worker_t *workers, int n_threads,
+                    int *n_started) {
+    int i;
+
+    for (i=0; i<n_threads; i++) {
+        if (pthread_create(&workers[i].thread, NULL, index_worker, &workers[i]))
+            return -1;
+        (*n_started)++;
+    }
+    return 0;
+}
+
+/* Fails job, so that its threads give up. */
+void
+index_job_fail(struct index_job_t *job) {
+    pthread_mutex_lock(&job->lock);
+    job->failed = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+}
+
+void
+index_workers_join(struct index_worker_t *workers, int n_started) {
+    int i;
+
+    for (i=0; i<n_started; i++)
+        pthread_join(workers[i].thread, NULL);
+}
+
+/* Adds the workers' filters to db's, which must be write-locked. Every key
+ * is in exactly one worker's filters. Returns 0 on success. */
+int
+index_workers_merge(struct keydb_t *db, struct index_worker_t *workers,
+                    int n_threads) {
+    int i;
+
+    for (i=0; i<n_threads; i++)
+        if (ibf_add(db->master, workers[i].master)
+                || strata_add(db->strata, workers[i].strata))
+            return -1;
+    return 0;
+}
+
+void
+index_job_free(struct index_job_t *job, struct index_worker_t *workers,
+               int n_threads) {
+    struct index_batch_t *batch;
+    struct index_buf_t *buf;
+    int i;
+
+    for (i=0; i<n_threads; i++) {
+        ibf_free(workers[i].master);
+        strata_free(workers[i].strata);
+    }
+    while (job->done) {
+        batch = job->done;
+        job->done = batch->next;
+        index_batch_free(batch);
+    }
+    while (job->todo) {
+        buf = job->todo;
+        job->todo = buf->next;
+        free(buf->data.data);
+        free(buf);
+    }
+    while (job->idle) {
+        buf = job->idle;
+        job->idle = buf->next;
+        free(buf->data.data);
+        free(buf);
+    }
+    pthread_cond_destroy(&job->cond);
+    pthread_mutex_destroy(&job->lock);
+}
+
+/* Sets up job and n_threads workers, with filters of their own if filters
+ * is set, and buffers for them, of size bytes each unless size is 0.
+ * Returns 0 on success. */
+int
+index_job_init(struct keydb_t *db, struct index_job_t *job,
+               struct index_worker_t *workers, int n_threads, size_t size,
+               int filters) {
+    struct index_buf_t *buf;
+    int i;
+
+    memset(job, 0, sizeof(*job));
+    memset(workers, 0, n_threads*sizeof(struct index_worker_t));
+    if (pthread_mutex_init(&job->lock, 0)) return -1;
+    if (pthread_cond_init(&job->cond, 0)) {
+        pthread_mutex_destroy(&job->lock);
+        return -1;
+    }
+
+    job->max_ahead = 2*INDEX_BUFFERS_PER_THREAD*n_threads;
+    for (i=0; i<INDEX_BUFFERS_PER_THREAD*n_threads; i++) {
+        buf = calloc(1, sizeof(struct index_buf_t));
+        if (!buf) goto error;
+        buf->next = job->idle;
+        job->idle = buf;
+        if (!size)
+            continue;
+        buf->data.data = malloc(size);
+        if (!buf->data.data) goto error;
+        buf->data.ulen = size;
+        buf->data.flags = DB_DBT_USERMEM;
+    }
+    for (i=0; i<n_threads; i++) {
+        workers[i].job = job;
+        if (!filters)
+            continue;
+        workers[i].master = ibf_allocate(BLOOM_HASH, BLOOM_MASTER_SIZE,
+                db->hash_version);
+        workers[i].strata = strata_allocate(BLOOM_HASH, STRATA_IBF_SIZE,
+                STRATA_MASTER_DEPTH, db->hash_version);
+        if (!workers[i].master || !workers[i].strata) goto error;
+    }
+    return 0;
+error:
+    index_job_free(job, workers, n_threads);
+    return -1;
+}
+
+/* Returns the number of worker threads to index with. */
+int
+index_threads() {
+    long cpus;
+
+    cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > INDEX_THREADS_MAX ? INDEX_THREADS_MAX : cpus;
+}
+
+/* Indexes every key in db's database, which must be empty of keys so
+ * far. Returns 0 on success. */
+int
+index_key_db(struct keydb_t *db) {
+    struct index_worker_t workers[INDEX_THREADS_MAX];
+    struct index_filing_t filing, *filer;
+    struct index_batch_t *batch;
+    struct index_job_t job;
+    pthread_t reader;
+    uint64_t start;
+    int n_threads, n_started, reader_started, locked, ret;
+
+    if (retry_wrlock(db)) return -1;
+    ret = idx_tables_reserve(db, stored_keys_guess(db));
+    unlock(db);
+    if (ret) return -1;
+
+    ret = -1;
+    n_started = reader_started = 0;
+    filer = NULL;
+    start = us_timestamp();
+    n_threads = index_threads();
+    if (index_job_init(db, &job, workers, n_threads, INDEX_BUFFER_SIZE, 1))
+        return -1;
+    if (n_threads > 1 && !index_filing_start(&filing, db, db->idx_count))
+        filer = &filing;
+    if (db->dbp->cursor(db->dbp, NULL, &job.curs, DB_CURSOR_BULK)) goto out;
+    if (index_workers_start(workers, n_threads, &n_started)) goto out;
+    if (pthread_create(&reader, NULL, index_reader, &job)) goto out;
+    reader_started = 1;
+    printf("Indexing with %d threads.\n", n_threads);
+
+    /* Splice each batch in cursor order as soon as it is done. */
+    while ((batch = index_next_batch(&job))) {
+        ret = index_splice(db, batch, 0, batch->n_keys, start, filer);
+        index_batch_free(batch);
+        index_batch_done(&job, ret);
+    }
+    pthread_mutex_lock(&job.lock);
+    ret = job.failed ? -1 : 0;
+    pthread_mutex_unlock(&job.lock);
+
+out:
+    if (ret)
+        index_job_fail(&job);
+    if (reader_started)
+        pthread_join(reader, NULL);
+    index_workers_join(workers, n_started);
+    if (job.curs)
+        job.curs->c_close(job.curs);
+    if (filer && index_filing_finish(filer, ret))
+        ret = -1;
+
+    locked = !ret && !retry_wrlock(db);
+    if (locked)
+        pthread_mutex_lock(&db->fold_lock);
+    if (!locked || index_workers_merge(db, workers, n_threads))
+        ret = -1;
+    if (!ret) {
+        db->filtered = db->idx_count;
+        __atomic_add_fetch(&db->generation, 1, __ATOMIC_RELEASE);
+        db->indexed = 1;
+        __atomic_store_n(&db->ready, 1, __ATOMIC_RELEASE);
+    }
+    if (locked) {
+        pthread_mutex_unlock(&db->fold_lock);
+        unlock(db);
+    }
+    if (!ret)
+        printf("Indexed %d keys in %.1f s.\n", get_key_count(db),
+                (us_timestamp()-start)/1e6);
+
+    index_job_free(&job, workers, n_threads);
+    return ret;
+}
+
+/* Files the keys loaded from a snapshot in the hash and trigram indexes,
+ * which load_snapshot sized for them, on a thread per index if there is
+ * more than one core. Returns 0 on success. */
+int
+index_loaded(struct keydb_t *db) {
+    struct index_filing_t filing;
+    int i;
+
+    if (index_threads() > 1 && !index_filing_start(&filing, db, 0)) {
+        index_filing_post(&filing, db->idx_count);
+        return index_filing_finish(&filing, 0);
+    }
+    for (i=0; i<db->idx_count; i++)
+        if (index_key(db, i))
+            return -1;
+    return 0;
+}
+
+void *
+index_thread(void *db_) {
+    struct keydb_t *db = db_;
+
+    if (index_key_db(db)) {
+        if (!retry_wrlock(db)) {
+            if (!db->stop)
+                printf("Indexing failed; index-dependent requests stay "
+                       "disabled.\n");
+            __atomic_store_n(&db->ready, -1, __ATOMIC_RELEASE);
+            unlock(db);
+        }
+        return NULL;
+    }
+    printf("Index contains %d keys.\n", get_key_count(db));
+    return NULL;
+}
+
+/* Locks and lock objects a transaction may hold, enough for a bulk put of
+ * a full MULTIPUT_SIZE buffer. */
+#define ENV_MAX_LOCKS (1<<17)
+
+/* Opens the environment conf asks for in the directory of filename, with
+ * a buffer pool of conf->cache_mb and either transactions or concurrent
+ * data store locking. Returns NULL on failure. */
+DB_ENV *
+open_env(const char *filename, const struct keydb_env_t *conf) {
+    DB_ENV *env;
+    char *home, *slash;
+    u_int32_t flags;
+    int ret;
+
+    home = strdup(filename);
+    if (!home) return NULL;
+    slash = strrchr(home, '/');
+    if (slash)
+        slash[slash == home] = '\0';
+    else
+        strcpy(home, ".");
+    if (db_env_create(&env, 0)) {
+        free(home);
+        return NULL;
+    }
+
+    ret = 0;
+    flags = DB_CREATE | DB_THREAD | DB_INIT_MPOOL;
+    if (conf->cache_mb)
+        ret = env->set_cachesize(env, conf->cache_mb/1024,
+                (conf->cache_mb%1024)*1024*1024, 1);
+    if (conf->txn) {
+        /* Commits that overlap share a log flush, so concurrent writers
+         * commit as a group. Without sync they don't wait for the disk. */
+        flags |= DB_INIT_TXN | DB_INIT_LOG | DB_INIT_LOCK | DB_RECOVER;
+        if (!ret) ret = env->set_lk_max_locks(env, ENV_MAX_LOCKS);
+        if (!ret) ret = env->set_lk_max_objects(env, ENV_MAX_LOCKS);
+        if (!ret) ret = env->set_lk_detect(env, DB_LOCK_DEFAULT);
+        if (!ret) ret = env->log_set_config(env, DB_LOG_AUTO_REMOVE, 1);
+        if (!ret && conf->txn == KEYDB_TXN_NOSYNC)
+            ret = env->set_flags(env, DB_TXN_WRITE_NOSYNC, 1);
+    } else
+        flags |= DB_INIT_CDB;
+    if (!ret)
+        ret = env->open(env, home, flags, 0);
+    free(home);
+    if (ret) {
+        printf("Error opening environment: %s\n", db_strerror(ret));
+        env->close(env, 0);
+        return NULL;
+    }
+    return env;
+}
+
+/* Checkpoints and closes env. Returns 0 on success. */
+int
+close_env(DB_ENV *env, int txn) {
+    int ret;
+
+    ret = 0;
+    if (txn && env->txn_checkpoint(env, 0, 0, 0))
+        ret = -1;
+    if (env->close(env, 0))
+        ret = -1;
+    return ret;
+}
+
+/* How open_key_db_mode builds the index, unless it loads a snapshot. */
+#define INDEX_NOW        0 /* On the opening thread. */
+#define INDEX_BACKGROUND 1 /* On a thread of its own. */
+#define INDEX_LATER      2 /* Not at all, leaving it to the caller. */
+
+/* Opens the database, building the index as mode, one of INDEX_*, says.
+ * The file is opened in env, if not NULL, and created with the page size
+ * and hash table conf asks for, sized for nelem keys. */
+struct keydb_t *
+open_key_db_mode(const char *filename, char create, int hash_version,
+                 int mode, const struct keydb_env_t *conf, DB_ENV *env,
+                 u_int32_t nelem) {
+    struct keydb_t *ret;
+    struct stat st;
+    const char *name;
+    int flags, loaded;
+
+    ret = malloc(sizeof(struct keydb_t));
+    if (!ret) goto error;
+
+    memset(ret, 0, sizeof(struct keydb_t));
+
+    ret->hash_version = hash_version;
+    if (pthread_mutex_init(&ret->fold_lock, 0)) goto error;
+    assert(ret->master=ibf_allocate(BLOOM_HASH, BLOOM_MASTER_SIZE, hash_version));
+    assert(ret->strata=strata_allocate(BLOOM_HASH, STRATA_IBF_SIZE,
+                STRATA_MASTER_DEPTH, hash_version));
+    ret->epoch = epoch_allocate();
+    if (!ret->epoch) goto error;
+    ret->by_uid = trigram_allocate(retire_free, ret);
+    if (!ret->by_uid) goto error;
+    if (filter_log_start(ret)) goto error;
+    ret->filename = strdup(filename);
+    if (!ret->filename) goto error;
+
+    /* The snapshot must match the file as it was before BDB touched it. */
+    loaded = 1;
+    if (!stat(filename, &st)) {
+        loaded = load_snapshot(ret, filename, &st);
+        if (loaded < 0) goto error;
+    }
+
+    /* Lookups by hash run alongside the indexer's cursor. */
+    if (create) flags = DB_CREATE | DB_THREAD;
+    else        flags = DB_THREAD;
+
+    if (db_create(&ret->dbp, env, 0)) goto error;
+    ret->env = env;
+    ret->txn = conf ? conf->txn : KEYDB_TXN_NONE;
+    ret->locking = env != NULL;
+
+    /* These only take effect when the file is created. */
+    if (conf && conf->page_size
+            && ret->dbp->set_pagesize(ret->dbp, conf->page_size))
+        goto error;
+    if (conf && conf->ffactor
+            && ret->dbp->set_h_ffactor(ret->dbp, conf->ffactor))
+        goto error;
+    if (nelem && ret->dbp->set_h_nelem(ret->dbp, nelem))
+        goto error;
+
+    /* Files in an environment are named relative to its home. */
+    name = filename;
+    if (env) {
+        name = strrchr(filename, '/') ? strrchr(filename, '/')+1 : filename;
+        if (ret->txn)
+            flags |= DB_AUTO_COMMIT;
+    }
+    if (ret->dbp->open(ret->dbp, NULL, name, NULL, DB_HASH, flags, 0666))
+        goto error;
+
+    if (pthread_rwlock_init(&ret->lock, 0)) goto error;
+
+    if (!loaded) {
+        if (index_loaded(ret)) goto error;
+        printf("Index contains %d keys, from the snapshot.\n", ret->idx_count);
+        ret->indexed = 1;
+        ret->ready = 1;
+        return ret;
+    }
+
+    ret->index_start = us_timestamp();
+    if (mode == INDEX_LATER)
+        return ret;
+    if (mode == INDEX_BACKGROUND) {
+        if (pthread_create(&ret->indexer, NULL, index_thread, ret))
+            goto error;
+        ret->indexer_started = 1;
+        return ret;
+    }
+
+    if (index_key_db(ret)) goto error;
+
+    printf("Index contains %d keys.\n", ret->idx_count);
+
+    return ret;
+
+error:
+    if (!ret)
+        return NULL;
+    close_key_db(ret);
+    return NULL;
+}
+
+struct keydb_t *
+open_key_db(const char *filename, char create, int hash_version) {
+    return open_key_db_env(filename, create, hash_version, NULL, 0, 0);
+}
+
+struct keydb_t *
+open_key_db_lazy(const char *filename, char create, int hash_version) {
+    return open_key_db_env(filename, create, hash_version, NULL, 0, 1);
+}
+
+struct keydb_t *
+open_key_db_sharded(const char *filename, char create, int hash_version,
+                    int n_shards, int lazy) {
+    return open_key_db_env(filename, create, hash_version, NULL, n_shards,
+            lazy);
+}
+
+/* Builds the index of every shard of db that did not load a snapshot, in
+ * turn, so that one pool of index_threads() workers serves them all, as
+ * when they are opened eagerly. Stops early once db is being closed. */
+void *
+sharded_index_thread(void *db_) {
+    struct keydb_t *db = db_;
+    struct keydb_t *shard;
+    int i, stop;
+
+    for (i=0; i<db->n_shards; i++) {
+        shard = db->shards[i];
+        if (__atomic_load_n(&shard->ready, __ATOMIC_ACQUIRE))
+            continue;
+        if (retry_rdlock(db)) break;
+        stop = db->stop;
+        unlock(db);
+        if (stop)
+            break;
+        index_thread(shard);
+    }
+    return NULL;
+}
+
+/* Shard i of n is kept in <filename>.<i>of<n>, next to its snapshot. The
+ * shards share one environment and its buffer pool. */
+struct keydb_t *
+open_sharded(const char *filename, char create, int hash_version,
+             const struct keydb_env_t *conf, int n_shards, int lazy) {
+    struct keydb_t *ret;
+    char *name;
+    int i;
+
+    if (n_shards < 1 || n_shards > KEYDB_MAX_SHARDS)
+        return NULL;
+    ret = calloc(1, sizeof(struct keydb_t));
+    if (!ret) return NULL;
+    ret->shards = calloc(n_shards, sizeof(struct keydb_t *));
+    if (!ret->shards) {
+        free(ret);
+        return NULL;
+    }
+    ret->n_shards = n_shards;
+    ret->hash_version = hash_version;
+    if (pthread_mutex_init(&ret->fold_lock, 0)) goto error;
+    if (pthread_rwlock_init(&ret->lock, 0)) goto error;
+    ret->epoch = epoch_allocate();
+    if (!ret->epoch) goto error;
+    ret->filename = strdup(filename);
+    if (!ret->filename) goto error;
+    if (conf) {
+        ret->env = open_env(filename, conf);
+        if (!ret->env) goto error;
+        ret->env_owner = 1;
+        ret->txn = conf->txn;
+    }
+
+    name = malloc(strlen(filename)+32);
+    if (!name) goto error;
+    for (i=0; i<n_shards; i++) {
+        sprintf(name, "%s.%dof%d", filename, i, n_shards);
+        ret->shards[i] = open_key_db_mode(name, create, hash_version,
+                lazy ? INDEX_LATER : INDEX_NOW, conf, ret->env,
+                conf ? conf->nelem/n_shards : 0);
+        if (!ret->shards[i])
+            break;
+        ret->shards[i]->shard = i;
+        ret->shards[i]->n_shards = n_shards;
+    }
+    free(name);
+    if (i < n_shards) goto error;
+    if (lazy) {
+        if (pthread_create(&ret->indexer, NULL, sharded_index_thread, ret))
+            goto error;
+        ret->indexer_started = 1;
+    }
+    return ret;
+
+error:
+    close_key_db(ret);
+    return NULL;
+}
+
+struct keydb_t *
+open_key_db_env(const char *filename, char create, int hash_version,
+                const struct keydb_env_t *conf, int n_shards, int lazy) {
+    struct keydb_t *ret;
+    DB_ENV *env;
+
+    if (n_shards)
+        return open_sharded(filename, create, hash_version, conf, n_shards,
+                lazy);
+    env = NULL;
+    if (conf) {
+        env = open_env(filename, conf);
+        if (!env) return NULL;
+    }
+    ret = open_key_db_mode(filename, create, hash_version,
+            lazy ? INDEX_BACKGROUND : INDEX_NOW, conf, env,
+            conf ? conf->nelem : 0);
+    if (ret)
+        ret->env_owner = env != NULL;
+    else if (env)
+        close_env(env, conf->txn);
+    return ret;
+}
+
+/* A sharded database is ready once every shard is, and has failed if any
+ * has. */
+int
+sharded_ready(struct keydb_t *db, int *keys, double *rate) {
+    double shard_rate;
+    int i, ret, shard_ret, count;
+
+    ret = 1;
+    if (keys)
+        *keys = 0;
+    if (rate)
+        *rate = 0;
+    for (i=0; i<db->n_shards; i++) {
+        shard_ret = key_db_ready(db->shards[i], &count, &shard_rate);
+        if (shard_ret < ret)
+            ret = shard_ret;
+        if (keys)
+            *keys += count;
+        if (rate)
+            *rate += shard_rate;
+    }
+    return ret;
+}
+
+int
+key_db_ready(struct keydb_t *db, int *keys, double *rate) {
+    uint64_t elapsed;
+    int ret, count;
+
+    if (db->shards)
+        return sharded_ready(db, keys, rate);
+    ret = __atomic_load_n(&db->ready, __ATOMIC_ACQUIRE);
+    count = get_key_count(db);
+    if (keys)
+        *keys = count;
+    if (rate) {
+        elapsed = us_timestamp() - db->index_start;
+        *rate = db->index_start && elapsed ? count*1e6/elapsed : 0;
+    }
+    return ret;
+}
+
+/* Bulk ingest runs the indexing pool over dump files. A reader thread maps
+ * the files in turn and cuts them into chunks of whole keys for the
+ * workers. The calling thread splices each batch into key_idx, in file
+ * order, dropping keys it already holds, and copies the rest into a bulk
+ * buffer. Full buffers are put by a thread of their own while the other
+ * one fills, so memory is bounded by the two buffers and the chunks in
+ * flight however large the dumps are. The keys kept reach the filters
+ * once they are all spliced, see ingest_fill.
+ *
+ * A sharded database is ingested into in the same single pass: workers
+ * order each batch by shard, and every shard has its own pair of buffers
+ * and putter, the buffers sharing MULTIPUT_SIZE between them. A buffer
+ * too small for a key grows to MULTIPUT_SIZE. */
+#define INGEST_CHUNK_SIZE (1024*1024*4)
+#define INGEST_MIN_PUT_SIZE (1024*256)
+
+/* A DB_MULTIPLE_KEY buffer. */
+struct ingest_bulk_t {
+    DBT data;
+    void *ptr;
+    int n_keys;
+    uint64_t bytes;
+};
+
+struct ingest_putter_t {
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* Broadcast on every change below. */
+    struct keydb_t *db;
+    struct ingest_bulk_t bulk[2];
+    struct ingest_bulk_t *filling;
+    struct ingest_bulk_t *full;  /* Being put, if not NULL. */
+    uint64_t batches;
+    int stop;
+    int failed;
+    pthread_t thread;
+    int started;
+};
+
+/* A database keys are ingested into: the database itself, or one of its
+ * shards. */
+struct ingest_target_t {
+    struct keydb_t *db;
+    struct ingest_putter_t putter;
+    int from;   /* The first key ingested. */
+    int to;     /* One past the last. */
+    int slice;  /* Keys per slice, when filling the filters. */
+    int parts;  /* Slices not summed yet. */
+    struct inv_bloom_t *master; /* The sum of the slices so far. */
+    struct strata_estimator_t *strata;
+};
+
+void *
+ingest_reader(void *arg) {
+    struct index_job_t *job;
+    struct index_buf_t *buf;
+    struct ingest_file_t *file;
+    struct pgp_key_t key;
+    struct dump_t *dump;
+    size_t start, end;
+    int i, ret, queued, last;
+
+    job = arg;
+    for (i=0; i<job->n_files; i++) {
+        file = &job->files[i];
+        dump = dump_open(file->filename);
+        if (!dump) {
+            fprintf(stderr, "Could not open dump file %s\n", file->filename);
+            goto error;
+        }
+        file->dump = dump;
+
+        queued = last = 0;
+        while (!last) {
+            pthread_mutex_lock(&job->lock);
+            while (!job->failed
+                    && (!job->idle || job->read-job->spliced >= job->max_ahead))
+                pthread_cond_wait(&job->cond, &job->lock);
+            if (job->failed) {
+                pthread_mutex_unlock(&job->lock);
+                return NULL;
+            }
+            buf = job->idle;
+            job->idle = buf->next;
+            pthread_mutex_unlock(&job->lock);
+
+            /* Whole keys only, so chunks can be parsed independently. */
+            start = dump->pos;
+            while (!(ret = dump_next_key(dump, &key))
+                    && dump->pos-start < INGEST_CHUNK_SIZE);
+            last = ret || dump->pos >= dump->len;
+            buf->chunk.data = dump->data+start;
+            buf->chunk.len = dump->pos-start;
+            buf->chunk.pos = 0;
+            buf->file = i;
+            buf->last = last;
+            buf->end = end = dump->pos;
+
+            pthread_mutex_lock(&job->lock);
+            if (buf->chunk.len) {
+                index_queue(job, buf);
+                queued = 1;
+            } else {
+                buf->next = job->idle;
+                job->idle = buf;
+            }
+            pthread_mutex_unlock(&job->lock);
+        }
+        /* Once its last chunk is queued the writer may close the dump, so
+         * only the offset saved before is used. */
+        if (ret < 0)
+            printf("Malformed key at byte %lu of %s, stopping there.\n",
+                   (unsigned long)end, file->filename);
+        /* Otherwise the file is closed once its last chunk is written. */
+        if (!queued) {
+            printf("Read 0 keys from %s\n", file->filename);
+            dump_close(dump);
+            file->dump = NULL;
+        }
+    }
+
+    pthread_mutex_lock(&job->lock);
+    job->eof = 1;
+    pthread_cond_broadcast(&job->cond);
+    pthread_mutex_unlock(&job->lock);
+    return NULL;
+error:
+    index_job_fail(job);
+    return NULL;
+}
+
+void *
+ingest_putter(void *arg) {
+    struct ingest_putter_t *putter;
+    struct ingest_bulk_t *bulk;
+    uint64_t start;
+    double secs;
+    int ret;
+
+    putter = arg;
+    pthread_mutex_lock(&putter->lock);
+    while (1) {
+        while (!putter->full && !putter->stop)
+            pthread_cond_wait(&putter->cond, &putter->lock);
+        if (!putter->full)
+            break;
+        bulk = putter->full;
+        pthread_mutex_unlock(&putter->lock);
+
+        start = us_timestamp();
+        ret = putter->db->dbp->put(putter->db->dbp, NULL, &bulk->data, NULL,
+                DB_MULTIPLE_KEY | DB_OVERWRITE_DUP);
+        secs = (us_timestamp()-start)/1e6;
+        if (ret)
+            printf("Error with multiput.\n");
+        else
+            printf("Put batch %lu: %d keys (%.2f MiB) in %.2f s, "
+                   "%.0f keys/s, %.1f MiB/s\n",
+                   (unsigned long)putter->batches+1, bulk->n_keys,
+                   bulk->bytes/1024.0/1024.0, secs,
+                   secs > 0 ? bulk->n_keys/secs : 0,
+                   secs > 0 ? bulk->bytes/1024.0/1024.0/secs : 0);
+
+        pthread_mutex_lock(&putter->lock);
+        putter->batches++;
+        if (ret)
+            putter->failed = 1;
+        putter->full = NULL;
+        pthread_cond_broadcast(&putter->cond);
+    }
+    pthread_mutex_unlock(&putter->lock);
+    return NULL;
+}
+
+/* Waits for the put in progress, if any, to finish. Returns 0 if every put
+ * so far succeeded. */
+int
+ingest_wait(struct ingest_putter_t *putter) {
+    int ret;
+
+    pthread_mutex_lock(&putter->lock);
+    while (putter->full)
+        pthread_cond_wait(&putter->cond, &putter->lock);
+    ret = putter->failed ? -1 : 0;
+    pthread_mutex_unlock(&putter->lock);
+    return ret;
+}
+
+/* Hands the buffer being filled, if it has any keys, to the putter thread
+ * and starts filling the other one once the put before is done. Returns 0
+ * on success. */
+int
+ingest_flush(struct ingest_putter_t *putter) {
+    struct ingest_bulk_t *bulk;
+
+    if (!putter->filling->n_keys)
+        return 0;
+    if (ingest_wait(putter))
+        return -1;
+    bulk = putter->filling;
+    putter->filling = bulk == &putter->bulk[0] ?
+            &putter->bulk[1] : &putter->bulk[0];
+    putter->filling->n_keys = 0;
+    putter->filling->bytes = 0;
+    DB_MULTIPLE_WRITE_INIT(putter->filling->ptr, &putter->filling->data);
+
+    pthread_mutex_lock(&putter->lock);
+    putter->full = bulk;
+    pthread_cond_broadcast(&putter->cond);
+    pthread_mutex_unlock(&putter->lock);
+    return 0;
+}
+
+/* Copies keys from to to-1 of batch that aren't duplicates into the
+ * buffer putter is filling, flushing it whenever it fills up, and counts
+ * their bytes in file. Returns 0 on success. */
+int
+ingest_copy(struct ingest_putter_t *putter, struct ingest_file_t *file,
+            struct index_batch_t *batch, int from, int to) {
+    struct key_idx_t *entry;
+    struct ingest_bulk_t *bulk;
+    void *data;
+    int i;
+
+    for (i=from; i<to; i++) {
+        if (!batch->data[i])
+            continue;
+        entry = &batch->keys[i];
+        bulk = putter->filling;
+        DB_MULTIPLE_KEY_WRITE_NEXT(bulk->ptr, &bulk->data, entry->hash,
+                sizeof(fp160), batch->data[i], entry->size);
+        if (!bulk->ptr) {
+            if (!bulk->n_keys && bulk->data.ulen < MULTIPUT_SIZE) {
+                data = realloc(bulk->data.data, MULTIPUT_SIZE);
+                if (!data) return -1;
+                bulk->data.data = data;
+                bulk->data.ulen = MULTIPUT_SIZE;
+                DB_MULTIPLE_WRITE_INIT(bulk->ptr, &bulk->data);
+            } else if (!bulk->n_keys) {
+                printf("Error writing data.\n");
+                return -1;
+            } else if (ingest_flush(putter)) {
+                return -1;
+            }
+            i--;
+            continue;
+        }
+        bulk->n_keys++;
+        bulk->bytes += entry->size;
+        file->bytes += entry->size;
+    }
+    return 0;
+}
+
+/* Splices batch into the key_idx of each of the n_targets targets its keys
+ * belong to, and copies those that aren't duplicates into the target's
+ * buffers. Releases the batch's chunk, and closes its file after the last
+ * one. Returns 0 on success. */
+int
+ingest_write(struct ingest_target_t *targets, int n_targets,
+             struct ingest_file_t *files, struct index_batch_t *batch,
+             uint64_t start) {
+    struct ingest_file_t *file;
+    int i, from, to;
+
+    file = &files[batch->file];
+    for (i=0; i<n_targets; i++) {
+        from = batch->bounds ? batch->bounds[i] : 0;
+        to = batch->bounds ? batch->bounds[i+1] : batch->n_keys;
+        if (from == to)
+            continue;
+        if (index_splice(targets[i].db, batch, from, to, start, NULL)
+                || ingest_copy(&targets[i].putter, file, batch, from, to))
+            return -1;
+    }
+    file->keys += batch->n_keys-batch->dups;
+    file->dups += batch->dups;
+    /* Every key before the chunk's end has been copied by now. */
+    dump_release(file->dump, batch->end);
+    if (batch->last) {
+        printf("Read %d keys (total %6.2f MiB) from %s, skipped %d "
+               "duplicates\n", file->keys, file->bytes/1024.0/1024.0,
+               file->filename, file->dups);
+        dump_close(file->dump);
+        file->dump = NULL;
+    }
+    return 0;
+}
+
+void
+ingest_putter_free(struct ingest_putter_t *putter) {
+    free(putter->bulk[0].data.data);
+    free(putter->bulk[1].data.data);
+    pthread_cond_destroy(&putter->cond);
+    pthread_mutex_destroy(&putter->lock);
+}
+
+/* Sets up putter to put into db, with two empty buffers of size bytes.
+ * Returns 0 on success. */
+int
+ingest_putter_init(struct ingest_putter_t *putter, struct keydb_t *db,
+                   size_t size) {
+    int i;
+
+    memset(putter, 0, sizeof(*putter));
+    putter->db = db;
+    if (pthread_mutex_init(&putter->lock, 0)) return -1;
+    if (pthread_cond_init(&putter->cond, 0)) {
+        pthread_mutex_destroy(&putter->lock);
+        return -1;
+    }
+    for (i=0; i<2; i++) {
+        putter->bulk[i].data.ulen = size;
+        putter->bulk[i].data.data = malloc(size);
+        if (!putter->bulk[i].data.data) {
+            printf("Error allocating memory.\n");
+            ingest_putter_free(putter);
+            return -1;
+        }
+    }
+    putter->filling = &putter->bulk[0];
+    DB_MULTIPLE_WRITE_INIT(putter->filling->ptr, &putter->filling->data);
+    return 0;
+}
+
+/* Starts putter's thread. Returns 0 on success. */
+int
+ingest_putter_start(struct ingest_putter_t *putter) {
+    if (pthread_create(&putter->thread, NULL, ingest_putter, putter))
+        return -1;
+    putter->started = 1;
+    return 0;
+}
+
+/* Stops putter's thread once the put in progress is done. Returns 0 if
+ * every put succeeded. */
+int
+ingest_putter_stop(struct ingest_putter_t *putter) {
+    if (putter->started) {
+        pthread_mutex_lock(&putter->lock);
+        putter->stop = 1;
+        pthread_cond_broadcast(&putter->cond);
+        pthread_mutex_unlock(&putter->lock);
+        pthread_join(putter->thread, NULL);
+        putter->started = 0;
+    }
+    return putter->failed ? -1 : 0;
+}
+
+/* Grows db's hash indexes to take the keys in the dump files as well, as
+ * far as their sizes tell, or db's share of them if it is a shard.
+ * Returns 0 on success. */
+int
+ingest_reserve(struct keydb_t *db, char *const *filenames, int n_files) {
+    struct stat st;
+    uint64_t n;
+    int i, ret;
+
+    n = 0;
+    for (i=0; i<n_files; i++)
+        if (!stat(filenames[i], &st))
+            n += st.st_size/IDX_KEY_SIZE_GUESS;
+    if (db->n_shards)
+        n /= db->n_shards;
+    if (retry_wrlock(db)) return -1;
+    if (n > (uint64_t)(INT_MAX/2-db->idx_count))
+        n = INT_MAX/2-db->idx_count;
+    ret = idx_tables_reserve(db, db->idx_count+n);
+    unlock(db);
+    return ret;
+}
+
+/* While keys are ingested the index counts as not ready, so no other
+ * writer adds keys, and the filters are left behind key_idx. Once every
+ * key is spliced, the threads of the indexing pool add slices of the new
+ * keys to filters of their own, as when indexing, and the sum of a
+ * database's slices is added to its filters in one step. Only the keys
+ * kept reach the filters, and the filtered keys stay a prefix of
+ * key_idx. */
+#define INGEST_FILL_MIN_KEYS (1<<16)
+#define INGEST_FILL_BATCH 256
+
+struct ingest_fill_t {
+    pthread_mutex_t lock;
+    struct ingest_target_t *targets;
+    int n_targets;
+    int target; /* The target slices are handed out of. */
+    int next;   /* The first key of its next slice. */
+    int failed;
+};
+
+/* Adds keys from to to-1 of db to new filters, stored in master and
+ * strata. Returns 0 on success. */
+int
+ingest_fill_slice(struct keydb_t *db, int from, int to,
+                  struct inv_bloom_t **master,
+                  struct strata_estimator_t **strata) {
+    fp160 hashes[INGEST_FILL_BATCH];
+    int i, n, token;
+
+    *master = ibf_allocate(BLOOM_HASH, BLOOM_MASTER_SIZE, db->hash_version);
+    *strata = strata_allocate(BLOOM_HASH, STRATA_IBF_SIZE,
+            STRATA_MASTER_DEPTH, db->hash_version);
+    if (!*master || !*strata) return -1;
+    token = read_begin(db);
+    while (from < to) {
+        for (n=0; n<INGEST_FILL_BATCH && from<to; n++, from++)
+            memcpy(hashes[n], key_at(db, from)->hash, sizeof(fp160));
+        ibf_insert_batch(*master, (const fp160 *)hashes, n);
+        for (i=0; i<n; i++)
+            strata_insert(*strata, hashes[i]);
+    }
+    read_end(db, token);
+    return 0;
+}
+
+/* Adds the sum of target's slices to its database's filters. The hashes
+ * logged before ingesting started go first. Returns 0 on success. */
+int
+ingest_fill_commit(struct ingest_target_t *target) {
+    struct keydb_t *db;
+    int ret;
+
+    db = target->db;
+    while (filter_log_apply(db));
+    pthread_mutex_lock(&db->fold_lock);
+    ret = ibf_add(db->master, target->master)
+        || strata_add(db->strata, target->strata) ? -1 : 0;
+    if (!ret) {
+        /* Rebuilt on next use, off the lock. */
+        riblt_encoder_free(db->riblt);
+        db->riblt = NULL;
+        db->filtered = target->to;
+        __atomic_add_fetch(&db->generation, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&db->fold_lock);
+    epoch_reclaim(db->epoch);
+    return ret;
+}
 
-    for (i=0; i<BLOOM_MAX_COUNT; i++)
-        assert(ret->filters[i]=ibf_allocate(BLOOM_HASH, (10<<i)));
-    for (i=0; i<STRATA_MAX_COUNT; i++)
-        assert(ret->strata[i]=strata_allocate(BLOOM_HASH, STRATA_IBF_SIZE, STRATA_IBF_MIN_DEPTH<<i));
+void *
+ingest_filler(void *arg) {
+    struct ingest_fill_t *fill;
+    struct ingest_target_t *target;
+    struct inv_bloom_t *master;
+    struct strata_estimator_t *strata;
+    int from, to, ret;
+
+    fill = arg;
+    pthread_mutex_lock(&fill->lock);
+    while (!fill->failed && fill->target < fill->n_targets) {
+        target = &fill->targets[fill->target];
+        if (fill->next >= target->to) {
+            if (++fill->target < fill->n_targets)
+                fill->next = fill->targets[fill->target].from;
+            continue;
+        }
+        from = fill->next;
+        to = target->to-from > target->slice ? from+target->slice
+                                             : target->to;
+        fill->next = to;
+        pthread_mutex_unlock(&fill->lock);
+
+        master = NULL;
+        strata = NULL;
+        ret = ingest_fill_slice(target->db, from, to, &master, &strata);
+
+        pthread_mutex_lock(&fill->lock);
+        if (!ret && !target->master) {
+            target->master = master;
+            target->strata = strata;
+            master = NULL;
+            strata = NULL;
+        } else if (!ret) {
+            ret = ibf_add(target->master, master)
+                || strata_add(target->strata, strata) ? -1 : 0;
+        }
+        ibf_free(master);
+        strata_free(strata);
+        if (!ret && !--target->parts) {
+            pthread_mutex_unlock(&fill->lock);
+            ret = ingest_fill_commit(target);
+            pthread_mutex_lock(&fill->lock);
+        }
+        if (ret)
+            fill->failed = 1;
+    }
+    pthread_mutex_unlock(&fill->lock);
+    return NULL;
+}
 
-    if (create) flags = DB_CREATE;
-    else        flags = 0;
+/* Adds the keys ingested into each of the n_targets targets to its
+ * filters, on the indexing pool, and frees their sums. Returns 0 on
+ * success. */
+int
+ingest_fill(struct ingest_target_t *targets, int n_targets) {
+    pthread_t threads[INDEX_THREADS_MAX];
+    struct ingest_fill_t fill;
+    struct ingest_target_t *target;
+    int i, n, n_threads, n_started;
+
+    n_threads = index_threads();
+    for (i=0; i<n_targets; i++) {
+        target = &targets[i];
+        target->to = target->db->idx_count;
+        n = target->to-target->from;
+        target->parts = n/INGEST_FILL_MIN_KEYS;
+        if (target->parts > n_threads)
+            target->parts = n_threads;
+        if (target->parts < 1)
+            target->parts = 1;
+        target->slice = (n+target->parts-1)/target->parts;
+        if (!n)
+            target->parts = 0;
+    }
 
-    if (db_create(&ret->dbp, NULL, 0)) goto error;
+    memset(&fill, 0, sizeof(fill));
+    if (pthread_mutex_init(&fill.lock, 0)) return -1;
+    fill.targets = targets;
+    fill.n_targets = n_targets;
+    fill.next = n_targets ? targets[0].from : 0;
+    /* This thread takes a share too. */
+    for (n_started=0; n_started<n_threads-1; n_started++)
+        if (pthread_create(&threads[n_started], NULL, ingest_filler, &fill))
+            break;
+    ingest_filler(&fill);
+    for (i=0; i<n_started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&fill.lock);
+
+    for (i=0; i<n_targets; i++) {
+        ibf_free(targets[i].master);
+        strata_free(targets[i].strata);
+        targets[i].master = NULL;
+        targets[i].strata = NULL;
+        if (targets[i].parts)
+            fill.failed = 1;
+    }
+    return fill.failed ? -1 : 0;
+}
 
-    //ret->dbp->set_h_ffactor(ret->dbp, 1);
-    //ret->dbp->set_h_nelem(ret->dbp, 8000000);
+/* Marks target's database not ready while keys are ingested into it, and
+ * notes where they start. Returns 0 on success, and -1 if its index is
+ * not ready. */
+int
+ingest_begin(struct ingest_target_t *target, struct keydb_t *db) {
+    int ret;
 
-    if (ret->dbp->open(ret->dbp, NULL, filename, NULL, DB_HASH, flags, 0666))
-        goto error;
+    memset(target, 0, sizeof(*target));
+    target->db = db;
+    if (retry_wrlock(db)) return -1;
+    ret = -1;
+    if (__atomic_load_n(&db->ready, __ATOMIC_ACQUIRE) == 1) {
+        __atomic_store_n(&db->ready, 0, __ATOMIC_RELEASE);
+        target->from = db->idx_count;
+        ret = 0;
+    }
+    unlock(db);
+    if (ret)
+        printf("Index not ready; not ingesting.\n");
+    return ret;
+}
 
-    if (pthread_rwlock_init(&ret->lock, 0)) goto error;
+/* Marks target's database ready again, or failed if its filters could not
+ * be brought up to date. */
+void
+ingest_end(struct ingest_target_t *target, int failed) {
+    if (retry_wrlock(target->db)) return;
+    __atomic_store_n(&target->db->ready, failed ? -1 : 1, __ATOMIC_RELEASE);
+    unlock(target->db);
+}
 
-    if (ret->dbp->cursor(ret->dbp, NULL, &curs, DB_CURSOR_BULK)) goto error;
+/* Splices the keys in the dump files into the n_targets targets, routing
+ * them by shard if there is more than one, and puts them. Returns 0 on
+ * success. */
+int
+ingest_dumps(struct ingest_target_t *targets, int n_targets,
+             char *const *filenames, int n_files, float excl_pct) {
+    struct index_worker_t workers[INDEX_THREADS_MAX];
+    struct ingest_file_t *files;
+    struct index_batch_t *batch;
+    struct index_job_t job;
+    pthread_t reader;
+    uint64_t start, bytes, batches;
+    size_t size;
+    time_t seed;
+    int n_threads, n_started, reader_started, n_putters, keys, dups, i,
+        ret;
 
-    indexed = 0;
+    ret = -1;
+    n_started = reader_started = n_putters = 0;
+    start = us_timestamp();
+    printf("Randomly excluding %8.4f%% of keys.\n", excl_pct);
 
-    data.data = malloc(MULTIPUT_SIZE);
-    if (!data.data)
-        goto error;
-    data.ulen = MULTIPUT_SIZE;
-    data.flags = DB_DBT_USERMEM;
-
-    while (!curs->c_get(curs, &key, &data, DB_MULTIPLE_KEY | DB_NEXT)) {
-        DB_MULTIPLE_INIT(ptr, &data);
-        while (1) {
-            DB_MULTIPLE_KEY_NEXT(ptr, &data, retkey, retklen, retdata, retdlen);
-            if (!ptr)
-                break;
-            pgp_key.data = retdata;
-            pgp_key.len = retdlen;
+    files = calloc(n_files, sizeof(struct ingest_file_t));
+    if (!files) {
+        printf("Error allocating memory.\n");
+        return -1;
+    }
+    for (i=0; i<n_files; i++)
+        files[i].filename = filenames[i];
+    size = MULTIPUT_SIZE/n_targets;
+    if (size < INGEST_MIN_PUT_SIZE)
+        size = INGEST_MIN_PUT_SIZE;
+    for (; n_putters<n_targets; n_putters++)
+        if (ingest_putter_init(&targets[n_putters].putter,
+                    targets[n_putters].db, size))
+            goto error_free;
+
+    n_threads = index_threads();
+    if (index_job_init(targets[0].db, &job, workers, n_threads, 0, 0))
+        goto error_free;
+    job.files = files;
+    job.n_files = n_files;
+    job.excl_pct = excl_pct;
+    job.n_shards = n_targets > 1 ? n_targets : 0;
+    seed = time(NULL);
+    for (i=0; i<n_threads; i++) {
+        workers[i].xsubi[0] = seed;
+        workers[i].xsubi[1] = seed>>16;
+        workers[i].xsubi[2] = i;
+    }
+    for (i=0; i<n_targets; i++)
+        if (ingest_putter_start(&targets[i].putter)) goto out;
+    if (index_workers_start(workers, n_threads, &n_started)) goto out;
+    if (pthread_create(&reader, NULL, ingest_reader, &job)) goto out;
+    reader_started = 1;
+    printf("Ingesting %d files with %d threads.\n", n_files, n_threads);
+
+    while ((batch = index_next_batch(&job))) {
+        ret = ingest_write(targets, n_targets, files, batch, start);
+        index_batch_free(batch);
+        index_batch_done(&job, ret);
+    }
+    pthread_mutex_lock(&job.lock);
+    ret = job.failed ? -1 : 0;
+    pthread_mutex_unlock(&job.lock);
+    for (i=0; !ret && i<n_targets; i++)
+        ret = ingest_flush(&targets[i].putter);
 
-            if (parse_key_metadata(&pgp_key))
-                continue;
+out:
+    if (ret)
+        index_job_fail(&job);
+    if (reader_started)
+        pthread_join(reader, NULL);
+    index_workers_join(workers, n_started);
+    /* Putters finish the put in progress before they stop. */
+    batches = 0;
+    for (i=0; i<n_targets; i++) {
+        if (ingest_putter_stop(&targets[i].putter))
+            ret = -1;
+        batches += targets[i].putter.batches;
+    }
 
-            if (add_key_to_index(ret, pgp_key.version, pgp_key.len,
-                        pgp_key.user_id, pgp_key.hash, pgp_key.fp, pgp_key.id32, pgp_key.id64))
-                goto error;
+    index_job_free(&job, workers, n_threads);
 
-            free(pgp_key.user_id);
-            if (++indexed%10000 == 0)
-                printf("Indexing...%d\n", indexed);
+    if (!ret) {
+        keys = dups = 0;
+        bytes = 0;
+        for (i=0; i<n_files; i++) {
+            keys += files[i].keys;
+            dups += files[i].dups;
+            bytes += files[i].bytes;
         }
+        printf("Ingested %d keys (total %6.2f MiB) in %lu batches in "
+               "%.1f s, skipped %d duplicates.\n", keys, bytes/1024.0/1024.0,
+               (unsigned long)batches, (us_timestamp()-start)/1e6, dups);
     }
-    curs->c_close(curs);
-
-    printf("Index contains %d keys.\n", ret->idx_count);
-    free(data.data);
-
+error_free:
+    for (i=0; i<n_files; i++)
+        dump_close(files[i].dump);
+    free(files);
+    for (i=0; i<n_putters; i++)
+        ingest_putter_free(&targets[i].putter);
     return ret;
-
-error:
-    free(data.data);
-    if (!ret)
-        return NULL;
-    close_key_db(ret);
-    return NULL;
 }
 
 int
-ingest_file(struct keydb_t *db, const char *filename, float excl_pct) {
-    FILE *in;
-    struct pgp_key_t key;
-    int read, total;
-    DBT data;
-    void *ptr;
-
-    memset(&data, 0, sizeof(data));
-
-    read = total = 0;
-
-    printf("Randomly excluding %8.4f%% of keys.\n", excl_pct);
-    srand48(time(NULL));
-
-    in = fopen(filename, "rb");
-    if (!in) {
-        fprintf(stderr, "Could not open dump file %s\n", filename);
+ingest_files(struct keydb_t *db, char *const *filenames, int n_files,
+             float excl_pct) {
+    struct ingest_target_t *targets;
+    uint64_t start;
+    int i, n_targets, n_begun, ret, failed, filled;
+
+    if (n_files < 1)
+        return 0;
+    n_targets = db->shards ? db->n_shards : 1;
+    targets = calloc(n_targets, sizeof(struct ingest_target_t));
+    if (!targets) return -1;
+    for (n_begun=0; n_begun<n_targets; n_begun++) {
+        if (ingest_reserve(db->shards ? db->shards[n_begun] : db,
+                    filenames, n_files)
+                || ingest_begin(&targets[n_begun],
+                    db->shards ? db->shards[n_begun] : db))
+            break;
+    }
+    if (n_begun < n_targets) {
+        for (i=0; i<n_begun; i++)
+            ingest_end(&targets[i], 0);
+        free(targets);
         return -1;
     }
+    ret = ingest_dumps(targets, n_targets, filenames, n_files, excl_pct);
+
+    /* Keys spliced before a failure are in the index all the same. */
+    start = us_timestamp();
+    failed = ingest_fill(targets, n_targets);
+    for (filled=i=0; i<n_targets; i++) {
+        ingest_end(&targets[i], failed);
+        filled += targets[i].to-targets[i].from;
+    }
+    if (failed)
+        printf("Could not add the ingested keys to the filters.\n");
+    else
+        printf("Added %d keys to the filters in %.1f s.\n", filled,
+               (us_timestamp()-start)/1e6);
+    free(targets);
+    return ret || failed ? -1 : 0;
+}
 
-    data.ulen = MULTIPUT_SIZE;
-    data.data = malloc(MULTIPUT_SIZE);
-    if (!data.data) {
-        printf("Error allocating memory.\n");
-        goto error_free_DBT;
-    }
-    DB_MULTIPLE_WRITE_INIT(ptr, &data);
-    if (!ptr) {
-        printf("Error initializing buffer.\n");
-        goto error_free_DBT;
-    }
-    
-    key.user_id = NULL;
-    while (!parse_from_dump(in, &key)) {
-        if (parse_key_metadata(&key) || 100*drand48() < excl_pct) {
-            free(key.data);
-            free(key.user_id);
-            key.user_id = NULL;
-            continue;
-        }
-        /*if(insert_key(db, &key, 0, db->gtxnid)) {*/
-        DB_MULTIPLE_KEY_WRITE_NEXT(ptr, &data, key.hash, 20, key.data, key.len);
-        if (!ptr) {
-            printf("Error writing data.\n");
-            goto error_free_DBT;
+/* Inserts n downloaded keys, counting those added and those already
+ * there, and frees them. Returns 0 on success. */
+int
+insert_fetched(struct keydb_t *db, struct pgp_key_t *keys, int n,
+               int *count, int *dups) {
+    int results[FETCH_BATCH];
+    int i, ret;
+
+    ret = insert_keys(db, keys, n, results) < 0 ? -1 : 0;
+    for (i=0; i<n; i++) {
+        switch (results[i]) {
+            case 0: (*count)++; break;
+            case 1: (*dups)++;  break;
         }
+        inner_free_key(&keys[i]);
+    }
+    return ret;
+}
 
-        if (add_key_to_index(db, key.version, key.len, 
-                    key.user_id, key.hash, key.fp, 
-                    key.id32, key.id64)) {
-            printf("Error writing key to index.\n");
-            goto error_free_DBT;
+/* Downloads the keys with the given hashes from srv and inserts them
+ * FETCH_BATCH at a time. Returns the number of keys added, or -1 on
+ * error. */
+int
+fetch_keys(struct keydb_t *db, char *srv, const fp160 *hashes, size_t n,
+           uint64_t *key_bytes) {
+    struct pgp_key_t *keys, *key;
+    size_t i;
+    int n_keys, count, dups, ret;
+
+    keys = malloc(FETCH_BATCH*sizeof(struct pgp_key_t));
+    if (!keys) return -1;
+    count = dups = n_keys = 0;
+    ret = 0;
+    for (i=0; i<n && !ret; i++) {
+        key = download_key(srv, hashes[i]);
+        if (!key) {
+            ret = -1;
+            break;
         }
+        *key_bytes += key->len;
+        keys[n_keys] = *key;
+        free(key);
+        if (parse_key_metadata(&keys[n_keys]))
+            inner_free_key(&keys[n_keys]);
+        else
+            n_keys++;
+        if (n_keys == FETCH_BATCH) {
+            ret = insert_fetched(db, keys, n_keys, &count, &dups);
+            n_keys = 0;
+        }
+    }
+    /* Keys downloaded before a failure are added all the same. */
+    if (n_keys && insert_fetched(db, keys, n_keys, &count, &dups))
+        ret = -1;
+    free(keys);
+    if (dups)
+        printf("Skipped %d keys already present.\n", dups);
+    return ret ? -1 : count;
+}
 
-        /*if(insert_key(db, &key, 1)) {
-            printf("Failed to insert key.\n");
-            return -1; 
-        }*/
+/* Reconciles with srv by streaming rateless coded symbols. Returns 0 on
+ * success, 1 if the peer can't serve them or the difference didn't decode,
+ * 2 if it has no /riblt, and -1 on any other error. */
+int
+peer_with_riblt(struct keydb_t *db, char *srv) {
+    struct riblt_decoder_t *decoder;
+    const fp160 *remote, *local;
+    size_t n_remote, n_local;
+    uint64_t start_time, decode_time, done_time, key_bytes;
+    int count, missing;
 
-        total += key.len;
-        free(key.data);
-        free(key.user_id);
-        key.user_id = NULL;
-        read++;
-        if (read %10000 == 0)
-            printf("Ingesting...%d\n", read);
-    }
+    start_time = us_timestamp();
+    key_bytes = 0;
 
-    if (db->dbp->put(db->dbp, NULL, &data, NULL, DB_MULTIPLE_KEY | DB_OVERWRITE_DUP)) {
-        printf("Error with multiput.\n");
-        goto error_free_DBT;
+    decoder = download_riblt(srv, db, &missing);
+    if (!decoder)
+        return missing ? 2 : 1;
+    decode_time = us_timestamp();
+
+    riblt_decoder_results(decoder, &remote, &n_remote, &local, &n_local);
+    printf("Decoded %lu remote and %lu local keys from %lu symbols.\n",
+            n_remote, n_local, riblt_decoder_count(decoder));
+    count = fetch_keys(db, srv, remote, n_remote, &key_bytes);
+    riblt_decoder_free(decoder);
+    if (count < 0) {
+        printf("Error synchronizing.\n");
+        return -1;
     }
-    free(data.data);
+    printf("Added %d keys.\n", count);
 
-    fclose(in);
-    printf("Read %d keys (total %6.2f MiB) from %s\n", read, total/1024.0/1024.0, filename);
+    done_time = us_timestamp();
+    printf("%ld us to stream and decode symbols.\n", decode_time-start_time);
+    printf("%ld us to download all keys.\n", done_time-decode_time);
+    printf("%ld us total.\n", done_time-start_time);
+    printf("%ld total key bytes.\n", key_bytes);
     return 0;
-error_free_DBT:
-    free(data.data);
-    return -1;
-}
-
-
-uint64_t
-us_timestamp() {
-    struct timespec time;
-    clock_gettime(CLOCK_MONOTONIC, &time);
-    return time.tv_sec*1000000+time.tv_nsec/1000;
 }
 
 int
-peer_with(struct keydb_t *db, char *srv) {
-    struct strata_estimator_t *strata = NULL;
+peer_with_strata(struct keydb_t *db, char *srv) {
+    struct strata_estimator_t *strata = NULL, *local;
     struct inv_bloom_t *filter = NULL;
-    struct pgp_key_t *key = NULL;
     int i, j, est_diff, ibf_min_size, acc;
-    int count, ret;
+    int count, ret, token;
     uint64_t start_time, strata_time, ibf_time, done_time, key_bytes;
-    fp160 hash;
+    fp160 *pos = NULL, *neg = NULL;
+    size_t n_pos, n_neg;
 
     start_time = us_timestamp();
     key_bytes = 0;
 
     /* For efficient synchronization, try small strata estimators first. */
     for (i=0; i<STRATA_MAX_COUNT; i++) {
-        strata = download_strata(srv, BLOOM_HASH, STRATA_IBF_SIZE, STRATA_IBF_MIN_DEPTH<<i);
+        strata = download_strata(srv, BLOOM_HASH, STRATA_IBF_SIZE,
+                STRATA_IBF_MIN_DEPTH<<i, db->hash_version);
         if (!strata) break;
 
         printf("Downloaded strata estimator %d.\n", i);
-        if (retry_rdlock(db)) goto error;
-        est_diff = strata_estimate_diff(db->strata[i], strata);
-        unlock(db);
+        token = read_begin(db);
+        local = get_strata(db, BLOOM_HASH, STRATA_IBF_SIZE,
+                STRATA_IBF_MIN_DEPTH<<i, db->hash_version, NULL);
+        est_diff = local ? strata_estimate_diff(local, strata) : -1;
+        read_end(db, token);
         if (est_diff == -1) { 
             printf("Estimator too small for useful result.\n");
             continue;
         }
 
+        /* Stop at the largest filter that can be served. */
         ibf_min_size = est_diff * 3;
-        acc = 10;
-        for (j=0; j<BLOOM_MAX_COUNT; j++) {
+        acc = IBF_MIN_SIZE;
+        for (j=0; j<BLOOM_MAX_COUNT-1; j++) {
             if (acc >= ibf_min_size)
                 break;
             acc *= 2;
@@ -322,35 +3332,41 @@ peer_with(struct keydb_t *db, char *srv) {
 
     if (est_diff) {
         printf("Estimated difference is %d keys, looking for ibf >= %d = %d.\n", est_diff, ibf_min_size, acc);
-        filter = download_inv_bloom(srv, BLOOM_HASH, acc);
+        filter = download_inv_bloom(srv, BLOOM_HASH, acc, db->hash_version);
+        /* Older peers don't serve filters this large, but the largest they
+         * do may still decode the difference. */
+        if (!filter && acc > BLOOM_LEGACY_MAX_SIZE) {
+            printf("Peer has no ibf of %d, trying %d.\n", acc,
+                   BLOOM_LEGACY_MAX_SIZE);
+            acc = BLOOM_LEGACY_MAX_SIZE;
+            filter = download_inv_bloom(srv, BLOOM_HASH, acc,
+                                        db->hash_version);
+        }
         if (!filter) goto error;
 
         printf("Downloaded filter.\n");
         count = 0;
-        if (retry_rdlock(db)) goto error;
-        if (!ibf_subtract(filter, db->filters[j])) {
+        token = read_begin(db);
+        if (!ibf_subtract(filter, get_bloom(db, BLOOM_HASH, acc,
+                        db->hash_version, NULL))) {
             ibf_time = us_timestamp();
-            unlock(db);
+            read_end(db, token);
             printf("Estimated difference from ibf=%ld.\n", ibf_count(filter));
-            while ((ret = ibf_decode(filter, hash))) {
-                if (ret < 0)
-                    continue;
-                key = download_key(srv, hash);
-                if (!key)
-                    goto error;
-                key_bytes += key->len;
-                if (parse_key_metadata(key))
-                    continue;
-                insert_key(db, key, 1);
-                count++;
-            }
+            ret = ibf_decode_all(filter, &pos, &n_pos, &neg, &n_neg);
+            if (ret < 0)
+                goto error;
+            printf("Decoded %lu remote and %lu local keys.\n", n_pos, n_neg);
+            /* Only keys the remote has and we lack need to be fetched. */
+            count = fetch_keys(db, srv, (const fp160 *)pos, n_pos, &key_bytes);
+            if (count < 0)
+                goto error;
             printf("Added %d keys.\n", count);
-            if (ibf_count(filter)) {
+            if (ret) {
                 printf("Undecodeable keys.\n");
                 goto error;
             }
         } else {
-            unlock(db);
+            read_end(db, token);
             goto error;
         }
     }
@@ -364,112 +3380,385 @@ peer_with(struct keydb_t *db, char *srv) {
     printf("%ld us total.\n", done_time - start_time);
     printf("%ld total key bytes.\n", key_bytes);
 
+    free(pos);
+    free(neg);
     ibf_free(filter);
     strata_free(strata);
     return 0;
 
 error:
     printf("Error synchronizing.\n");
+    free(pos);
+    free(neg);
     ibf_free(filter);
     strata_free(strata);
     return -1;
 }
 
-/* Returns the number of keys found, up to max_results. */
 int
-query_key_db(struct keydb_t *db, const char *query, int max_results,
-        struct pgp_key_t *keys, char exact, int after) {
-    /* Find the type of the query:
-     *      1=32-bit keyID,
-     *      2=64-bit keyID,
-     *      3=160-bit fingerprint,
-     *      4=user ID string.
-     * Autodetected using HKP format. */
-    char type;
-    int i;
-    int res_idx;
-    char tmp[3];
-
-    uint64_t id64;
-    uint32_t id32;
-    fp160 fp;
+peer_with(struct keydb_t *db, struct peer_t *peer) {
+    int ret;
 
-    type = res_idx = 0;
-    tmp[2] = 0;
+    if (key_db_ready(db, NULL, NULL) != 1) {
+        printf("Index not ready; not synchronizing.\n");
+        return -1;
+    }
+    /* Rateless reconciliation needs no estimate, but peers that predate it
+     * only serve fixed-size filters, and are not asked for symbols again
+     * for a while. */
+    if (peer->riblt_skip > 0) {
+        peer->riblt_skip--;
+    } else {
+        ret = peer_with_riblt(db, peer->host);
+        if (ret <= 0)
+            return ret;
+        if (ret == 2)
+            peer->riblt_skip = PEER_RIBLT_RETRY;
+        printf("Falling back to strata estimation.\n");
+    }
+    return peer_with_strata(db, peer->host);
+}
 
+/* Parses an HKP search string into probe, returning its QUERY_* type, or 0
+ * if it can't be searched for. */
+int
+parse_query(const char *query, struct key_idx_t *probe) {
+    memset(probe, 0, sizeof(*probe));
     if (query[0] == '0' && query[1] == 'x') {
         if (strlen(query) == 10) {
-            type = 1;
-            id32 = strtol(query, NULL, 16);
+            probe->id32 = strtoul(query, NULL, 16);
+            return QUERY_ID32;
         } else if (strlen(query) == 18) {
-            type = 2;
-            id64 = strtol(query, NULL, 16);
+            probe->id64 = strtoull(query, NULL, 16);
+            return QUERY_ID64;
         } else if (strlen(query) == 42) {
-            parse_fp160(query+2, fp);
-            type = 3;
+            parse_fp160(query+2, probe->fp);
+            return QUERY_FP;
         }
-    } else {
-        type = 4;
+        return 0;
     }
+    return QUERY_UID;
+}
 
-    if (!type) return 0;
-    if (retry_rdlock(db)) return -1;
+/* Stores the positions in key_idx of up to max keys matching the query in
+ * found, if it is not NULL, after skipping the first `after`. Positions
+ * come out in key_idx order either way. Any query walks the whole index
+ * if scan is set; otherwise user ID queries of three bytes or more go
+ * through the trigram index, shorter ones walk the whole index, as do
+ * longer ones if the trigram index fails, and the rest probe the hash
+ * index for their type. Must be called in a read section; keys added
+ * meanwhile are not seen. Returns the number of positions found. */
+int
+find_keys(struct keydb_t *db, const char *query, char exact, int scan,
+          int after, int *found, int max) {
+    struct key_idx_t probe;
+    struct idx_table_t *table;
+    const char *uid;
+    size_t slot, c, n_candidates;
+    int *candidates;
+    int type, i, n, ret, count;
+
+    n = 0;
+    type = parse_query(query, &probe);
+    if (!type || max <= 0)
+        return 0;
+    count = get_key_count(db);
+
+    /* The trigram index narrows user ID queries down to candidates, which
+     * are checked just as a scan would check them, in the same order. */
+    if (type == QUERY_UID && !scan) {
+        ret = trigram_candidates(db->by_uid, query, &candidates, &n_candidates);
+        if (ret == 0) {
+            for (c=0; c<n_candidates && candidates[c]<count; c++) {
+                i = candidates[c];
+                uid = key_uid(db, key_at(db, i));
+                if ((exact && !strstr(uid, query))
+                        || (!exact && !strcasestr(uid, query)))
+                    continue;
+                if (after) {
+                    after--;
+                    continue;
+                }
+                if (found)
+                    found[n] = i;
+                if (++n >= max)
+                    break;
+            }
+            free(candidates);
+            return n;
+        }
+    }
 
-    for (i=0; i<db->idx_count; i++) {
-        switch(type) {
-            default:
-                return 0;
+    if (type == QUERY_UID || scan) {
+        for (i=0; i<count; i++) {
+            if (type != QUERY_UID) {
+                if (!idx_table_match(key_at(db, i), &probe, type))
+                    continue;
+            } else {
+                uid = key_uid(db, key_at(db, i));
+                if ((exact && !strstr(uid, query))
+                        || (!exact && !strcasestr(uid, query)))
+                    continue;
+            }
+            /* Skip a user-specified number of keys for pagination. */
+            if (after) {
+                after--;
+                continue;
+            }
+            if (found)
+                found[n] = i;
+            if (++n >= max)
                 break;
-            case 1: if (db->key_idx[i].id32 != id32)
-                        continue; /* Try the next key. */
-                    break;        /* Add this key to the results. */
-            case 2: if (db->key_idx[i].id64 != id64)
-                        continue;
-                    break;
-            case 3: if (neq_fp160(db->key_idx[i].fp, fp))
-                        continue;
-                    break;
-            case 4: if ((exact && !strstr(db->key_idx[i].uid, query))
-                    || (!exact && !strcasestr(db->key_idx[i].uid, query)))
-                        continue;
-                    break;
         }
-        /* Skip a user-specified number of keys for pagination. */
+        return n;
+    }
+
+    table = idx_table_for(db, type);
+    if (!table)
+        return 0;
+    for (slot=idx_table_slot(table, idx_table_key(&probe, type));
+            (i=idx_table_get(table, slot)) >= 0; slot=(slot+1)&table->mask) {
+        if (i >= count || !idx_table_match(key_at(db, i), &probe, type))
+            continue;
         if (after) {
             after--;
             continue;
         }
-        /* Get the key into the next slot from BDB. */
-        if (retrieve_key(db, &keys[res_idx], db->key_idx[i].hash))
+        if (found)
+            found[n] = i;
+        if (++n >= max)
             break;
-        /*if (parse_key_metadata(&keys[res_idx]))
-            break;*/
-        /* Limit the total number of keys. */
-        if (++res_idx >= max_results)
+    }
+    return n;
+}
+
+/* Queries the shards in turn, as if their indexes were one after the
+ * other, skipping whole shards with fewer than `after` matches. */
+int
+sharded_query(struct keydb_t *db, const char *query, int max_results,
+        struct pgp_key_t *keys, char exact, int after) {
+    struct keydb_t *shard;
+    int i, n, ret, token, skipped;
+
+    n = 0;
+    for (i=0; i<db->n_shards && n<max_results; i++) {
+        shard = db->shards[i];
+        if (after) {
+            token = read_begin(shard);
+            skipped = find_keys(shard, query, exact, 0, 0, NULL, after);
+            read_end(shard, token);
+            if (skipped < after) {
+                after -= skipped;
+                continue;
+            }
+        }
+        ret = query_key_db(shard, query, max_results-n, keys+n, exact,
+                after);
+        if (ret < 0)
+            return n ? n : -1;
+        n += ret;
+        after = 0;
+    }
+    return n;
+}
+
+/* Returns the number of keys found, up to max_results. The hashes are
+ * copied out of the index before BDB is asked for the keys, so slow disk
+ * holds back no reclamation. */
+int
+query_key_db(struct keydb_t *db, const char *query, int max_results,
+        struct pgp_key_t *keys, char exact, int after) {
+    fp160 *hashes;
+    int *found;
+    int i, n, token;
+    int res_idx;
+
+    res_idx = 0;
+    if (max_results <= 0) return 0;
+    if (db->shards)
+        return sharded_query(db, query, max_results, keys, exact, after);
+    found = malloc(max_results*sizeof(int));
+    hashes = malloc(max_results*sizeof(fp160));
+    if (!found || !hashes) {
+        free(found);
+        free(hashes);
+        return -1;
+    }
+
+    token = read_begin(db);
+    n = find_keys(db, query, exact, 0, after, found, max_results);
+    for (i=0; i<n; i++)
+        memcpy(hashes[i], key_at(db, found[i])->hash, sizeof(fp160));
+    read_end(db, token);
+
+    for (i=0; i<n; i++) {
+        /* Get the key into the next slot from BDB. */
+        if (retrieve_key(db, &keys[res_idx], hashes[i]))
             break;
+        res_idx++;
     }
-    pthread_rwlock_unlock(&db->lock);
+    free(found);
+    free(hashes);
     return res_idx;
 }
 
+int
+count_key_matches(struct keydb_t *db, const char *query, int scan) {
+    int i, n, token;
+
+    if (db->shards) {
+        for (n=i=0; i<db->n_shards; i++)
+            n += count_key_matches(db->shards[i], query, scan);
+        return n;
+    }
+    token = read_begin(db);
+    n = find_keys(db, query, 0, scan, 0, NULL, get_key_count(db));
+    read_end(db, token);
+    return n;
+}
+
+/* Returns the shard holding the i-th key of a sharded database, counting
+ * through the shards in turn, and sets *i to its position there. Returns
+ * NULL if there is no such key. */
+struct keydb_t *
+shard_at(struct keydb_t *db, int *i) {
+    int s, count;
+
+    for (s=0; s<db->n_shards; s++) {
+        count = get_key_count(db->shards[s]);
+        if (*i < count)
+            return db->shards[s];
+        *i -= count;
+    }
+    return NULL;
+}
+
+int
+get_key_ids(struct keydb_t *db, int i, uint32_t *id32, uint64_t *id64,
+            fp160 fp) {
+    int token;
+
+    if (db->shards && i >= 0) {
+        db = shard_at(db, &i);
+        if (!db)
+            return -1;
+    }
+    if (i < 0 || i >= get_key_count(db))
+        return -1;
+    token = read_begin(db);
+    *id32 = key_at(db, i)->id32;
+    *id64 = key_at(db, i)->id64;
+    memcpy(fp, key_at(db, i)->fp, sizeof(fp160));
+    read_end(db, token);
+    return 0;
+}
+
+int
+get_key_uid(struct keydb_t *db, int i, char *uid, size_t len) {
+    int token;
+
+    if (db->shards && i >= 0) {
+        db = shard_at(db, &i);
+        if (!db)
+            return -1;
+    }
+    if (!len || i < 0 || i >= get_key_count(db))
+        return -1;
+    token = read_begin(db);
+    strncpy(uid, key_uid(db, key_at(db, i)), len-1);
+    uid[len-1] = '\0';
+    read_end(db, token);
+    return 0;
+}
+
+int
+close_sharded(struct keydb_t *db) {
+    int ret, i;
+
+    /* The indexer gives up at its next batch and starts no other shard. */
+    if (db->indexer_started) {
+        if (retry_wrlock(db)) return -1;
+        db->stop = 1;
+        unlock(db);
+        for (i=0; i<db->n_shards; i++) {
+            if (retry_wrlock(db->shards[i])) return -1;
+            db->shards[i]->stop = 1;
+            unlock(db->shards[i]);
+        }
+        pthread_join(db->indexer, NULL);
+        db->indexer_started = 0;
+    }
+    ret = 0;
+    for (i=0; i<db->n_shards; i++)
+        if (db->shards[i] && close_key_db(db->shards[i]))
+            ret = -1;
+    if (db->env_owner && close_env(db->env, db->txn))
+        ret = -1;
+    free(db->shards);
+    free(db->filename);
+    for(i=0; i<BLOOM_MAX_COUNT; i++)
+        if (db->folded[i])
+            release_view(db->folded[i]);
+    for(i=0; i<STRATA_MAX_COUNT; i++)
+        if (db->strata_views[i])
+            release_view(db->strata_views[i]);
+    epoch_free(db->epoch);
+    free(db);
+    return ret;
+}
+
 int
 close_key_db(struct keydb_t *db) {
     int ret, i;
+
+    if (db->shards)
+        return close_sharded(db);
+    /* A background indexer gives up at its next batch. */
+    if (db->indexer_started) {
+        if (retry_wrlock(db)) return -1;
+        db->stop = 1;
+        unlock(db);
+        pthread_join(db->indexer, NULL);
+        db->indexer_started = 0;
+    }
     if (retry_wrlock(db)) return -1;
+    filter_log_stop(db);
     ret = 0;
-    if (db->key_idx) {
-        for (i=0; i<db->idx_count; i++)
-            if (db->key_idx[i].uid)
-                free(db->key_idx[i].uid);
-        free(db->key_idx);
-    }
-    for(i=0; i<BLOOM_MAX_COUNT && db->filters[i]; i++)
-        ibf_free(db->filters[i]);
-    for(i=0; i<STRATA_MAX_COUNT && db->strata[i]; i++)
-        strata_free(db->strata[i]);
     if (db->dbp)
         if (db->dbp->close(db->dbp, 0))
             ret = -1;
+    /* Only once BDB has flushed the file does its state match the index. */
+    if (db->indexed && !ret && write_snapshot(db, db->filename))
+        fprintf(stderr, "Could not write snapshot of %s\n", db->filename);
+    if (db->env_owner && close_env(db->env, db->txn))
+        ret = -1;
+    for (i=0; i<db->idx_segments; i++)
+        if (!in_snapshot(db, db->key_idx[i]))
+            free(db->key_idx[i]);
+    free(db->key_idx);
+    for (i=0; i<UID_MAX_SEGMENTS; i++)
+        if (!in_snapshot(db, db->uids[i]))
+            free(db->uids[i]);
+    if (db->snapshot)
+        munmap(db->snapshot, db->snapshot_len);
+    free(db->filename);
+    free(db->log.entries);
+    free(db->log.batch);
+    ibf_free(db->master);
+    for(i=0; i<BLOOM_MAX_COUNT; i++)
+        if (db->folded[i])
+            release_view(db->folded[i]);
+    strata_free(db->strata);
+    for(i=0; i<STRATA_MAX_COUNT; i++)
+        if (db->strata_views[i])
+            release_view(db->strata_views[i]);
+    riblt_encoder_free(db->riblt);
+    idx_table_free(db->by_id32);
+    idx_table_free(db->by_id64);
+    idx_table_free(db->by_fp);
+    idx_table_free(db->by_hash);
+    trigram_free(db->by_uid);
+    epoch_free(db->epoch);
     free(db);
     return ret;
 }
@@ -477,11 +3766,14 @@ close_key_db(struct keydb_t *db) {
 int
 insert_key(struct keydb_t *db, struct pgp_key_t *pgp_key, int index) {
     DBT key, data;
-    int ret;
+    int ret, token;
 
     if (!db) return -1;
-    if (!db->dbp) return -1;
     if (!pgp_key) return -1;
+    if (db->shards)
+        return insert_key(db->shards[shard_of(pgp_key->hash, db->n_shards)],
+                pgp_key, index);
+    if (!db->dbp) return -1;
 
     memset(&key, 0, sizeof(key));
     memset(&data, 0, sizeof(data));
@@ -490,37 +3782,226 @@ insert_key(struct keydb_t *db, struct pgp_key_t *pgp_key, int index) {
     data.data = pgp_key->data;
     data.size = pgp_key->len;
 
-    if (retry_wrlock(db)) return -1;
+    /* Until the indexer is done, keys can't be added to the index. */
+    if (index && __atomic_load_n(&db->ready, __ATOMIC_ACQUIRE) != 1)
+        return -1;
 
+    /* A key that is already indexed must not reach the filters twice. */
+    if (index) {
+        token = read_begin(db);
+        ret = has_key(db, pgp_key->hash);
+        read_end(db, token);
+        if (ret)
+            return 1;
+    }
+    /* In an environment BDB keeps concurrent puts apart, and
+     * DB_NOOVERWRITE lets only one of two racing inserts of a key through,
+     * so the lock is only taken to index it. Otherwise BDB allows one
+     * writer at a time, and the put is made under the lock too. */
+    if (!db->locking && retry_wrlock(db)) return -1;
     ret = db->dbp->put(db->dbp, NULL, &key, &data, DB_NOOVERWRITE);
+    if (ret || !index) {
+        if (!db->locking)
+            unlock(db);
+        return ret == DB_KEYEXIST ? 1 : ret ? -1 : 0;
+    }
 
-    if (ret == DB_KEYEXIST)
-        goto success_lock;
-    else if (ret)
-        goto err_lock;
+    if (db->locking && retry_wrlock(db)) return -1;
+    /* A batch put, which overwrites, may have stored and indexed it. */
+    if (db->locking && has_key(db, pgp_key->hash))
+        ret = 1;
+    else
+        ret = add_key_to_index(db, pgp_key->version, pgp_key->len,
+                pgp_key->user_id, pgp_key->hash, pgp_key->fp,
+                pgp_key->id32, pgp_key->id64) ? -1 : 0;
+    unlock(db);
+    epoch_reclaim(db->epoch);
+    return ret;
+}
 
-success_lock:
-    if (index)
-        if (add_key_to_index(db, pgp_key->version, pgp_key->len, 
-                    pgp_key->user_id, pgp_key->hash, pgp_key->fp, 
-                    pgp_key->id32, pgp_key->id64))
-            goto err_lock;
+/* Puts the keys in [first, last) whose result is 0 from bulk, marking
+ * them -1 if the put fails. Returns 0 on success. */
+int
+put_bulk(struct keydb_t *db, DBT *bulk, int first, int last, int *results) {
+    int i;
 
-    unlock(db);
-    return 0;
-err_lock:
-    unlock(db);
+    if (!db->dbp->put(db->dbp, NULL, bulk, NULL,
+                DB_MULTIPLE_KEY | DB_OVERWRITE_DUP))
+        return 0;
+    for (i=first; i<last; i++)
+        if (!results[i])
+            results[i] = -1;
     return -1;
 }
 
+/* Stores the keys whose result is 0 with DB_MULTIPLE_KEY puts of up to
+ * MULTIPUT_SIZE bytes, marking those that could not be stored -1. */
+void
+put_keys(struct keydb_t *db, struct pgp_key_t *keys, int n, int *results) {
+    DBT bulk;
+    void *ptr;
+    size_t size;
+    int i, first, n_bulk;
+
+    size = sizeof(uint32_t);
+    for (i=0; i<n; i++)
+        if (!results[i])
+            size += sizeof(fp160)+keys[i].len+MULTIPUT_PAIR_OVERHEAD;
+    if (size > MULTIPUT_SIZE)
+        size = MULTIPUT_SIZE;
+    memset(&bulk, 0, sizeof(bulk));
+    bulk.ulen = size;
+    bulk.data = malloc(size);
+    if (!bulk.data) {
+        for (i=0; i<n; i++)
+            if (!results[i])
+                results[i] = -1;
+        return;
+    }
+
+    first = n_bulk = 0;
+    DB_MULTIPLE_WRITE_INIT(ptr, &bulk);
+    for (i=0; i<n; i++) {
+        if (results[i])
+            continue;
+        DB_MULTIPLE_KEY_WRITE_NEXT(ptr, &bulk, keys[i].hash, sizeof(fp160),
+                keys[i].data, keys[i].len);
+        if (ptr) {
+            if (!n_bulk++)
+                first = i;
+            continue;
+        }
+        /* A key that doesn't fit an empty buffer can't be put at all. */
+        if (!n_bulk)
+            results[i] = -1;
+        else {
+            put_bulk(db, &bulk, first, i, results);
+            i--;
+        }
+        n_bulk = 0;
+        DB_MULTIPLE_WRITE_INIT(ptr, &bulk);
+    }
+    if (n_bulk)
+        put_bulk(db, &bulk, first, n, results);
+    free(bulk.data);
+}
+
+/* Inserts the keys of a sharded database into their shards, a sub-batch
+ * per shard, keeping results in the order of keys. */
+int
+insert_sharded(struct keydb_t *db, struct pgp_key_t *keys, int n,
+               int *results) {
+    struct pgp_key_t *sub;
+    int start[KEYDB_MAX_SHARDS+1];
+    int *order, *sub_results;
+    int i, s, ret, count;
+
+    sub = malloc(n*sizeof(struct pgp_key_t));
+    order = malloc(n*sizeof(int));
+    sub_results = malloc(n*sizeof(int));
+    count = -1;
+    if (!sub || !order || !sub_results) {
+        for (i=0; i<n; i++)
+            results[i] = -1;
+        goto out;
+    }
+
+    /* Sorts the keys by shard, noting where each came from. */
+    memset(start, 0, sizeof(start));
+    for (i=0; i<n; i++)
+        start[shard_of(keys[i].hash, db->n_shards)+1]++;
+    for (s=0; s<db->n_shards; s++)
+        start[s+1] += start[s];
+    for (i=0; i<n; i++) {
+        s = shard_of(keys[i].hash, db->n_shards);
+        order[start[s]] = i;
+        sub[start[s]++] = keys[i];
+    }
+
+    count = 0;
+    for (s=0, i=0; s<db->n_shards; i=start[s++]) {
+        if (i == start[s])
+            continue;
+        ret = insert_keys(db->shards[s], sub+i, start[s]-i, sub_results+i);
+        if (ret < 0)
+            count = -1;
+        else if (count >= 0)
+            count += ret;
+    }
+    for (i=0; i<n; i++)
+        results[order[i]] = sub_results[i];
+out:
+    free(sub);
+    free(order);
+    free(sub_results);
+    return count;
+}
+
+int
+insert_keys(struct keydb_t *db, struct pgp_key_t *keys, int n, int *results) {
+    int i, count, token;
+
+    token = 0;
+    if (!db || n < 0 || (n && (!keys || !results))) return -1;
+    if (!n) return 0;
+    for (i=0; i<n; i++)
+        results[i] = -1;
+    if (db->shards)
+        return insert_sharded(db, keys, n, results);
+    if (!db->dbp) return -1;
+    if (__atomic_load_n(&db->ready, __ATOMIC_ACQUIRE) != 1)
+        return -1;
+
+    /* As with insert_key, the puts are made under the lock unless BDB
+     * keeps writers apart itself, and then only indexing takes it. */
+    if (db->locking)
+        token = read_begin(db);
+    else if (retry_wrlock(db))
+        return -1;
+    for (i=0; i<n; i++)
+        results[i] = has_key(db, keys[i].hash) ? 1 : 0;
+    if (db->locking)
+        read_end(db, token);
+
+    put_keys(db, keys, n, results);
+
+    if (db->locking && retry_wrlock(db)) {
+        for (i=0; i<n; i++)
+            if (!results[i])
+                results[i] = -1;
+        return -1;
+    }
+    /* Keys indexed meanwhile, or twice in the batch, are only put once
+     * more, over themselves, as the hash covers the whole key. */
+    count = 0;
+    for (i=0; i<n; i++) {
+        if (results[i])
+            continue;
+        if (has_key(db, keys[i].hash))
+            results[i] = 1;
+        else if (add_key_to_index(db, keys[i].version, keys[i].len,
+                    keys[i].user_id, keys[i].hash, keys[i].fp,
+                    keys[i].id32, keys[i].id64))
+            results[i] = -1;
+        else
+            count++;
+    }
+    unlock(db);
+    epoch_reclaim(db->epoch);
+    return count;
+}
+
 int
 retrieve_key(struct keydb_t *db, struct pgp_key_t *pgp_key, fp160 hash) {
     DBT key, data;
     int ret;
 
     if (!db) return -1;
-    if (!db->dbp) return -1;
     if (!pgp_key) return -1;
+    if (db->shards)
+        return retrieve_key(db->shards[shard_of(hash, db->n_shards)],
+                pgp_key, hash);
+    if (!db->dbp) return -1;
 
     memset(&key, 0, sizeof(key));
     memset(&data, 0, sizeof(data));
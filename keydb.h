@@ -5,22 +5,101 @@
 #include "types.h"
 #include "ibf.h"
 #include "setdiff.h"
+#include "riblt.h"
 
+/* Opens the database and builds its index. Filters and strata estimators
+ * use hashing scheme hash_version, one of IBF_HASH_*. */
 struct keydb_t *
-open_key_db(const char *filename, char create);
+open_key_db(const char *filename, char create, int hash_version);
+
+/* Opens the database like open_key_db, but returns as soon as BDB is open
+ * and, unless a current snapshot is loaded, builds the index on a
+ * background thread. Until key_db_ready returns 1 only retrieve_key can be
+ * relied on; insert_key refuses to index and peer_with to synchronize. */
+struct keydb_t *
+open_key_db_lazy(const char *filename, char create, int hash_version);
+
+#define KEYDB_MAX_SHARDS 256
+
+/* Transaction modes for struct keydb_env_t. Writes committing at the same
+ * time share a log flush, and a bulk put commits as one transaction. */
+#define KEYDB_TXN_NONE   0
+#define KEYDB_TXN_SYNC   1 /* Commits wait for the log to reach the disk. */
+#define KEYDB_TXN_NOSYNC 2 /* Commits only wait for the log to be written. */
+
+/* Berkeley DB tuning for open_key_db_env. Zero leaves BDB's default. The
+ * page size and hash table only take effect when a file is created. */
+struct keydb_env_t {
+    uint32_t cache_mb;  /* Buffer pool, shared by every shard. */
+    uint32_t page_size;
+    uint32_t nelem;     /* Keys to size the hash table for, in all. */
+    uint32_t ffactor;   /* Keys per hash bucket. */
+    int txn;            /* One of KEYDB_TXN_*. */
+};
+
+/* Opens a database like open_key_db, or open_key_db_lazy if lazy is set,
+ * in a Berkeley DB environment in the directory of filename configured by
+ * conf, unless it is NULL. The environment keeps concurrent writers apart
+ * itself, so puts are not made under the index lock. Spreads the keys
+ * over n_shards databases if that is not 0, as open_key_db_sharded. */
+struct keydb_t *
+open_key_db_env(const char *filename, char create, int hash_version,
+                const struct keydb_env_t *conf, int n_shards, int lazy);
+
+/* Opens a database spread over n_shards databases, each with its own BDB
+ * file, index, lock and filters, by a prefix of the key hash, so that
+ * writers to different shards never wait for each other. Its filters are
+ * the sums of the shards'. Builds the shards' indexes in the background,
+ * one shard at a time, if lazy is set. The number of shards must stay the
+ * same across runs. */
+struct keydb_t *
+open_key_db_sharded(const char *filename, char create, int hash_version,
+                    int n_shards, int lazy);
+
+/* Returns 1 once the index is complete, 0 while it is being built and -1
+ * if building it failed or the lock can't be taken. If keys and rate are
+ * not NULL they are set to the number of keys indexed so far and the keys
+ * per second since indexing started. */
+int
+key_db_ready(struct keydb_t *db, int *keys, double *rate);
 
 int
 query_key_db(struct keydb_t *db, const char *query, int max_results,
         struct pgp_key_t *keys, char exact, int after);
 
+/* Returns the number of keys matching query, case-insensitively, or -1 on
+ * error. Queries use the hash and trigram indexes unless scan is set, which
+ * makes them walk the whole index instead. For benchmarking. */
+int
+count_key_matches(struct keydb_t *db, const char *query, int scan);
+
+/* Stores the IDs and fingerprint of the i-th indexed key. Returns 0 on
+ * success. */
+int
+get_key_ids(struct keydb_t *db, int i, uint32_t *id32, uint64_t *id64,
+            fp160 fp);
+
+/* Copies up to len-1 bytes of the user ID of the i-th indexed key to uid,
+ * NUL-terminated. Returns 0 on success. */
 int
-ingest_file(struct keydb_t *db, const char *filename, float excl_pct);
+get_key_uid(struct keydb_t *db, int i, char *uid, size_t len);
+
+/* Adds the keys in the dump files filenames to the database, parsing
+ * chunks of them on a thread per core and writing them in order, and
+ * randomly leaves out excl_pct percent of them. The index counts as not
+ * ready meanwhile. Returns 0 on success. */
+int
+ingest_files(struct keydb_t *db, char *const *filenames, int n_files,
+             float excl_pct);
 
 int
 close_key_db(struct keydb_t *db);
 
+/* Synchronizes with peer, streaming rateless coded symbols if it serves
+ * them and falling back to a strata estimate and a fixed-size filter if
+ * not. Returns 0 on success. */
 int
-peer_with(struct keydb_t *db, char *srv);
+peer_with(struct keydb_t *db, struct peer_t *peer);
 
 int 
 retry_rdlock(struct keydb_t *db);
@@ -31,15 +110,74 @@ retry_wrlock(struct keydb_t *db);
 int 
 unlock(struct keydb_t *db);
 
+/* Starts a read section, returning a token for read_end. Lookups run in
+ * one of their own and need no lock; filters and estimators returned in
+ * one stay valid until it ends. Sections never wait for writers, nor
+ * writers for them. */
+int
+read_begin(struct keydb_t *db);
+
+void
+read_end(struct keydb_t *db, int token);
+
+/* Returns the filter with k hashes, N buckets and hashing scheme v, folded
+ * from the master filter, or NULL if it can't be served. If generation is
+ * not NULL it is set to the generation the filter reflects. Must be called
+ * in a read section; the result is not changed by later writes. */
 struct inv_bloom_t *
-get_bloom(struct keydb_t *db, int idx);
+get_bloom(struct keydb_t *db, int k, size_t N, int v, uint64_t *generation);
 
+int
+get_key_count(struct keydb_t *db);
+
+/* Returns the strata estimator with the given parameters, derived from the
+ * deepest one, or NULL if it can't be served. Must be called in a read
+ * section, as with get_bloom. */
 struct strata_estimator_t *
-get_strata(struct keydb_t *db, int idx);
+get_strata(struct keydb_t *db, int k, size_t N, int c, int v,
+           uint64_t *generation);
 
 int
+get_hash_version(struct keydb_t *db);
+
+/* Returns the filter generation, which counts the batches of added keys
+ * that have reached the filters. Keys are indexed at once, but reach the
+ * filters shortly after, a batch at a time. */
+uint64_t
+get_generation(struct keydb_t *db);
+
+/* The keys in the filters at some point, which a rateless stream is coded
+ * over however many are added while it lasts. */
+struct riblt_set_t {
+    int n_keys[KEYDB_MAX_SHARDS]; /* Keys filtered in each shard. */
+};
+
+/* Stores the set of keys now in the filters in set. */
+void
+get_riblt_set(struct keydb_t *db, struct riblt_set_t *set);
+
+/* Copies rateless coded symbols start to start+n-1 of set into out.
+ * Returns 0 on success, and -1 on failure or if too many keys have been
+ * added since set was taken. */
+int
+get_riblt_symbols(struct keydb_t *db, const struct riblt_set_t *set,
+                  size_t start, size_t n, struct riblt_symbol_t *out);
+
+/* Stores pgp_key, and adds it to the index and filters if index is set.
+ * Returns 0 on success, 1 if the key is already there, in which case
+ * nothing is changed, and -1 on error. */
+int
 insert_key(struct keydb_t *db, struct pgp_key_t *pgp_key, int index);
 
+/* Stores and indexes n keys under one lock and in as few bulk puts as
+ * will hold them, their filter updates going to the filters in batches.
+ * Sets results[i] as insert_key would return for keys[i], with 1 for keys
+ * already indexed or earlier in the batch. Returns the number of keys
+ * added, or -1 if the batch could not be tried, as before the index is
+ * ready, in which case the results of keys not added are -1. */
+int
+insert_keys(struct keydb_t *db, struct pgp_key_t *keys, int n, int *results);
+
 int
 retrieve_key(struct keydb_t *db, struct pgp_key_t *key, fp160 keyid);
 
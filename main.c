@@ -2,6 +2,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
 #include <signal.h>
 #include "hash.h"
@@ -11,6 +12,7 @@
 #include "key.h"
 #include "keydb.h"
 #include "serv.h"
+#include "bench.h"
 
 char done = 0;
 char do_poll = 1;
@@ -32,33 +34,77 @@ int main(int argc, char **argv) {
 
     struct peer_t peers[MAX_PEERS];
     struct status_t status;
-    char verbose, create, ingest;
+    char verbose, create, ingest, bench, lazy, use_env;
     struct keydb_t *db;
+    struct keydb_env_t env;
     struct serv_state_t *serv;
     int opt;
     int i;
     int port = 8080;
+    /* Peers that predate hashing schemes only speak the first. */
+    int hash_version = IBF_HASH_SHA1;
+    int shards = 0;
     unsigned alarm_int = 15;
     float excl_pct = 0;;
 
-    verbose = create = ingest = 0;
+    verbose = create = ingest = bench = lazy = 0;
+    memset(&env, 0, sizeof(env));
 
-    while ((opt = getopt(argc, argv, "a:cd:e:h:ip:qr:v")) != -1) {
+    while ((opt = getopt(argc, argv, "a:bcd:e:F:h:H:ilM:N:p:P:qr:s:T:v")) != -1) {
         switch (opt) {
             default:
             case '?': return -1;                break;
             case 'a': alarm_int = atoi(optarg); break;
+            case 'b': bench = 1;                break;
             case 'c': create = 1;               break;
             case 'd': db_name = optarg;         break;
             case 'e': excl_pct = atof(optarg);  break;
+            case 'F': env.ffactor = atoi(optarg); break;
             case 'h': hosts_file = optarg;      break;
+            case 'H': hash_version = atoi(optarg); break;
             case 'i': ingest = 1;               break;
+            case 'l': lazy = 1;                 break;
+            case 'M': env.cache_mb = atoi(optarg); break;
+            case 'N': env.nelem = atoi(optarg); break;
             case 'p': port = atoi(optarg);      break;
+            case 'P': env.page_size = atoi(optarg); break;
             case 'r': serv_root = optarg;       break;
+            case 's': shards = atoi(optarg);    break;
+            case 'T': env.txn = atoi(optarg);   break;
             case 'v': verbose = 1;              break;
         }
     }
 
+    if (hash_version != IBF_HASH_SHA1 && hash_version != IBF_HASH_FAST) {
+        printf("Unknown hashing scheme %d.\n", hash_version);
+        return -1;
+    }
+
+    if (shards < 0 || shards > KEYDB_MAX_SHARDS) {
+        printf("Number of shards must be at most %d.\n", KEYDB_MAX_SHARDS);
+        return -1;
+    }
+
+    if (env.txn < KEYDB_TXN_NONE || env.txn > KEYDB_TXN_NOSYNC) {
+        printf("Unknown transaction mode %d.\n", env.txn);
+        return -1;
+    }
+    /* Any Berkeley DB setting opens the database in an environment. */
+    use_env = env.cache_mb || env.page_size || env.nelem || env.ffactor
+        || env.txn;
+
+    if (bench) {
+        bench_ibf();
+        /* Lookups are timed against an existing database, if there is one. */
+        db = open_key_db_env(db_name, 0, hash_version,
+                use_env ? &env : NULL, shards, 0);
+        if (db) {
+            bench_lookup(db);
+            close_key_db(db);
+        }
+        return 0;
+    }
+
     status.port = port;
     status.alarm_int = alarm_int;
     status.peers = peers;
@@ -69,6 +115,7 @@ int main(int argc, char **argv) {
         return -1;
     }
 
+    memset(peers, 0, sizeof(peers));
     for (i=0; i<MAX_PEERS; i++) {
         if (2 != fscanf(hosts_in, "%d %1024[^ \r\n\t\v\f]", &peers[i].interval, peers[i].host)) {
             peers[i].interval = 0;
@@ -89,7 +136,9 @@ int main(int argc, char **argv) {
     }
 
 
-    db = open_key_db(db_name, create);
+    /* Ingesting adds to the index, so it has to be built first. */
+    db = open_key_db_env(db_name, create, hash_version,
+            use_env ? &env : NULL, shards, lazy && !ingest);
     if (!db) {
         if (create)
             printf("Unable to open/create database %s\n", db_name);
@@ -99,14 +148,13 @@ int main(int argc, char **argv) {
     }
 
     if (ingest) {
-        for (i=optind; i<argc; i++) {
-            if (ingest_file(db, argv[i], excl_pct))  {
-                printf("Error ingesting file %s\n", argv[i]);
-                return -1;
-            }
+        if (ingest_files(db, argv+optind, argc-optind, excl_pct))  {
+            printf("Error ingesting files\n");
+            return -1;
         }
     } 
-    status.nkeys = ibf_count(get_bloom(db, 0));
+    status.nkeys = get_key_count(db);
+    status.db = db;
     signal(SIGINT, &handle_sig);
     signal(SIGTERM, &handle_sig);
     signal(SIGALRM, &handle_sig);
@@ -128,10 +176,10 @@ int main(int argc, char **argv) {
                 if (peers[i].countdown <= 0) {
                     printf("Polling %s.\n", peers[i].host);
                     peers[i].countdown = peers[i].interval;
-                    peers[i].status = peer_with(db, peers[i].host);
+                    peers[i].status = peer_with(db, &peers[i]);
                 }
             }
-            status.nkeys = ibf_count(get_bloom(db, 0));
+            status.nkeys = get_key_count(db);
         }
     }
     printf("Received signal, terminating.\n");
@@ -0,0 +1,442 @@
+#include "riblt.h"
+#include "ibf.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define RIBLT_MAGIC "RBLT"
+#define RIBLT_FORMAT 1
+
+/* Multiplier of the generator each element uses to pick its symbols. */
+#define RIBLT_PRNG_MUL 0xDA942042E4DD58B5ULL
+
+/* Index of a symbol that is never reached. */
+#define RIBLT_NEVER UINT64_MAX
+
+/* An element, and where it is in its sequence of symbols. */
+struct riblt_source_t {
+    fp160    element;
+    int      sign;     /* Added to the count of every symbol it maps to. */
+    uint64_t checksum;
+    uint64_t prng;
+    uint64_t next;     /* Index of the next symbol the element maps to. */
+};
+
+/* A set of elements, kept in a heap by the next symbol they map to so that
+ * producing a symbol only touches the elements that belong in it. */
+struct riblt_window_t {
+    struct riblt_source_t *sources;
+    size_t *heap;
+    size_t n;
+    size_t sources_alloc;
+    size_t heap_alloc;
+};
+
+struct riblt_encoder_t {
+    struct riblt_window_t set;
+    struct riblt_symbol_t *symbols;
+    size_t n_symbols;
+    size_t symbols_alloc;
+};
+
+struct riblt_decoder_t {
+    /* Elements decoded so far, to be removed from later symbols. */
+    struct riblt_window_t decoded;
+    /* Received symbols, less the local ones and everything decoded. */
+    struct riblt_symbol_t *symbols;
+    size_t n_symbols;
+    size_t symbols_alloc;
+    /* Symbols that may have become pure. */
+    size_t *queue;
+    size_t q_len;
+    size_t q_alloc;
+    fp160 *remote;
+    size_t n_remote;
+    size_t remote_alloc;
+    fp160 *local;
+    size_t n_local;
+    size_t local_alloc;
+};
+
+/* Points source at symbol 0, which every element maps to. */
+void
+riblt_source_init(struct riblt_source_t *source, const fp160 element,
+                  uint64_t checksum, int sign) {
+    memcpy(source->element, element, sizeof(fp160));
+    source->sign = sign;
+    source->checksum = checksum;
+    source->prng = checksum;
+    source->next = 0;
+}
+
+/* Moves source on to the next symbol it maps to. The gap after symbol i is
+ * drawn so that the element lands in symbol j with probability about
+ * 1/(1+j/2). Both ends must agree on every index, and the arithmetic only
+ * uses correctly rounded IEEE operations, so it is the same everywhere. */
+void
+riblt_source_advance(struct riblt_source_t *source) {
+    double step;
+
+    source->prng *= RIBLT_PRNG_MUL;
+    step = ceil((source->next + 1.5)
+            * (4294967296.0/sqrt((double)source->prng + 1) - 1));
+    if (step >= (double)(RIBLT_NEVER - source->next))
+        source->next = RIBLT_NEVER;
+    else
+        source->next += (uint64_t)step;
+}
+
+void
+riblt_symbol_apply(struct riblt_symbol_t *symbol,
+                   const struct riblt_source_t *source) {
+    symbol->count += source->sign;
+    ibf_fp160_xor(symbol->sum, source->element);
+    symbol->checksum ^= source->checksum;
+}
+
+/* Returns non-zero iff symbol holds exactly one element. */
+int
+riblt_symbol_pure(const struct riblt_symbol_t *symbol) {
+    if (symbol->count != 1 && symbol->count != -1)
+        return 0;
+    return symbol->checksum == ibf_fast_checksum(symbol->sum);
+}
+
+int
+riblt_symbol_empty(const struct riblt_symbol_t *symbol) {
+    return !symbol->count && !symbol->checksum
+        && ibf_fp160_zero(symbol->sum);
+}
+
+/* Grows *array, of *alloc items of the given size, to hold at least n.
+ * Returns 0 on success. */
+int
+riblt_reserve(void **array, size_t *alloc, size_t n, size_t size) {
+    size_t new_alloc;
+    void *tmp;
+
+    if (n <= *alloc)
+        return 0;
+    new_alloc = *alloc ? 2*(*alloc) : 64;
+    if (new_alloc < n)
+        new_alloc = n;
+    tmp = realloc(*array, new_alloc*size);
+    if (!tmp) return -1;
+    *array = tmp;
+    *alloc = new_alloc;
+    return 0;
+}
+
+/* Restores the heap property for the entry at position i, which may only
+ * have moved later in the sequence. */
+void
+riblt_window_sift_down(struct riblt_window_t *window, size_t i) {
+    size_t child, top;
+
+    top = window->heap[i];
+    for (;;) {
+        child = 2*i+1;
+        if (child >= window->n)
+            break;
+        if (child+1 < window->n
+                && window->sources[window->heap[child+1]].next
+                 < window->sources[window->heap[child]].next)
+            child++;
+        if (window->sources[window->heap[child]].next
+                >= window->sources[top].next)
+            break;
+        window->heap[i] = window->heap[child];
+        i = child;
+    }
+    window->heap[i] = top;
+}
+
+/* Adds source to the window. Returns 0 on success. */
+int
+riblt_window_push(struct riblt_window_t *window,
+                  const struct riblt_source_t *source) {
+    size_t i, parent;
+
+    if (riblt_reserve((void **)&window->sources, &window->sources_alloc,
+                window->n+1, sizeof(struct riblt_source_t)))
+        return -1;
+    if (riblt_reserve((void **)&window->heap, &window->heap_alloc,
+                window->n+1, sizeof(size_t)))
+        return -1;
+
+    window->sources[window->n] = *source;
+    for (i=window->n++; i; i=parent) {
+        parent = (i-1)/2;
+        if (window->sources[window->heap[parent]].next <= source->next)
+            break;
+        window->heap[i] = window->heap[parent];
+    }
+    window->heap[i] = window->n-1;
+    return 0;
+}
+
+/* Applies every element of the window that maps to symbol index to it. */
+void
+riblt_window_apply(struct riblt_window_t *window,
+                   struct riblt_symbol_t *symbol, uint64_t index) {
+    struct riblt_source_t *source;
+
+    while (window->n) {
+        source = &window->sources[window->heap[0]];
+        if (source->next != index)
+            break;
+        riblt_symbol_apply(symbol, source);
+        riblt_source_advance(source);
+        riblt_window_sift_down(window, 0);
+    }
+}
+
+void
+riblt_window_free(struct riblt_window_t *window) {
+    free(window->sources);
+    free(window->heap);
+}
+
+struct riblt_encoder_t *
+riblt_encoder_allocate() {
+    struct riblt_encoder_t *encoder;
+
+    encoder = malloc(sizeof(struct riblt_encoder_t));
+    if (!encoder) return NULL;
+    memset(encoder, 0, sizeof(struct riblt_encoder_t));
+    return encoder;
+}
+
+int
+riblt_encoder_add(struct riblt_encoder_t *encoder, const fp160 element) {
+    struct riblt_source_t source;
+
+    riblt_source_init(&source, element, ibf_fast_checksum(element), 1);
+    while (source.next < encoder->n_symbols) {
+        riblt_symbol_apply(&encoder->symbols[source.next], &source);
+        riblt_source_advance(&source);
+    }
+    return riblt_window_push(&encoder->set, &source);
+}
+
+void
+riblt_symbols_remove(struct riblt_symbol_t *symbols, size_t start, size_t n,
+                     const fp160 element) {
+    struct riblt_source_t source;
+
+    riblt_source_init(&source, element, ibf_fast_checksum(element), -1);
+    while (source.next < start+n) {
+        if (source.next >= start)
+            riblt_symbol_apply(&symbols[source.next-start], &source);
+        riblt_source_advance(&source);
+    }
+}
+
+const struct riblt_symbol_t *
+riblt_encoder_symbols(struct riblt_encoder_t *encoder, size_t n) {
+    struct riblt_symbol_t *symbol;
+
+    if (riblt_reserve((void **)&encoder->symbols, &encoder->symbols_alloc, n,
+                sizeof(struct riblt_symbol_t)))
+        return NULL;
+
+    while (encoder->n_symbols < n) {
+        symbol = &encoder->symbols[encoder->n_symbols];
+        memset(symbol, 0, sizeof(struct riblt_symbol_t));
+        riblt_window_apply(&encoder->set, symbol, encoder->n_symbols);
+        encoder->n_symbols++;
+    }
+    return encoder->symbols;
+}
+
+size_t
+riblt_encoder_size(const struct riblt_encoder_t *encoder) {
+    return encoder->set.n;
+}
+
+void
+riblt_symbol_add(struct riblt_symbol_t *A, const struct riblt_symbol_t *B) {
+    A->count += B->count;
+    ibf_fp160_xor(A->sum, B->sum);
+    A->checksum ^= B->checksum;
+}
+
+void
+riblt_encoder_free(struct riblt_encoder_t *encoder) {
+    if (!encoder)
+        return;
+    riblt_window_free(&encoder->set);
+    free(encoder->symbols);
+    free(encoder);
+}
+
+struct riblt_decoder_t *
+riblt_decoder_allocate() {
+    struct riblt_decoder_t *decoder;
+
+    decoder = malloc(sizeof(struct riblt_decoder_t));
+    if (!decoder) return NULL;
+    memset(decoder, 0, sizeof(struct riblt_decoder_t));
+    return decoder;
+}
+
+/* Queues symbol i if it might be pure. Returns 0 on success. */
+int
+riblt_decoder_queue(struct riblt_decoder_t *decoder, size_t i) {
+    if (abs(decoder->symbols[i].count) != 1)
+        return 0;
+    if (riblt_reserve((void **)&decoder->queue, &decoder->q_alloc,
+                decoder->q_len+1, sizeof(size_t)))
+        return -1;
+    decoder->queue[decoder->q_len++] = i;
+    return 0;
+}
+
+/* Peels pure symbols until none are left. Each element found is removed
+ * from every symbol received so far, and remembered so that it can be
+ * removed from later ones as they arrive. Returns 0 on success. */
+int
+riblt_decoder_peel(struct riblt_decoder_t *decoder) {
+    struct riblt_symbol_t *symbol;
+    struct riblt_source_t source;
+    size_t i;
+
+    while (decoder->q_len) {
+        i = decoder->queue[--decoder->q_len];
+        symbol = &decoder->symbols[i];
+        if (!riblt_symbol_pure(symbol))
+            continue;
+
+        if (symbol->count > 0) {
+            if (ibf_list_append(&decoder->remote, &decoder->n_remote,
+                        &decoder->remote_alloc, symbol->sum))
+                return -1;
+        } else {
+            if (ibf_list_append(&decoder->local, &decoder->n_local,
+                        &decoder->local_alloc, symbol->sum))
+                return -1;
+        }
+
+        riblt_source_init(&source, symbol->sum, symbol->checksum,
+                -symbol->count);
+        while (source.next < decoder->n_symbols) {
+            riblt_symbol_apply(&decoder->symbols[source.next], &source);
+            if (riblt_decoder_queue(decoder, source.next))
+                return -1;
+            riblt_source_advance(&source);
+        }
+        if (riblt_window_push(&decoder->decoded, &source))
+            return -1;
+    }
+    return 0;
+}
+
+int
+riblt_decoder_add(struct riblt_decoder_t *decoder,
+                  const struct riblt_symbol_t *remote,
+                  const struct riblt_symbol_t *local) {
+    struct riblt_symbol_t *symbol;
+    size_t i;
+
+    if (riblt_reserve((void **)&decoder->symbols, &decoder->symbols_alloc,
+                decoder->n_symbols+1, sizeof(struct riblt_symbol_t)))
+        return -1;
+
+    i = decoder->n_symbols++;
+    symbol = &decoder->symbols[i];
+    *symbol = *remote;
+    if (local) {
+        symbol->count -= local->count;
+        ibf_fp160_xor(symbol->sum, local->sum);
+        symbol->checksum ^= local->checksum;
+    }
+    riblt_window_apply(&decoder->decoded, symbol, i);
+
+    if (riblt_decoder_queue(decoder, i)) return -1;
+    if (riblt_decoder_peel(decoder))     return -1;
+
+    /* Every element is in symbol 0, so it empties last. */
+    return riblt_symbol_empty(&decoder->symbols[0]);
+}
+
+size_t
+riblt_decoder_count(const struct riblt_decoder_t *decoder) {
+    return decoder->n_symbols;
+}
+
+void
+riblt_decoder_results(const struct riblt_decoder_t *decoder,
+                      const fp160 **remote, size_t *n_remote,
+                      const fp160 **local, size_t *n_local) {
+    *remote = (const fp160 *)decoder->remote;
+    *n_remote = decoder->n_remote;
+    *local = (const fp160 *)decoder->local;
+    *n_local = decoder->n_local;
+}
+
+void
+riblt_decoder_free(struct riblt_decoder_t *decoder) {
+    if (!decoder)
+        return;
+    riblt_window_free(&decoder->decoded);
+    free(decoder->symbols);
+    free(decoder->queue);
+    free(decoder->remote);
+    free(decoder->local);
+    free(decoder);
+}
+
+size_t
+riblt_write_header(uint8_t *buf) {
+    memcpy(buf, RIBLT_MAGIC, 4);
+    buf[4] = RIBLT_FORMAT;
+    return RIBLT_HEADER_LEN;
+}
+
+int
+riblt_check_header(const uint8_t *buf) {
+    return memcmp(buf, RIBLT_MAGIC, 4) || buf[4] != RIBLT_FORMAT;
+}
+
+/* Symbols are a zigzag varint count, the sum, and the checksum least
+ * significant byte first. */
+size_t
+riblt_write_symbol(uint8_t *buf, const struct riblt_symbol_t *symbol) {
+    size_t w;
+    uint64_t h;
+    int i;
+
+    w = ibf_put_varint(buf, ((uint32_t)symbol->count<<1)
+                          ^ (uint32_t)(symbol->count>>31));
+    memcpy(buf+w, symbol->sum, 20);
+    w += 20;
+    h = symbol->checksum;
+    for (i=0; i<8; i++, h >>= 8)
+        buf[w++] = h&0xFF;
+    return w;
+}
+
+int
+riblt_read_symbol(const uint8_t **buf, const uint8_t *end,
+                  struct riblt_symbol_t *symbol) {
+    const uint8_t *p;
+    uint64_t zz;
+    int i;
+
+    p = *buf;
+    if (ibf_get_varint(&p, end, &zz))
+        return end-*buf < 10 ? 1 : -1;
+    if (zz > UINT32_MAX)
+        return -1;
+    if (end-p < 28)
+        return 1;
+
+    symbol->count = (int32_t)((zz>>1) ^ -(zz&1));
+    memcpy(symbol->sum, p, 20);
+    p += 20;
+    symbol->checksum = 0;
+    for (i=7; i>=0; i--)
+        symbol->checksum = (symbol->checksum<<8) | p[i];
+    *buf = p+8;
+    return 0;
+}
@@ -0,0 +1,110 @@
+#ifndef RIBLT_H_
+#define RIBLT_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include "types.h"
+
+/* Rateless invertible Bloom lookup tables. Instead of a filter of fixed
+ * size, the encoder produces an endless sequence of coded symbols, each
+ * the sum of a pseudo-random subset of the set. Every element is in
+ * symbol 0, and in symbol i with probability about 1/(1+i/2), so any
+ * prefix of the sequence behaves like a filter of that size. A peer
+ * subtracts its own symbols from the ones it receives and peels the
+ * difference, stopping once symbol 0 is empty; on average that takes
+ * well under twice as many symbols as there are differences. */
+
+/* Bytes taken by the stream header, and the bounds on one symbol. */
+#define RIBLT_HEADER_LEN 5
+#define RIBLT_SYMBOL_MIN (1+20+8)
+#define RIBLT_SYMBOL_MAX (10+20+8)
+
+struct riblt_symbol_t {
+    int32_t  count;
+    fp160    sum;
+    uint64_t checksum;
+};
+
+struct riblt_encoder_t;
+struct riblt_decoder_t;
+
+/* Allocates an encoder for the empty set. Returns NULL on failure. */
+struct riblt_encoder_t *
+riblt_encoder_allocate();
+
+/* Adds element to the set. Symbols that were already produced are updated
+ * in place. Returns 0 on success. */
+int
+riblt_encoder_add(struct riblt_encoder_t *encoder, const fp160 element);
+
+/* Takes element out of symbols, which are coded symbols start to
+ * start+n-1 of a set holding it, leaving those of the set without it. */
+void
+riblt_symbols_remove(struct riblt_symbol_t *symbols, size_t start, size_t n,
+                     const fp160 element);
+
+/* Produces the first n coded symbols, if they have not been already, and
+ * returns them. The result is valid until the encoder is next changed.
+ * Returns NULL on failure. */
+const struct riblt_symbol_t *
+riblt_encoder_symbols(struct riblt_encoder_t *encoder, size_t n);
+
+/* Returns the number of elements in the set. */
+size_t
+riblt_encoder_size(const struct riblt_encoder_t *encoder);
+
+/* Adds symbol B, coded over a set disjoint from A's, to A in place, giving
+ * the symbol with the same index for the union of the two. */
+void
+riblt_symbol_add(struct riblt_symbol_t *A, const struct riblt_symbol_t *B);
+
+void
+riblt_encoder_free(struct riblt_encoder_t *encoder);
+
+/* Allocates a decoder. Returns NULL on failure. */
+struct riblt_decoder_t *
+riblt_decoder_allocate();
+
+/* Feeds the next coded symbol of the remote set, along with the symbol with
+ * the same index from the local set, or NULL if the local set is empty.
+ * Returns 1 once the difference has been decoded completely, 0 if more
+ * symbols are needed, and -1 on failure. */
+int
+riblt_decoder_add(struct riblt_decoder_t *decoder,
+                  const struct riblt_symbol_t *remote,
+                  const struct riblt_symbol_t *local);
+
+/* Returns the number of symbols fed to the decoder so far. */
+size_t
+riblt_decoder_count(const struct riblt_decoder_t *decoder);
+
+/* Points remote and local at the elements decoded so far that only the
+ * remote or only the local set holds. The lists belong to the decoder. */
+void
+riblt_decoder_results(const struct riblt_decoder_t *decoder,
+                      const fp160 **remote, size_t *n_remote,
+                      const fp160 **local, size_t *n_local);
+
+void
+riblt_decoder_free(struct riblt_decoder_t *decoder);
+
+/* Writes the stream header to buf, returning its length. */
+size_t
+riblt_write_header(uint8_t *buf);
+
+/* Returns 0 iff buf starts with a header this version understands. buf
+ * must hold at least RIBLT_HEADER_LEN bytes. */
+int
+riblt_check_header(const uint8_t *buf);
+
+/* Writes symbol to buf, returning its length, at most RIBLT_SYMBOL_MAX. */
+size_t
+riblt_write_symbol(uint8_t *buf, const struct riblt_symbol_t *symbol);
+
+/* Reads a symbol from *buf, advancing it. Returns 0 on success, 1 if the
+ * buffer ends before the symbol does, and -1 if it is malformed. */
+int
+riblt_read_symbol(const uint8_t **buf, const uint8_t *end,
+                  struct riblt_symbol_t *symbol);
+
+#endif
@@ -15,6 +15,19 @@
 #define PATH_LEN 256
 #define BUF_SIZE (16*1024)
 #define MAX_RESULTS 1000
+#define BINARY_TYPE "application/x-aks-ibf"
+#define RIBLT_TYPE "application/x-aks-riblt"
+/* MHD_SIZE_UNKNOWN, for streams that end when the client stops reading. */
+#define STREAM_SIZE_UNKNOWN ((uint64_t)-1)
+/* Caps on rateless streams. Decoding takes about 1.35 symbols per key
+ * that differs, and no more than two for small differences, so the limit
+ * only stops streams that could never decode from growing the cache. */
+#define RIBLT_SLACK 64
+#define RIBLT_MAX_SYMBOLS (1<<20)
+/* Seconds a client is asked to wait while the index is being built. */
+#define INDEX_RETRY_AFTER "10"
+/* Tells clients which batch of added keys a filter or estimator reflects. */
+#define GENERATION_HEADER "X-Filter-Generation"
 
 struct serv_state_t {
     struct _u_instance inst;
@@ -28,6 +41,7 @@ int reply_response_status(struct _u_response *response,
     switch(status) {
         default:  status = 500;
         case 500: expl   = "Internal server error"; break;
+        case 503: expl   = "Service unavailable";   break;
         case 501: expl   = "Not implemented";       break;
         case 400: expl   = "Bad request";           break;
         case 403: expl   = "Invalid path";          break;
@@ -42,6 +56,23 @@ int reply_response_status(struct _u_response *response,
     return U_CALLBACK_COMPLETE;
 }
 
+/* Replies to a request that needs the index while it is being built, or
+ * if building it failed. */
+int reply_not_ready(struct _u_response *response, struct keydb_t *db) {
+    if (key_db_ready(db, NULL, NULL) < 0)
+        return reply_response_status(response, 503, "Index unavailable");
+    ulfius_add_header_to_response(response, "Retry-After", INDEX_RETRY_AFTER);
+    return reply_response_status(response, 503, "Index is being built");
+}
+
+void add_generation_header(struct _u_response *response,
+                           uint64_t generation) {
+    char buf[32];
+
+    snprintf(buf, sizeof(buf), "%llu", (unsigned long long)generation);
+    ulfius_add_header_to_response(response, GENERATION_HEADER, buf);
+}
+
 int callback_index(const struct _u_request *request, 
                    struct _u_response *response,
                    void *user_data) {
@@ -234,6 +265,10 @@ int callback_hkp_lookup(const struct _u_request *request,
             index ? "index" : 
             vindex ? "vindex" : "error",
             search, fingerprint, mr, exact);
+    /* Downloads by hash go straight to BDB; everything else searches the
+     * index. */
+    if (!download && key_db_ready(db, NULL, NULL) != 1)
+        return reply_not_ready(response, db);
     if (index || get)
         num_results = query_key_db(db, search, MAX_RESULTS, results, exact, after);
 
@@ -280,15 +315,32 @@ int callback_hkp_lookup(const struct _u_request *request,
     }
 }
 
+/* Returns non-zero if the client asked for the binary filter encoding, with
+ * either ?fmt=bin or an Accept header. */
+int
+wants_binary(const struct _u_request *request) {
+    const char *accept;
+
+    if (u_map_has_key(request->map_url, "fmt")
+            && !strcmp(u_map_get(request->map_url, "fmt"), "bin"))
+        return 1;
+    accept = u_map_get_case(request->map_header, "Accept");
+    return accept && strstr(accept, BINARY_TYPE);
+}
+
 int callback_bloom(const struct _u_request *request,
                    struct _u_response *response,
                    void *db_) {
     char *resp;
-    int size, hcnt;
+    size_t resp_len;
+    int size, hcnt, version, binary, token;
+    uint64_t generation;
     struct keydb_t *db = db_;
-    int i;
+    struct inv_bloom_t *filter;
 
     printf("Received ibf request.\n");
+    if (key_db_ready(db, NULL, NULL) != 1)
+        return reply_not_ready(response, db);
 
     /* These are required options. */
     if (!u_map_has_key(request->map_url, "size"))
@@ -301,41 +353,59 @@ int callback_bloom(const struct _u_request *request,
     else
         hcnt = atoi(u_map_get(request->map_url, "hcnt"));
 
+    /* Peers that predate versioning don't ask for a hashing scheme. */
+    if (!u_map_has_key(request->map_url, "hash"))
+        version = IBF_HASH_SHA1;
+    else
+        version = atoi(u_map_get(request->map_url, "hash"));
+
+    binary = wants_binary(request);
+
     printf("Parsed ibf request successfully:\n");
     printf("\tsize=%d\n", size);
     printf("\thcnt=%d\n", hcnt);
+    printf("\thash=%d\n", version);
+    printf("\tbinary=%d\n", binary);
 
     resp = NULL;
-    for (i=0; get_bloom(db, i); i++) {
-        if(ibf_match(get_bloom(db, i), hcnt, size)) {
-            if (retry_rdlock(db)) goto serv_error;
-            resp = ibf_write(get_bloom(db, i));
-            unlock(db);
-            break;
+    token = read_begin(db);
+    filter = get_bloom(db, hcnt, size, version, &generation);
+    if (filter) {
+        if (binary) {
+            resp = (char *)ibf_write_binary(filter, &resp_len);
+        } else {
+            resp = ibf_write(filter);
+            resp_len = resp ? strlen(resp) : 0;
         }
     }
+    read_end(db, token);
 
     if (resp) {
+        if (binary)
+            ulfius_add_header_to_response(response, "Content-Type", BINARY_TYPE);
+        add_generation_header(response, generation);
         response->binary_body = resp;
-        response->binary_body_length = strlen(resp);
+        response->binary_body_length = resp_len;
         response->status = 200;
         return U_CALLBACK_COMPLETE;
     } else {
-        return reply_response_status(response, 404, "size/hash count not found");
+        return reply_response_status(response, 404, "size/hash count/scheme not found");
     }
-serv_error:
-    return reply_response_status(response, 500, "Could not acquire rdlock");
 }
 
 int callback_strata(const struct _u_request *request,
                     struct _u_response *response,
                     void *db_) {
     char *resp;
-    int size, hcnt, depth;
+    size_t resp_len;
+    int size, hcnt, depth, version, binary, token;
+    uint64_t generation;
     struct keydb_t *db = db_;
-    int i;
+    struct strata_estimator_t *estimator;
 
     printf("Received strata request.\n");
+    if (key_db_ready(db, NULL, NULL) != 1)
+        return reply_not_ready(response, db);
 
     /* These are required options. */
     if (!u_map_has_key(request->map_url, "size"))
@@ -353,31 +423,119 @@ int callback_strata(const struct _u_request *request,
     else
         depth = atoi(u_map_get(request->map_url, "depth"));
 
+    if (!u_map_has_key(request->map_url, "hash"))
+        version = IBF_HASH_SHA1;
+    else
+        version = atoi(u_map_get(request->map_url, "hash"));
+
+    binary = wants_binary(request);
+
     printf("Parsed strata request successfully:\n");
     printf("\tsize=%d\n", size);
     printf("\thcnt=%d\n", hcnt);
     printf("\tdepth=%d\n", depth);
+    printf("\thash=%d\n", version);
+    printf("\tbinary=%d\n", binary);
 
     resp = NULL;
-    for (i=0; get_strata(db, i); i++) {
-        if(strata_match(get_strata(db, i), hcnt, size, depth)) {
-            if (retry_rdlock(db)) goto serv_error;
-            resp = strata_write(get_strata(db, i));
-            unlock(db);
-            break;
+    token = read_begin(db);
+    estimator = get_strata(db, hcnt, size, depth, version, &generation);
+    if (estimator) {
+        if (binary) {
+            resp = (char *)strata_write_binary(estimator, &resp_len);
+        } else {
+            resp = strata_write(estimator);
+            resp_len = resp ? strlen(resp) : 0;
         }
     }
+    read_end(db, token);
 
     if (resp) {
+        if (binary)
+            ulfius_add_header_to_response(response, "Content-Type", BINARY_TYPE);
+        add_generation_header(response, generation);
         response->binary_body = resp;
-        response->binary_body_length = strlen(resp);
+        response->binary_body_length = resp_len;
         response->status = 200;
         return U_CALLBACK_COMPLETE;
     } else {
-        return reply_response_status(response, 404, "size/hash/depth count not found");
+        return reply_response_status(response, 404, "size/hash/depth count/scheme not found");
+    }
+}
+
+struct riblt_stream_t {
+    struct keydb_t *db;
+    struct riblt_set_t set; /* Keys as of the request, which are coded. */
+    size_t next;
+    size_t limit;
+};
+
+ssize_t
+callback_riblt_stream(void *stream_, uint64_t offset, char *out_buf,
+                      size_t max) {
+    struct riblt_stream_t *stream = stream_;
+    struct riblt_symbol_t symbols[BUF_SIZE/RIBLT_SYMBOL_MAX];
+    size_t w, n, i;
+    int ret;
+
+    w = 0;
+    if (!offset)
+        w += riblt_write_header((uint8_t *)out_buf);
+
+    /* Batches double in size, so small differences stay cheap. */
+    n = (max-w)/RIBLT_SYMBOL_MAX;
+    if (n > BUF_SIZE/RIBLT_SYMBOL_MAX)    n = BUF_SIZE/RIBLT_SYMBOL_MAX;
+    if (n > stream->next+RIBLT_SLACK)     n = stream->next+RIBLT_SLACK;
+    if (n > stream->limit-stream->next)   n = stream->limit-stream->next;
+    if (!n)
+        return w ? w : U_STREAM_END;
+
+    ret = get_riblt_symbols(stream->db, &stream->set, stream->next, n,
+                            symbols);
+    /* The client notices the stream ending before it could decode. */
+    if (ret)
+        return w ? w : U_STREAM_END;
+
+    for (i=0; i<n; i++)
+        w += riblt_write_symbol((uint8_t *)out_buf+w, &symbols[i]);
+    stream->next += n;
+    return w;
+}
+
+int callback_riblt(const struct _u_request *request,
+                   struct _u_response *response,
+                   void *db_) {
+    struct keydb_t *db = db_;
+    struct riblt_stream_t *stream;
+    size_t peer_keys;
+
+    printf("Received rateless sync request.\n");
+    if (key_db_ready(db, NULL, NULL) != 1)
+        return reply_not_ready(response, db);
+
+    /* The client's key count bounds how many symbols it can need. */
+    peer_keys = 0;
+    if (u_map_has_key(request->map_url, "keys"))
+        peer_keys = strtoul(u_map_get(request->map_url, "keys"), NULL, 10);
+
+    if (!(stream=malloc(sizeof(struct riblt_stream_t))))
+        return reply_response_status(response, 500, "malloc");
+    stream->db = db;
+    stream->next = 0;
+
+    get_riblt_set(db, &stream->set);
+    stream->limit = 2*(get_key_count(db)+peer_keys)+RIBLT_SLACK;
+    if (stream->limit > RIBLT_MAX_SYMBOLS)
+        stream->limit = RIBLT_MAX_SYMBOLS;
+
+    ulfius_add_header_to_response(response, "Content-Type", RIBLT_TYPE);
+    if (U_OK != ulfius_set_stream_response(response, 200,
+                &callback_riblt_stream, &free, STREAM_SIZE_UNKNOWN,
+                BUF_SIZE, stream)) {
+        free(stream);
+        return reply_response_status(response, 500, "");
     }
-serv_error:
-    return reply_response_status(response, 500, "Could not acquire rdlock");
+    return U_CALLBACK_COMPLETE;
 }
 
 void free_static_stream(void *fd) {
@@ -423,17 +581,93 @@ int callback_static(const struct _u_request *request,
     return U_CALLBACK_COMPLETE;
 }
 
+/* Splits the n keys of a keyring, held in data, into keys, which point
+ * into it, and parses their metadata. Returns 0 on success. */
+int
+split_keyring(uint8_t *data, size_t len, struct pgp_key_t *keys, int n) {
+    struct dump_t ring;
+    int i;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.data = data;
+    ring.len = len;
+    memset(keys, 0, n*sizeof(struct pgp_key_t));
+    for (i=0; i<n; i++)
+        if (dump_next_key(&ring, &keys[i]) || parse_key_metadata(&keys[i]))
+            return -1;
+    return 0;
+}
+
+/* Returns the number of keys in a keyring, or -1 if it is malformed. */
+int
+count_keyring(uint8_t *data, size_t len) {
+    struct dump_t ring;
+    struct pgp_key_t key;
+    int n, ret;
+
+    memset(&ring, 0, sizeof(ring));
+    ring.data = data;
+    ring.len = len;
+    for (n=0; !(ret = dump_next_key(&ring, &key)); n++);
+    return ret < 0 ? -1 : n;
+}
+
+/* Adds the keys of an uploaded keyring as one batch, replying with a line
+ * per key: its hash, and whether it was added, was already there or
+ * failed. */
+int
+reply_add_keys(struct _u_response *response, struct keydb_t *db,
+               struct pgp_key_t *keys, int n) {
+    char hash_buf[41];
+    char *body;
+    int *results;
+    int i, w, added;
+
+    results = malloc(n*sizeof(int));
+    body = malloc(n*(sizeof(hash_buf)+sizeof("exists\n")));
+    if (!results || !body) {
+        free(results);
+        free(body);
+        return reply_response_status(response, 500, "Out of memory");
+    }
+
+    added = insert_keys(db, keys, n, results);
+    if (added < 0) {
+        free(results);
+        free(body);
+        return reply_response_status(response, 500, "Failed to insert keys");
+    }
+    printf("Added %d of %d uploaded keys.\n", added, n);
+
+    w = 0;
+    body[0] = '\0';
+    for (i=0; i<n; i++) {
+        print_fp160(keys[i].hash, hash_buf);
+        w += sprintf(body+w, "%s %s\n", hash_buf,
+                results[i] == 0 ? "added" :
+                results[i] == 1 ? "exists" : "failed");
+    }
+    ulfius_set_string_body_response(response, 200, body);
+    free(results);
+    free(body);
+    return U_CALLBACK_COMPLETE;
+}
+
 int callback_add_key(const struct _u_request *request,
                      struct _u_response *response,
                      void *db_) {
     struct keydb_t *db = db_;
     struct pgp_key_t key;
     struct pgp_key_t test_key;
+    struct pgp_key_t *keys;
     char creat_buf[1024];
     char hash_buf[41];
     const char *keytext;
+    int n_keys, i, ret;
     
     printf("Received request to add key.\n");
+    if (key_db_ready(db, NULL, NULL) != 1)
+        return reply_not_ready(response, db);
     
     if (!u_map_has_key(request->map_post_body, "keytext"))
         return reply_response_status(response, 400, "Malformed request");
@@ -444,6 +678,26 @@ int callback_add_key(const struct _u_request *request,
     
     if (ascii_parse_key(keytext, &key))
         return reply_response_status(response, 400, "Malformed key");
+
+    /* A keyring of several keys is added as one batch. */
+    n_keys = count_keyring(key.data, key.len);
+    if (n_keys > 1) {
+        keys = malloc(n_keys*sizeof(struct pgp_key_t));
+        if (!keys) {
+            free(key.data);
+            return reply_response_status(response, 500, "Out of memory");
+        }
+        if (split_keyring(key.data, key.len, keys, n_keys))
+            ret = reply_response_status(response, 400, "Malformed key");
+        else
+            ret = reply_add_keys(response, db, keys, n_keys);
+        /* The keys' data is the keyring's. */
+        for (i=0; i<n_keys; i++)
+            free(keys[i].user_id);
+        free(keys);
+        free(key.data);
+        return ret;
+    }
     
     if (parse_key_metadata(&key)) {
         free(key.data);
@@ -460,9 +714,15 @@ int callback_add_key(const struct _u_request *request,
     }
     inner_free_key(&test_key);
 
-    if (insert_key(db, &key, 1)) {
-        inner_free_key(&key);
-        return reply_response_status(response, 500, "Failed to insert key");
+    switch (insert_key(db, &key, 1)) {
+        case 0:
+            break;
+        case 1:
+            inner_free_key(&key);
+            return reply_response_status(response, 403, "Cannot overwrite key.");
+        default:
+            inner_free_key(&key);
+            return reply_response_status(response, 500, "Failed to insert key");
     }
 
     print_fp160(key.hash, hash_buf);
@@ -478,8 +738,10 @@ int callback_status(const struct _u_request *request,
                     void *stat_) {
     struct status_t *stat = stat_;
     char status_buf[BUF_SIZE];
+    double rate;
     int w = 0;
     int i = 0;
+    int ready, nkeys;
 
     w += snprintf(status_buf+w, BUF_SIZE-w,
 "<html> <head> <title>AKS Status Page</title> </head> <body>"
@@ -488,8 +750,19 @@ int callback_status(const struct _u_request *request,
             "<li>Running on port: %d</li>", stat->port);
     w += snprintf(status_buf+w, BUF_SIZE-w,
             "<li>Alarm interval: %d</li>", stat->alarm_int);
+    nkeys = 0;
+    rate = 0;
+    ready = key_db_ready(stat->db, &nkeys, &rate);
     w += snprintf(status_buf+w, BUF_SIZE-w,
-            "<li>Key count: %d</li>", stat->nkeys);
+            "<li>Key count: %d</li>", nkeys);
+    if (ready == 1)
+        w += snprintf(status_buf+w, BUF_SIZE-w, "<li>Index: ready</li>");
+    else if (ready == 0)
+        w += snprintf(status_buf+w, BUF_SIZE-w,
+                "<li>Index: building, %d keys so far (%.0f keys/s)</li>",
+                nkeys, rate);
+    else
+        w += snprintf(status_buf+w, BUF_SIZE-w, "<li>Index: failed</li>");
     w += snprintf(status_buf+w, BUF_SIZE-w, "</ul>");
     w += snprintf(status_buf+w, BUF_SIZE-w, "<h1> Keyserver Peers: </h1><ul>"); 
 
@@ -511,8 +784,10 @@ int callback_status(const struct _u_request *request,
 
 }
 
+/* Downloads url into a NUL-terminated buffer, storing the body length in
+ * len if it is not NULL. Returns NULL on failure. */
 char *
-download_url(char *url) {
+download_url(char *url, size_t *len) {
     struct _u_request  req;
     struct _u_response resp;
     char *ret;
@@ -539,6 +814,8 @@ download_url(char *url) {
 
     memcpy(ret, resp.binary_body, resp.binary_body_length);
     ret[resp.binary_body_length] = 0;
+    if (len)
+        *len = resp.binary_body_length;
 
 /*success:*/
     ulfius_clean_request(&req);
@@ -553,7 +830,7 @@ error_req:
 }
 
 struct pgp_key_t *
-download_key(char *srv, fp160 hash) {
+download_key(char *srv, const fp160 hash) {
     struct pgp_key_t *ret = NULL;
     char *string = NULL;
     char hash_buf[41];
@@ -567,7 +844,7 @@ download_key(char *srv, fp160 hash) {
     snprintf(url_buf, 1024, "%s/pks/lookup?op=download&search=%s", 
             srv, hash_buf);
 
-    string = download_url(url_buf);
+    string = download_url(url_buf, NULL);
 
     if (ascii_parse_key(string, ret))
         goto error;
@@ -582,23 +859,32 @@ error:
 }
 
 struct strata_estimator_t *
-download_strata(char *host, int k, int N, int c) {
+download_strata(char *host, int k, int N, int c, int v) {
     char *string = NULL;
+    size_t len;
     struct strata_estimator_t *estimator = NULL;
 
     char full_url[1024];
-    snprintf(full_url, 1024, "%s/strata/%d/%d/%d", host, c, k, N);
+    snprintf(full_url, 1024, "%s/strata/%d/%d/%d?hash=%d&fmt=bin", host, c, k, N, v);
 
-    printf("Attempting to download the strata estimator (c=%d, k=%d, N=%d) @ %s\n", c, k, N, host);
+    printf("Attempting to download the strata estimator (c=%d, k=%d, N=%d, v=%d) @ %s\n", c, k, N, v, host);
 
-    string = download_url(full_url);
+    string = download_url(full_url, &len);
     if (!string) return NULL;
-    printf("Strata is %ld bytes.\n", strlen(string));
+    printf("Strata is %ld bytes.\n", len);
 
-    estimator = strata_from_string(string);
+    /* Peers that predate the binary encoding answer in ASCII. */
+    if (len > 8 && !memcmp(string, "STRATAB:", 8))
+        estimator = strata_from_binary((uint8_t *)string, len);
+    else
+        estimator = strata_from_string(string);
     if (!estimator) goto error_string;
 
-    if (!strata_match(estimator, k, N, c)) goto error_est;
+    /* Peers that predate versioning ignore the requested scheme. */
+    if (!strata_match(estimator, k, N, c, v)) {
+        printf("Peer strata estimator does not use hashing scheme %d.\n", v);
+        goto error_est;
+    }
 
 /*success:*/
     free(string);
@@ -612,23 +898,30 @@ error_string:
 }
 
 struct inv_bloom_t *
-download_inv_bloom(char *host, int k, int N) {
+download_inv_bloom(char *host, int k, int N, int v) {
     char *string = NULL;
+    size_t len;
     struct inv_bloom_t *filt = NULL;
 
     char full_url[1024];
-    snprintf(full_url, 1024, "%s/ibf/%d/%d", host, k, N);
+    snprintf(full_url, 1024, "%s/ibf/%d/%d?hash=%d&fmt=bin", host, k, N, v);
 
-    printf("Attempting to download the ibf (k=%d, N=%d) @ %s\n", k, N, host);
+    printf("Attempting to download the ibf (k=%d, N=%d, v=%d) @ %s\n", k, N, v, host);
 
-    string = download_url(full_url);
+    string = download_url(full_url, &len);
     if (!string) return NULL;
-    printf("IBF is %ld bytes.\n", strlen(string));
+    printf("IBF is %ld bytes.\n", len);
 
-    filt = ibf_from_string(string);
+    if (len > 4 && !memcmp(string, "IBFB", 4))
+        filt = ibf_from_binary((uint8_t *)string, len, NULL);
+    else
+        filt = ibf_from_string(string);
     if (!filt) goto error_string;
 
-    if (!ibf_match(filt, k, N)) goto error_filt;
+    if (!ibf_match(filt, k, N, v)) {
+        printf("Peer ibf does not use hashing scheme %d.\n", v);
+        goto error_filt;
+    }
 
 /*success:*/
     free(string);
@@ -641,6 +934,146 @@ error_string:
     return NULL;
 }
 
+struct riblt_sync_t {
+    struct keydb_t *db;
+    struct riblt_decoder_t *decoder;
+    struct riblt_set_t set;
+    uint8_t *buf;  /* Received bytes not yet decoded. */
+    size_t len;
+    size_t bytes;
+    int header;    /* 1 once the stream header is checked, -1 if it's bad. */
+    int status;    /* 1 once decoded, -1 on error. */
+};
+
+/* Decodes the symbols in sync's buffer, less our own symbols with the same
+ * indices. Returns 0 to keep reading. */
+int
+riblt_sync_decode(struct riblt_sync_t *sync) {
+    struct riblt_symbol_t *remote, *local;
+    const uint8_t *p, *end;
+    size_t n, i, start;
+    int ret;
+
+    p = sync->buf;
+    end = sync->buf+sync->len;
+    if (!sync->header) {
+        if (sync->len < RIBLT_HEADER_LEN)
+            return 0;
+        if (riblt_check_header(p)) {
+            sync->header = -1;
+            return 0;
+        }
+        p += RIBLT_HEADER_LEN;
+        sync->header = 1;
+    }
+
+    n = (end-p)/RIBLT_SYMBOL_MIN + 1;
+    remote = malloc(n*sizeof(struct riblt_symbol_t));
+    local = malloc(n*sizeof(struct riblt_symbol_t));
+    ret = -1;
+    if (!remote || !local) goto out;
+
+    for (n=0; !(ret=riblt_read_symbol(&p, end, &remote[n])); n++);
+    if (ret < 0) goto out;
+
+    start = riblt_decoder_count(sync->decoder);
+    ret = get_riblt_symbols(sync->db, &sync->set, start, n, local);
+    if (ret) goto out;
+
+    for (i=0; i<n; i++) {
+        ret = riblt_decoder_add(sync->decoder, &remote[i], &local[i]);
+        if (ret)
+            break;
+    }
+
+    sync->len = end-p;
+    memmove(sync->buf, p, sync->len);
+out:
+    free(remote);
+    free(local);
+    return ret;
+}
+
+size_t
+riblt_sync_write(void *data, size_t size, size_t nmemb, void *sync_) {
+    struct riblt_sync_t *sync = sync_;
+    uint8_t *tmp;
+
+    size *= nmemb;
+    sync->bytes += size;
+    /* Other replies, as from peers without /riblt, are read to the end,
+     * so that their status is known, unless they are long. */
+    if (sync->header < 0)
+        return sync->bytes > BUF_SIZE ? 0 : size;
+    tmp = realloc(sync->buf, sync->len+size);
+    if (!tmp) {
+        sync->status = -1;
+        return 0;
+    }
+    sync->buf = tmp;
+    memcpy(sync->buf+sync->len, data, size);
+    sync->len += size;
+
+    /* Returning short makes the transfer stop, once decoded or not. */
+    sync->status = riblt_sync_decode(sync);
+    if (sync->header < 0) {
+        free(sync->buf);
+        sync->buf = NULL;
+        sync->len = 0;
+    }
+    return sync->status ? 0 : size;
+}
+
+struct riblt_decoder_t *
+download_riblt(char *host, struct keydb_t *db, int *missing) {
+    struct _u_request  req;
+    struct _u_response resp;
+    struct riblt_sync_t sync;
+    char full_url[1024];
+
+    *missing = 0;
+    memset(&sync, 0, sizeof(sync));
+    sync.db = db;
+    if (!(sync.decoder=riblt_decoder_allocate()))
+        return NULL;
+
+    get_riblt_set(db, &sync.set);
+    snprintf(full_url, 1024, "%s/riblt?keys=%d", host, get_key_count(db));
+
+    printf("Attempting to stream rateless symbols @ %s\n", host);
+
+    if (ulfius_init_request(&req) != U_OK) goto error;
+    if (ulfius_init_response(&resp) != U_OK) {
+        ulfius_clean_request(&req);
+        goto error;
+    }
+    req.http_protocol = strdup("1.0");
+    req.http_verb = strdup("GET");
+    req.http_url = strdup(full_url);
+    /* Stopping the transfer early is reported as an error, so only the
+     * decoder's verdict counts. The status is only set if it isn't. */
+    resp.status = 0;
+    ulfius_send_http_streaming_request(&req, &resp, &riblt_sync_write, &sync);
+    *missing = resp.status == 404;
+    ulfius_clean_request(&req);
+    ulfius_clean_response(&resp);
+
+    printf("Streamed %lu symbols in %lu bytes.\n",
+            riblt_decoder_count(sync.decoder), sync.bytes);
+    if (sync.status != 1) {
+        printf("Rateless symbols did not decode.\n");
+        goto error;
+    }
+
+    free(sync.buf);
+    return sync.decoder;
+
+error:
+    free(sync.buf);
+    riblt_decoder_free(sync.decoder);
+    return NULL;
+}
+
 struct serv_state_t *
 start_server(short port, char *root, struct keydb_t *db, struct status_t *stat) {
     struct serv_state_t *serv;
@@ -669,6 +1102,9 @@ start_server(short port, char *root, struct keydb_t *db, struct status_t *stat)
     /* Add the bloom filter endpoint. */
     ulfius_add_endpoint_by_val(&serv->inst, "GET", NULL, 
             "/ibf/:hcnt/:size", 0, &callback_bloom, db);
+    /* Add the rateless reconciliation endpoint. */
+    ulfius_add_endpoint_by_val(&serv->inst, "GET", NULL,
+            "/riblt", 0, &callback_riblt, db);
     /* Add the system status endpoint. */
     ulfius_add_endpoint_by_val(&serv->inst, "GET", NULL, 
             "/status", 0, &callback_status, stat);
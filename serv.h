@@ -5,17 +5,25 @@
 #include "setdiff.h"
 #include "keydb.h"
 #include "ibf.h"
+#include "riblt.h"
 
 struct serv_state_t;
 
 struct pgp_key_t *
-download_key(char *srv, fp160 hash);
+download_key(char *srv, const fp160 hash);
 
 struct inv_bloom_t *
-download_inv_bloom(char *host, int k, int N);
+download_inv_bloom(char *host, int k, int N, int v);
 
 struct strata_estimator_t *
-download_strata(char *host, int k, int N, int c);
+download_strata(char *host, int k, int N, int c, int v);
+
+/* Streams rateless coded symbols from host until the difference from db
+ * decodes. Returns the decoder holding the result, or NULL if the peer
+ * can't serve symbols or they didn't decode. Sets *missing if the peer
+ * has no /riblt at all. */
+struct riblt_decoder_t *
+download_riblt(char *host, struct keydb_t *db, int *missing);
 
 struct serv_state_t *
 start_server(short port, char *root, struct keydb_t *db, struct status_t *stat);
@@ -1,18 +1,34 @@
 #include "setdiff.h"
 #include "ibf.h"
 #include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/* The binary encoding keeps a text header so it is easy to recognize. */
+#define STRATA_BIN_MAGIC "STRATAB:"
+
+/* Limit on the depth of estimators accepted from the network. */
+#define STRATA_MAX_DEPTH 64
+
+/* Strata are decoded concurrently by at most this many threads, including
+ * the caller, and never by more threads than there are online CPUs. */
+#define STRATA_DECODE_THREADS 4
+/* Estimators with fewer buckets in all are decoded on the calling thread. */
+#define STRATA_INLINE_BUCKETS 4096
 
 struct strata_estimator_t {
     int    c;
     int    k;
     size_t N;
+    int    version;
     struct inv_bloom_t **blooms;
 };
 
 struct strata_estimator_t *
 strata_allocate(int    k /* Number of hashes per element */,
                 size_t N /* Number of buckets */,
-                int    c /* Number strata. */) {
+                int    c /* Number strata. */,
+                int    v /* Hashing scheme, one of IBF_HASH_* */) {
     int i;
     struct strata_estimator_t *estimator;
 
@@ -21,12 +37,13 @@ strata_allocate(int    k /* Number of hashes per element */,
     estimator->c = c;
     estimator->k = k;
     estimator->N = N;
+    estimator->version = v;
 
     estimator->blooms = malloc(c*sizeof(struct inv_bloom_t *));
     if (!estimator->blooms) goto error;
 
     for (i=0; i<c; i++)
-        estimator->blooms[i] = ibf_allocate(k, N);
+        estimator->blooms[i] = ibf_allocate(k, N, v);
 
     return estimator;
 
@@ -36,10 +53,12 @@ error:
 }
 
 int
-strata_match(struct strata_estimator_t *estimator, int k, size_t N, int c) {
+strata_match(struct strata_estimator_t *estimator, int k, size_t N, int c,
+             int v) {
     return estimator->k == k
         && estimator->N == N
-        && estimator->c == c;
+        && estimator->c == c
+        && estimator->version == v;
 }
 
 void
@@ -86,55 +105,181 @@ strata_insert(struct strata_estimator_t *estimator, fp160 val) {
     ibf_insert(estimator->blooms[tzcount], val);
 }
 
+int
+strata_fold_into(struct strata_estimator_t *dst,
+                 const struct strata_estimator_t *src) {
+    int i;
+
+    if (dst->c > src->c)             return -1;
+    if (dst->k != src->k)            return -1;
+    if (dst->N != src->N)            return -1;
+    if (dst->version != src->version) return -1;
+
+    /* Levels shallower than the last are shared; the last level of dst
+     * collects every element with at least c-1 trailing zeros. */
+    for (i=0; i<dst->c; i++)
+        if (ibf_fold_into(dst->blooms[i], src->blooms[i]))
+            return -1;
+    for (i=dst->c; i<src->c; i++)
+        if (ibf_add(dst->blooms[dst->c-1], src->blooms[i]))
+            return -1;
+    return 0;
+}
+
+int
+strata_add(struct strata_estimator_t *A,
+     const struct strata_estimator_t *B) {
+    int i;
+
+    if (A->c != B->c || A->k != B->k || A->N != B->N
+            || A->version != B->version)
+        return -1;
+    for (i=0; i<A->c; i++)
+        if (ibf_add(A->blooms[i], B->blooms[i]))
+            return -1;
+    return 0;
+}
+
+/* Shared state of one estimate. Workers claim strata from the deepest level
+ * down, since a failure there makes every shallower level irrelevant. */
+struct strata_job_t {
+    const struct strata_estimator_t *A;
+    const struct strata_estimator_t *B;
+    pthread_mutex_t lock;
+    int next;       /* Next level to claim, -1 when none are left.  */
+    int failed;     /* Deepest level that failed to decode, or -1.  */
+    int error;
+    size_t *decoded;
+};
+
+/* Subtracts one level into scratch, a filter of the same shape, and decodes
+ * it. Returns the number of elements decoded, -1 if the level could not be
+ * decoded completely, or -2 on error. */
+int64_t
+strata_decode_level(struct inv_bloom_t *scratch,
+                    const struct inv_bloom_t *bloom_A,
+                    const struct inv_bloom_t *bloom_B) {
+    fp160 *pos, *neg;
+    size_t n_pos, n_neg;
+    int ret;
+
+    if (ibf_fold_into(scratch, bloom_B)) return -2;
+    if (ibf_subtract(scratch, bloom_A))  return -2;
+
+    ret = ibf_decode_all(scratch, &pos, &n_pos, &neg, &n_neg);
+    if (ret < 0) return -2;
+    free(pos);
+    free(neg);
+
+    /* Not empty. */
+    if (ret) return -1;
+    return n_pos + n_neg;
+}
+
+void *
+strata_decode_worker(void *arg) {
+    struct strata_job_t *job;
+    struct inv_bloom_t *scratch;
+    int i;
+    int64_t n;
+
+    job = arg;
+    scratch = ibf_allocate(job->B->k, job->B->N, job->B->version);
+    for (;;) {
+        pthread_mutex_lock(&job->lock);
+        if (!scratch)
+            job->error = 1;
+        i = job->next;
+        if (i < job->failed || job->error)
+            i = -1;
+        if (i >= 0)
+            job->next--;
+        pthread_mutex_unlock(&job->lock);
+        if (i < 0)
+            break;
+
+        n = strata_decode_level(scratch, job->A->blooms[i], job->B->blooms[i]);
+
+        pthread_mutex_lock(&job->lock);
+        if (n == -2)
+            job->error = 1;
+        else if (n == -1 && i > job->failed)
+            job->failed = i;
+        else if (n >= 0)
+            job->decoded[i] = n;
+        pthread_mutex_unlock(&job->lock);
+    }
+    ibf_free(scratch);
+    return NULL;
+}
+
+/* Querying the CPU count reads sysfs, so it is done only once. */
+pthread_once_t strata_threads_once = PTHREAD_ONCE_INIT;
+int strata_threads;
+
+void
+strata_threads_init() {
+    long n;
+
+    n = sysconf(_SC_NPROCESSORS_ONLN);
+    if (n < 1)                     n = 1;
+    if (n > STRATA_DECODE_THREADS) n = STRATA_DECODE_THREADS;
+    strata_threads = n;
+}
+
 uint64_t
 strata_estimate_diff(const struct strata_estimator_t *estimator_A,
-                           struct strata_estimator_t *estimator_B) {
-    int i;
-    int total_decoded, local_decoded;
-    fp160 dummy;
+                     const struct strata_estimator_t *estimator_B) {
+    int i, n_threads, started;
+    pthread_t threads[STRATA_DECODE_THREADS];
+    struct strata_job_t job;
+    int64_t total_decoded;
 
     if (estimator_A->c != estimator_B->c) return -1;
     if (estimator_A->k != estimator_B->k) return -1;
     if (estimator_A->N != estimator_B->N) return -1;
+    if (estimator_A->version != estimator_B->version) return -1;
+
+    job.A = estimator_A;
+    job.B = estimator_B;
+    job.next = estimator_A->c-1;
+    job.failed = -1;
+    job.error = 0;
+    job.decoded = calloc(estimator_A->c, sizeof(size_t));
+    if (!job.decoded) return -1;
+    if (pthread_mutex_init(&job.lock, NULL)) {
+        free(job.decoded);
+        return -1;
+    }
 
-    total_decoded = 0;
-
-    for (i=estimator_A->c-1; i>=0; i--) {
-        /*printf("Trying to decode stratum %d.\n", i);
-        if (ibf_count(estimator_B->blooms[i])) {
-            printf("Local filter: %s\n", ibf_write(estimator_A->blooms[i]));
-            printf("Remote filter: %s\n", ibf_write(estimator_B->blooms[i]));
-        }*/
-        if(ibf_subtract(estimator_B->blooms[i], estimator_A->blooms[i]))
-            return -1;
-
-        /*printf("Subtracted filter for stratum %d contains %ld elements.\n", 
-                i, ibf_count(estimator_B->blooms[i]));
-        if (ibf_count(estimator_B->blooms[i])) {
-            printf("Trying to decode filter: %s\n", ibf_write(estimator_B->blooms[i]));
-        }*/
-       
-        local_decoded = 0; 
-        while (ibf_decode(estimator_B->blooms[i], dummy))
-            local_decoded++;
-
-        /*if (ibf_count(estimator_B->blooms[i])) {
-            printf("Decoded %d entries.\n", local_decoded);
-        }*/
-
-        /* Not empty. */
-        if (ibf_count(estimator_B->blooms[i])) {
-            /*printf("Found undecodeable IBF remainder at level %d:%s\n", i, 
-                    ibf_write(estimator_B->blooms[i]));
-            printf("Previously decoded: %d\nScaling factor: %d\n",
-                    total_decoded, 1<<(i+1));*/
-            total_decoded *= 1<<(i+1);
-            if (total_decoded == 0)
-                total_decoded = -1;
+    /* Starting threads costs more than decoding the small estimators
+     * peers exchange, so only large ones are spread over threads. */
+    pthread_once(&strata_threads_once, strata_threads_init);
+    n_threads = strata_threads;
+    if (n_threads > estimator_A->c)        n_threads = estimator_A->c;
+    if (estimator_A->c*estimator_A->N < STRATA_INLINE_BUCKETS) n_threads = 1;
+    for (started=0; started<n_threads-1; started++)
+        if (pthread_create(&threads[started], NULL, strata_decode_worker,
+                    &job))
             break;
-        } else {
-            total_decoded += local_decoded;
-        }
+    /* The calling thread takes part, so the estimate completes even if no
+     * helper could be started. */
+    strata_decode_worker(&job);
+    for (i=0; i<started; i++)
+        pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&job.lock);
+
+    total_decoded = 0;
+    for (i=estimator_A->c-1; i>job.failed; i--)
+        total_decoded += job.decoded[i];
+    free(job.decoded);
+
+    if (job.error)
+        return -1;
+    if (job.failed >= 0) {
+        total_decoded *= (int64_t)1<<(job.failed+1);
+        if (total_decoded == 0)
+            total_decoded = -1;
     }
     return total_decoded;
 }
@@ -196,7 +341,11 @@ strata_from_string(char *string) {
         ibf = strstr(ibf+1, "IBF:");
         estimator->blooms[i] = ibf_from_string(ibf);
         if (!estimator->blooms[i]) goto free_blooms;
-        if (!ibf_match(estimator->blooms[i], k, N)) goto free_blooms;
+        /* Every level must use the scheme advertised by the first. */
+        if (i == 0)
+            estimator->version = ibf_version(estimator->blooms[0]);
+        if (!ibf_match(estimator->blooms[i], k, N, estimator->version))
+            goto free_blooms;
     }
 
     return estimator;
@@ -211,3 +360,89 @@ error:
     return NULL;
 }
 
+uint8_t *
+strata_write_binary(const struct strata_estimator_t *estimator, size_t *len) {
+    uint8_t **ibf_bufs;
+    size_t *ibf_lens;
+    uint8_t *buf;
+    size_t total, w;
+    int i;
+
+    buf = NULL;
+    ibf_bufs = calloc(estimator->c, sizeof(uint8_t *));
+    ibf_lens = calloc(estimator->c, sizeof(size_t));
+    if (!ibf_bufs || !ibf_lens) goto error;
+
+    total = 64;
+    for (i=0; i<estimator->c; i++) {
+        ibf_bufs[i] = ibf_write_binary(estimator->blooms[i], &ibf_lens[i]);
+        if (!ibf_bufs[i]) goto error;
+        total += ibf_lens[i];
+    }
+
+    buf = malloc(total);
+    if (!buf) goto error;
+
+    /* Each level is a self-describing binary ibf. */
+    w = sprintf((char *)buf, STRATA_BIN_MAGIC "%d:%d:%lu\n",
+            estimator->c, estimator->k, estimator->N);
+    for (i=0; i<estimator->c; i++) {
+        memcpy(buf+w, ibf_bufs[i], ibf_lens[i]);
+        w += ibf_lens[i];
+    }
+    *len = w;
+
+error:
+    if (ibf_bufs)
+        for (i=0; i<estimator->c; i++)
+            free(ibf_bufs[i]);
+    free(ibf_bufs);
+    free(ibf_lens);
+    return buf;
+}
+
+struct strata_estimator_t *
+strata_from_binary(const uint8_t *buf, size_t len) {
+    int c, k, N, i, hdr_len;
+    size_t used;
+    struct strata_estimator_t *estimator = NULL;
+
+    /* The header is text, so make sure sscanf stays inside the buffer. */
+    if (!memchr(buf, '\n', len < 64 ? len : 64))
+        goto error;
+    if (3 != sscanf((const char *)buf, STRATA_BIN_MAGIC "%d:%d:%d\n%n",
+                &c, &k, &N, &hdr_len))
+        goto error;
+    if (c < 1 || c > STRATA_MAX_DEPTH)
+        goto error;
+
+    estimator = malloc(sizeof(*estimator));
+    if (!estimator) goto error;
+
+    estimator->blooms = calloc(c, sizeof(struct inv_bloom_t *));
+    if (!estimator->blooms) goto error_est;
+
+    estimator->c = c;
+    estimator->k = k;
+    estimator->N = N;
+
+    buf += hdr_len;
+    len -= hdr_len;
+    for (i=0; i<c; i++) {
+        estimator->blooms[i] = ibf_from_binary(buf, len, &used);
+        if (!estimator->blooms[i]) goto error_est;
+        buf += used;
+        len -= used;
+        if (i == 0)
+            estimator->version = ibf_version(estimator->blooms[0]);
+        if (!ibf_match(estimator->blooms[i], k, N, estimator->version))
+            goto error_est;
+    }
+
+    return estimator;
+
+error_est:
+    strata_free(estimator);
+error:
+    return NULL;
+}
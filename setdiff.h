@@ -8,10 +8,12 @@
 struct strata_estimator_t *
 strata_allocate(int    k /* Number of hashes per element */,
                 size_t N /* Number of buckets */,
-                int    c /* Number strata. */);
+                int    c /* Number strata. */,
+                int    v /* Hashing scheme, one of IBF_HASH_* */);
 
 int
-strata_match(struct strata_estimator_t *estimator, int k, size_t N, int c);
+strata_match(struct strata_estimator_t *estimator, int k, size_t N, int c,
+             int v);
 
 void
 strata_free(struct strata_estimator_t *estimator);
@@ -22,10 +24,28 @@ strata_insert(struct strata_estimator_t *estimator, fp160 val);
 void
 strata_counts(struct strata_estimator_t *estimator);
 
-/* Overwrites estimator_B completely. */
+/* Overwrites dst, which must be no deeper than src, with the estimator of
+ * dst's depth that src's elements would have produced. Returns 0 on
+ * success, non-zero on error. */
+int
+strata_fold_into(struct strata_estimator_t *dst,
+                 const struct strata_estimator_t *src);
+
+/* Adds B, which must have the same parameters, to A in place, giving the
+ * estimator of the union of two disjoint sets. Returns 0 on success,
+ * non-zero on error. */
+int
+strata_add(struct strata_estimator_t *A,
+     const struct strata_estimator_t *B);
+
+/* Estimates the size of the difference between the sets behind the two
+ * estimators, leaving both untouched. Strata are subtracted into scratch
+ * space and decoded in parallel, deepest first; nothing below the deepest
+ * stratum that fails to decode is examined. Returns -1 on error or when the
+ * estimators are too small to give a useful result. */
 uint64_t
 strata_estimate_diff(const struct strata_estimator_t *estimator_A,
-                           struct strata_estimator_t *estimator_B);
+                     const struct strata_estimator_t *estimator_B);
 
 char *
 strata_write(const struct strata_estimator_t *estimator);
@@ -33,4 +53,14 @@ strata_write(const struct strata_estimator_t *estimator);
 struct strata_estimator_t *
 strata_from_string(char *string);
 
+/* Writes out estimator in the compact binary encoding, storing its length
+ * in len. Returns NULL on failure. */
+uint8_t *
+strata_write_binary(const struct strata_estimator_t *estimator, size_t *len);
+
+/* Allocates and parses a binary-encoded estimator. Returns NULL on
+ * failure. */
+struct strata_estimator_t *
+strata_from_binary(const uint8_t *buf, size_t len);
+
 #endif
@@ -0,0 +1,264 @@
+#include "trigram.h"
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <ctype.h>
+
+#define TRIGRAM_MIN_SLOTS 4096
+
+/* Positions of the strings holding one trigram. No string has a NUL, so a
+ * trigram of 0 marks an empty slot. Readers may walk a list while it is
+ * appended to: pos is only ever replaced by a larger copy, and n is stored
+ * after the position it counts. */
+struct trigram_list_t {
+    uint32_t trigram;
+    int n;
+    int alloc;
+    int *pos;
+};
+
+/* Open-addressing table of posting lists, probed linearly. */
+struct trigram_table_t {
+    struct trigram_list_t *slots;
+    size_t mask;
+};
+
+/* The table is replaced, not resized, when it grows, and what it and the
+ * lists replace is handed to retire. */
+struct trigram_idx_t {
+    struct trigram_table_t *table;
+    size_t count;
+    void (*retire)(void *arg, void *ptr);
+    void *arg;
+};
+
+/* Packs the three case-folded bytes starting at s. */
+uint32_t
+trigram_code(const char *s) {
+    return (uint32_t)tolower((unsigned char)s[0])<<16
+         | (uint32_t)tolower((unsigned char)s[1])<<8
+         | (uint32_t)tolower((unsigned char)s[2]);
+}
+
+struct trigram_list_t *
+trigram_slot(const struct trigram_table_t *table, uint32_t trigram) {
+    uint32_t found;
+    size_t slot;
+
+    slot = (trigram*0x9E3779B1u) & table->mask;
+    while ((found = __atomic_load_n(&table->slots[slot].trigram,
+                                    __ATOMIC_ACQUIRE)) && found != trigram)
+        slot = (slot+1) & table->mask;
+    return &table->slots[slot];
+}
+
+/* Hands ptr, which readers may still be using, to the retire callback. */
+void
+trigram_retire(struct trigram_idx_t *idx, void *ptr) {
+    if (idx->retire)
+        idx->retire(idx->arg, ptr);
+    else
+        free(ptr);
+}
+
+/* Publishes a table of twice the size. Returns 0 on success. */
+int
+trigram_grow(struct trigram_idx_t *idx) {
+    struct trigram_table_t *old, *grown;
+    size_t i;
+
+    old = idx->table;
+    grown = malloc(sizeof(struct trigram_table_t));
+    if (!grown) return -1;
+    grown->mask = 2*(old->mask+1)-1;
+    grown->slots = calloc(grown->mask+1, sizeof(struct trigram_list_t));
+    if (!grown->slots) {
+        free(grown);
+        return -1;
+    }
+    for (i=0; i<=old->mask; i++)
+        if (old->slots[i].trigram)
+            *trigram_slot(grown, old->slots[i].trigram) = old->slots[i];
+    __atomic_store_n(&idx->table, grown, __ATOMIC_RELEASE);
+    trigram_retire(idx, old->slots);
+    trigram_retire(idx, old);
+    return 0;
+}
+
+struct trigram_idx_t *
+trigram_allocate(void (*retire)(void *arg, void *ptr), void *arg) {
+    struct trigram_idx_t *idx;
+
+    idx = malloc(sizeof(struct trigram_idx_t));
+    if (!idx) return NULL;
+    idx->count = 0;
+    idx->retire = retire;
+    idx->arg = arg;
+    idx->table = malloc(sizeof(struct trigram_table_t));
+    if (!idx->table) {
+        free(idx);
+        return NULL;
+    }
+    idx->table->mask = TRIGRAM_MIN_SLOTS-1;
+    idx->table->slots = calloc(TRIGRAM_MIN_SLOTS,
+                               sizeof(struct trigram_list_t));
+    if (!idx->table->slots) {
+        free(idx->table);
+        free(idx);
+        return NULL;
+    }
+    return idx;
+}
+
+int
+trigram_add(struct trigram_idx_t *idx, int pos, const char *string) {
+    struct trigram_list_t *list;
+    uint32_t trigram;
+    size_t i, len;
+    int *tmp, *old;
+    int alloc;
+
+    len = strlen(string);
+    for (i=0; i+3<=len; i++) {
+        if (2*(idx->count+1) > idx->table->mask+1 && trigram_grow(idx))
+            return -1;
+
+        trigram = trigram_code(string+i);
+        list = trigram_slot(idx->table, trigram);
+        if (!list->trigram) {
+            __atomic_store_n(&list->trigram, trigram, __ATOMIC_RELEASE);
+            idx->count++;
+        }
+        /* A trigram repeated within one string is listed once. */
+        if (list->n && list->pos[list->n-1] == pos)
+            continue;
+        /* Readers may be walking the old positions, so they are copied
+         * rather than reallocated. */
+        if (list->n >= list->alloc) {
+            alloc = list->alloc ? 2*list->alloc : 4;
+            tmp = malloc(alloc*sizeof(int));
+            if (!tmp) return -1;
+            if (list->n)
+                memcpy(tmp, list->pos, list->n*sizeof(int));
+            old = list->pos;
+            __atomic_store_n(&list->pos, tmp, __ATOMIC_RELEASE);
+            list->alloc = alloc;
+            if (old)
+                trigram_retire(idx, old);
+        }
+        list->pos[list->n] = pos;
+        __atomic_store_n(&list->n, list->n+1, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+/* Returns the first index from *at on at which list holds pos or more,
+ * galloping so that a walk over sorted positions costs about as much as
+ * the shorter of a merge and a binary search per position. */
+int
+trigram_list_seek(const struct trigram_list_t *list, int at, int pos) {
+    int lo, hi, step, mid;
+
+    lo = at;
+    step = 1;
+    while (at < list->n && list->pos[at] < pos) {
+        lo = at+1;
+        at += step;
+        step *= 2;
+    }
+    hi = at < list->n ? at : list->n;
+    while (lo < hi) {
+        mid = lo + (hi-lo)/2;
+        if (list->pos[mid] < pos)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+int
+trigram_candidates(const struct trigram_idx_t *idx, const char *query,
+                   int **found, size_t *n) {
+    const struct trigram_table_t *table;
+    const struct trigram_list_t *list;
+    struct trigram_list_t *lists, tmp;
+    uint32_t trigram;
+    size_t len, n_lists, i, j, k;
+    int ret, at;
+
+    *found = NULL;
+    *n = 0;
+    len = strlen(query);
+    if (len < 3)
+        return 1;
+
+    lists = malloc((len-2)*sizeof(*lists));
+    if (!lists) return -1;
+
+    /* A trigram that no string has rules out every position. Each list
+     * is copied as it stands now: its count first, then positions holding
+     * at least that many. */
+    n_lists = 0;
+    table = __atomic_load_n(&idx->table, __ATOMIC_ACQUIRE);
+    for (i=0; i+3<=len; i++) {
+        trigram = trigram_code(query+i);
+        list = trigram_slot(table, trigram);
+        lists[n_lists].trigram = trigram;
+        if (__atomic_load_n(&list->trigram, __ATOMIC_ACQUIRE) == trigram)
+            lists[n_lists].n = __atomic_load_n(&list->n, __ATOMIC_ACQUIRE);
+        else
+            lists[n_lists].n = 0;
+        if (!lists[n_lists].n) {
+            free(lists);
+            return 0;
+        }
+        lists[n_lists].pos = __atomic_load_n(&list->pos, __ATOMIC_ACQUIRE);
+        n_lists++;
+    }
+
+    /* Start from the shortest list, so the candidates only ever shrink. */
+    for (i=1; i<n_lists; i++)
+        if (lists[i].n < lists[0].n) {
+            tmp = lists[0];
+            lists[0] = lists[i];
+            lists[i] = tmp;
+        }
+
+    ret = -1;
+    *found = malloc((lists[0].n ? lists[0].n : 1)*sizeof(int));
+    if (!*found) goto out;
+    memcpy(*found, lists[0].pos, lists[0].n*sizeof(int));
+    *n = lists[0].n;
+
+    for (i=1; i<n_lists && *n; i++) {
+        if (lists[i].trigram == lists[0].trigram)
+            continue;
+        at = 0;
+        for (j=k=0; j<*n; j++) {
+            at = trigram_list_seek(&lists[i], at, (*found)[j]);
+            if (at >= lists[i].n)
+                break;
+            if (lists[i].pos[at] == (*found)[j])
+                (*found)[k++] = (*found)[j];
+        }
+        *n = k;
+    }
+    ret = 0;
+out:
+    free(lists);
+    return ret;
+}
+
+void
+trigram_free(struct trigram_idx_t *idx) {
+    size_t i;
+
+    if (!idx)
+        return;
+    for (i=0; i<=idx->table->mask; i++)
+        free(idx->table->slots[i].pos);
+    free(idx->table->slots);
+    free(idx->table);
+    free(idx);
+}
@@ -0,0 +1,36 @@
+#ifndef TRIGRAM_H_
+#define TRIGRAM_H_
+
+#include <stddef.h>
+
+/* Posting lists of the positions whose strings contain each trigram, with
+ * case folded as strcasestr folds it. Any string containing a query, with
+ * or without regard to case, holds every trigram of the folded query, so
+ * intersecting their lists gives a superset of the matches to check. */
+struct trigram_idx_t;
+
+/* Allocates an empty index. Lookups may run alongside trigram_add, as
+ * long as what it replaces outlives them: it hands the table and position
+ * lists it outgrows to retire, with arg, to be freed once no lookup can be
+ * using them, or frees them at once if retire is NULL. Returns NULL on
+ * failure. */
+struct trigram_idx_t *
+trigram_allocate(void (*retire)(void *arg, void *ptr), void *arg);
+
+/* Adds string as position pos, which must be greater than any added so
+ * far. Only one thread may add at a time. Returns 0 on success. */
+int
+trigram_add(struct trigram_idx_t *idx, int pos, const char *string);
+
+/* Stores in *found a malloc'd list of the positions, in increasing order,
+ * whose strings may contain query, and their number in *n. Returns 0 on
+ * success, 1 if query is too short to narrow down, in which case every
+ * position is a candidate, and -1 on failure. */
+int
+trigram_candidates(const struct trigram_idx_t *idx, const char *query,
+                   int **found, size_t *n);
+
+void
+trigram_free(struct trigram_idx_t *idx);
+
+#endif
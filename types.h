@@ -10,8 +10,16 @@
 #define STRATA_IBF_SIZE 40
 #define STRATA_IBF_MIN_DEPTH 1
 
+/* Estimators of depth STRATA_IBF_MIN_DEPTH<<i are served for
+ * i < STRATA_MAX_COUNT. They are all derived from one of the largest depth. */
 #define STRATA_MAX_COUNT 5
-#define BLOOM_MAX_COUNT 10
+#define STRATA_MASTER_DEPTH (STRATA_IBF_MIN_DEPTH<<(STRATA_MAX_COUNT-1))
+/* Filters of IBF_MIN_SIZE<<i buckets are served for i < BLOOM_MAX_COUNT.
+ * They are all folded from one master filter of the largest size. */
+#define BLOOM_MAX_COUNT 12
+#define BLOOM_MASTER_SIZE (IBF_MIN_SIZE<<(BLOOM_MAX_COUNT-1))
+/* The largest filter served by peers from before the ladder grew to 12. */
+#define BLOOM_LEGACY_MAX_SIZE (IBF_MIN_SIZE<<9)
 
 #define MAX_PEERS 256
 
@@ -36,6 +44,7 @@ struct peer_t {
     int interval;
     int countdown;
     int status;
+    int riblt_skip; /* Polls left before /riblt is asked for again. */
 };
 
 struct status_t {
@@ -43,6 +52,7 @@ struct status_t {
     int alarm_int;
     int nkeys;
     struct peer_t *peers;
+    struct keydb_t *db;
 };
 
 
@@ -1,5 +1,6 @@
 #include "util.h"
 #include <stdio.h>
+#include <time.h>
 
 void
 parse_fp160(const char *buf, fp160 out) {
@@ -23,7 +24,7 @@ print_fp160(const fp160 in, char *buf) {
 
 /* Returns non-zero iff a != b. */
 int
-neq_fp160(fp160 a, fp160 b) {
+neq_fp160(const fp160 a, const fp160 b) {
     int i;
     int diff;
 
@@ -34,3 +35,9 @@ neq_fp160(fp160 a, fp160 b) {
     return diff;
 }
 
+uint64_t
+us_timestamp() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec*1000000+time.tv_nsec/1000;
+}
@@ -11,6 +11,10 @@ print_fp160(const fp160 in, char *buf);
 
 /* Returns zero iff a == b. */
 int
-neq_fp160(fp160 a, fp160 b);
+neq_fp160(const fp160 a, const fp160 b);
+
+/* Returns a monotonic timestamp in microseconds. */
+uint64_t
+us_timestamp();
 
 #endif